@@ -0,0 +1,288 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "mongo-fuse.h"
+
+/*
+ * Cache of inode attributes by path for getattr and access, which get
+ * called for every path ls, make and shells look at. Paths that don't
+ * exist are cached too, since searching PATH or include directories asks
+ * about lots of them. Entries live for attr_ttl or negative_ttl
+ * milliseconds, which bounds how long changes made by other clients can
+ * go unnoticed. Changes made through this mount remove the entries for
+ * the paths they touch right away.
+ *
+ * Like the block cache it's split into shards, each with its own lock
+ * and LRU list, picked by a hash of the path.
+ *
+ * A lookup that misses gets its shard's generation, and the attributes
+ * it then reads from the database are only cached if nothing in the
+ * shard was invalidated in the meantime. Otherwise a lookup that read
+ * the inode just before a change could cache it just after.
+ */
+
+#define ATTR_SHARDS 32
+#define ATTR_BUCKETS 512
+
+struct attr_entry {
+    struct attr_entry * next;
+    struct attr_entry * lru_prev;
+    struct attr_entry * lru_next;
+    uint64_t expires;
+    uint32_t hash;
+    int missing;
+    struct inode_attr attr;
+    size_t len;
+    char path[1];
+};
+
+struct attr_shard {
+    pthread_mutex_t lock;
+    struct attr_entry * buckets[ATTR_BUCKETS];
+    struct attr_entry * lru_head;
+    struct attr_entry * lru_tail;
+    size_t count;
+    uint64_t gen;
+};
+
+static struct attr_shard * attr_shards = NULL;
+static size_t shard_max = 0;
+static uint64_t attr_ttl = 0;
+static uint64_t negative_ttl = 0;
+
+uint64_t attr_cache_hits = 0;
+uint64_t attr_cache_negative_hits = 0;
+uint64_t attr_cache_misses = 0;
+
+void setup_attr_cache(size_t maxentries, unsigned int ttl,
+    unsigned int negttl) {
+    int i;
+
+    attr_ttl = ttl;
+    negative_ttl = negttl;
+    shard_max = maxentries / ATTR_SHARDS;
+    if(shard_max == 0 || (ttl == 0 && negttl == 0))
+        return;
+
+    attr_shards = calloc(ATTR_SHARDS, sizeof(struct attr_shard));
+    if(!attr_shards) {
+        logit(WARN, "Could not allocate attribute cache, running without it");
+        return;
+    }
+    for(i = 0; i < ATTR_SHARDS; i++)
+        pthread_mutex_init(&attr_shards[i].lock, NULL);
+}
+
+static uint64_t now_ms() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+// FNV-1a
+static uint32_t hash_path(const char * path, size_t len) {
+    uint32_t h = 2166136261u;
+    size_t i;
+    for(i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct attr_shard * get_shard(uint32_t hash) {
+    return &attr_shards[hash % ATTR_SHARDS];
+}
+
+static struct attr_entry ** get_bucket(struct attr_shard * s, uint32_t hash) {
+    return &s->buckets[(hash / ATTR_SHARDS) % ATTR_BUCKETS];
+}
+
+static void lru_unlink(struct attr_shard * s, struct attr_entry * ae) {
+    if(ae->lru_prev)
+        ae->lru_prev->lru_next = ae->lru_next;
+    else
+        s->lru_head = ae->lru_next;
+    if(ae->lru_next)
+        ae->lru_next->lru_prev = ae->lru_prev;
+    else
+        s->lru_tail = ae->lru_prev;
+    ae->lru_prev = ae->lru_next = NULL;
+}
+
+static void lru_push(struct attr_shard * s, struct attr_entry * ae) {
+    ae->lru_prev = NULL;
+    ae->lru_next = s->lru_head;
+    if(s->lru_head)
+        s->lru_head->lru_prev = ae;
+    s->lru_head = ae;
+    if(!s->lru_tail)
+        s->lru_tail = ae;
+}
+
+static struct attr_entry * find_entry(struct attr_shard * s, uint32_t hash,
+    const char * path, size_t len) {
+    struct attr_entry * ae = *get_bucket(s, hash);
+    while(ae && (ae->hash != hash || ae->len != len ||
+        memcmp(ae->path, path, len) != 0))
+        ae = ae->next;
+    return ae;
+}
+
+static void evict_entry(struct attr_shard * s, struct attr_entry * ae) {
+    struct attr_entry ** pp = get_bucket(s, ae->hash);
+    while(*pp != ae)
+        pp = &(*pp)->next;
+    *pp = ae->next;
+    lru_unlink(s, ae);
+    s->count--;
+    free(ae);
+}
+
+/*
+ * Looks up path. Returns 0 and its attributes in out if it's cached,
+ * -ENOENT if it's cached as missing, or 1 if it isn't cached. On a miss
+ * gen is what to pass attr_cache_put once the inode has been read.
+ */
+int attr_cache_get(const char * path, struct inode_attr * out,
+    uint64_t * gen) {
+    struct attr_shard * s;
+    struct attr_entry * ae;
+    size_t len = strlen(path);
+    uint32_t hash;
+    int res;
+
+    *gen = 0;
+    if(!attr_shards)
+        return 1;
+
+    hash = hash_path(path, len);
+    s = get_shard(hash);
+    pthread_mutex_lock(&s->lock);
+    ae = find_entry(s, hash, path, len);
+    if(ae && ae->expires <= now_ms()) {
+        evict_entry(s, ae);
+        ae = NULL;
+    }
+    if(!ae) {
+        *gen = s->gen;
+        pthread_mutex_unlock(&s->lock);
+        __sync_fetch_and_add(&attr_cache_misses, 1);
+        return 1;
+    }
+
+    if(ae->missing) {
+        res = -ENOENT;
+        __sync_fetch_and_add(&attr_cache_negative_hits, 1);
+    }
+    else {
+        *out = ae->attr;
+        res = 0;
+        __sync_fetch_and_add(&attr_cache_hits, 1);
+    }
+    lru_unlink(s, ae);
+    lru_push(s, ae);
+    pthread_mutex_unlock(&s->lock);
+    return res;
+}
+
+/*
+ * Caches the attributes of path, or that it's missing if attr is NULL,
+ * unless something in its shard was invalidated since attr_cache_get
+ * returned gen.
+ */
+void attr_cache_put(const char * path, const struct inode_attr * attr,
+    uint64_t gen) {
+    struct attr_shard * s;
+    struct attr_entry * ae, * old;
+    size_t len = strlen(path);
+    uint64_t ttl = attr ? attr_ttl : negative_ttl;
+    uint32_t hash;
+
+    if(!attr_shards || ttl == 0)
+        return;
+
+    if((ae = malloc(sizeof(struct attr_entry) + len)) == NULL)
+        return;
+    hash = hash_path(path, len);
+    memcpy(ae->path, path, len + 1);
+    ae->len = len;
+    ae->hash = hash;
+    ae->expires = now_ms() + ttl;
+    ae->missing = attr == NULL;
+    if(attr)
+        ae->attr = *attr;
+
+    s = get_shard(hash);
+    pthread_mutex_lock(&s->lock);
+    if(s->gen != gen) {
+        pthread_mutex_unlock(&s->lock);
+        free(ae);
+        return;
+    }
+    if((old = find_entry(s, hash, path, len)) != NULL)
+        evict_entry(s, old);
+    while(s->lru_tail && s->count >= shard_max)
+        evict_entry(s, s->lru_tail);
+
+    ae->next = *get_bucket(s, hash);
+    *get_bucket(s, hash) = ae;
+    lru_push(s, ae);
+    s->count++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+void attr_cache_invalidate(const char * path) {
+    struct attr_shard * s;
+    struct attr_entry * ae;
+    size_t len = strlen(path);
+    uint32_t hash;
+
+    if(!attr_shards)
+        return;
+
+    hash = hash_path(path, len);
+    s = get_shard(hash);
+    pthread_mutex_lock(&s->lock);
+    s->gen++;
+    if((ae = find_entry(s, hash, path, len)) != NULL)
+        evict_entry(s, ae);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Invalidates everything under the directory path, for renames that move
+ * a whole tree. Every shard can have entries under it, so every shard's
+ * generation changes too.
+ */
+void attr_cache_invalidate_tree(const char * path) {
+    struct attr_shard * s;
+    struct attr_entry * ae, * next;
+    size_t len = strlen(path);
+    int i;
+
+    if(!attr_shards)
+        return;
+
+    for(i = 0; i < ATTR_SHARDS; i++) {
+        s = &attr_shards[i];
+        pthread_mutex_lock(&s->lock);
+        s->gen++;
+        for(ae = s->lru_head; ae; ae = next) {
+            next = ae->lru_next;
+            if(ae->len > len && memcmp(ae->path, path, len) == 0 &&
+                ae->path[len] == '/')
+                evict_entry(s, ae);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+// Invalidates every path of an inode.
+void attr_cache_invalidate_inode(struct inode * e) {
+    struct dirent * cde;
+    for(cde = e->dirents; cde; cde = cde->next)
+        attr_cache_invalidate(cde->path);
+}
@@ -0,0 +1,614 @@
+#include <fuse.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "../mongo-fuse.h"
+
+/*
+ * Runs fixed workloads straight against the fuse_operations callbacks,
+ * with no kernel or mount in between, and prints one JSON object per
+ * line for each operation measured: throughput, and latency percentiles
+ * for the individual calls.
+ *
+ * Usage: fs-bench [-o options] [workload ...]
+ *
+ * Options are the mount options plus size (megabytes per file for seq,
+ * random and dedup_copy), files (small_files), entries (readdir),
+ * snap_files and copies. Every run starts from an empty database, so it
+ * drops the collections of the one named in db=, which has to have
+ * "bench" in its name. The data written comes from seed, so the same
+ * options write the same bytes every time.
+ */
+
+#define FILL_POOL (4 << 20)
+#define STAMP_EVERY 4096
+#define READDIR_PASSES 5
+#define SNAPSHOTS 3
+
+#ifndef BENCH_REV
+#define BENCH_REV "unknown"
+#endif
+
+struct bench_config {
+    unsigned int size;
+    unsigned int files;
+    unsigned int entries;
+    unsigned int snap_files;
+    unsigned int copies;
+    unsigned int seed;
+};
+
+struct result {
+    const char * workload;
+    const char * op;
+    size_t block_size;
+    size_t entries;
+    uint64_t bytes;
+    uint64_t errors;
+    double started;
+    double seconds;
+    uint64_t * lat;
+    size_t nlat;
+    size_t caplat;
+};
+
+struct workload {
+    const char * name;
+    int (*run)(const struct bench_config * cfg);
+};
+
+extern struct fuse_operations mongo_oper;
+extern mongoc_uri_t * dial_uri;
+
+static const size_t block_sizes[] = { 4096, 65536, 1 << 20 };
+#define NBLOCK_SIZES (sizeof(block_sizes) / sizeof(block_sizes[0]))
+
+static char * fill_pool = NULL;
+static size_t fill_off = 0;
+static uint64_t fill_stamp = 0;
+static uint64_t rng_state = 0;
+static int failed = 0;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, so runs don't depend on the C library's rand.
+static uint64_t next_rand() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static int setup_fill(unsigned int seed) {
+    size_t i;
+
+    rng_state = seed ? seed : 1;
+    if((fill_pool = malloc(FILL_POOL)) == NULL)
+        return -ENOMEM;
+    for(i = 0; i < FILL_POOL; i += sizeof(uint64_t)) {
+        uint64_t r = next_rand();
+        memcpy(fill_pool + i, &r, sizeof(r));
+    }
+    return 0;
+}
+
+/*
+ * Fills buf with data that doesn't compress and doesn't dedup against
+ * anything else written: pool bytes with a counter stamped every 4 KB.
+ */
+static void fill_unique(char * buf, size_t len) {
+    size_t i, n;
+
+    for(i = 0; i < len; i += n) {
+        n = len - i < FILL_POOL - fill_off ? len - i : FILL_POOL - fill_off;
+        memcpy(buf + i, fill_pool + fill_off, n);
+        fill_off = (fill_off + n) % FILL_POOL;
+    }
+    for(i = 0; i + sizeof(uint64_t) <= len; i += STAMP_EVERY) {
+        fill_stamp++;
+        memcpy(buf + i, &fill_stamp, sizeof(fill_stamp));
+    }
+}
+
+static void start_result(struct result * r, const char * workload,
+    const char * op, size_t block_size) {
+    memset(r, 0, sizeof(struct result));
+    r->workload = workload;
+    r->op = op;
+    r->block_size = block_size;
+    r->started = now();
+}
+
+// Counts one call that started at start, and how it went.
+static void record(struct result * r, double start, int res, size_t bytes) {
+    uint64_t us = (uint64_t)((now() - start) * 1e6);
+
+    if(res < 0) {
+        r->errors++;
+        return;
+    }
+    r->bytes += bytes;
+    if(r->nlat == r->caplat) {
+        size_t newcap = r->caplat ? r->caplat * 2 : 1024;
+        uint64_t * tmp = realloc(r->lat, newcap * sizeof(uint64_t));
+        if(!tmp)
+            return;
+        r->lat = tmp;
+        r->caplat = newcap;
+    }
+    r->lat[r->nlat++] = us;
+}
+
+static int cmp_u64(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct result * r, double p) {
+    size_t idx;
+
+    if(r->nlat == 0)
+        return 0;
+    idx = (size_t)(r->nlat * p + 0.999999);
+    return r->lat[idx > 0 ? idx - 1 : 0];
+}
+
+static void finish_result(struct result * r) {
+    r->seconds = now() - r->started;
+    qsort(r->lat, r->nlat, sizeof(uint64_t), cmp_u64);
+
+    printf("{\"rev\":\"%s\",\"workload\":\"%s\",\"op\":\"%s\"",
+        BENCH_REV, r->workload, r->op);
+    if(r->block_size)
+        printf(",\"block_size\":%zu", r->block_size);
+    if(r->entries)
+        printf(",\"entries\":%zu", r->entries);
+    printf(",\"ops\":%zu,\"errors\":%llu,\"bytes\":%llu,\"seconds\":%.6f,"
+        "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"p50_us\":%llu,"
+        "\"p90_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu,\"max_us\":%llu}\n",
+        r->nlat, (unsigned long long)r->errors,
+        (unsigned long long)r->bytes, r->seconds,
+        r->seconds > 0 ? r->nlat / r->seconds : 0.0,
+        r->seconds > 0 ? r->bytes / r->seconds / (1 << 20) : 0.0,
+        (unsigned long long)percentile(r, 0.5),
+        (unsigned long long)percentile(r, 0.9),
+        (unsigned long long)percentile(r, 0.99),
+        (unsigned long long)percentile(r, 0.999),
+        (unsigned long long)(r->nlat ? r->lat[r->nlat - 1] : 0));
+    fflush(stdout);
+
+    if(r->errors)
+        failed = 1;
+    free(r->lat);
+}
+
+static int bench_create(const char * path, struct fuse_file_info * fi) {
+    memset(fi, 0, sizeof(struct fuse_file_info));
+    fi->flags = O_RDWR | O_CREAT;
+    return mongo_oper.create(path, 0644, fi);
+}
+
+static int bench_open(const char * path, int flags,
+    struct fuse_file_info * fi) {
+    memset(fi, 0, sizeof(struct fuse_file_info));
+    fi->flags = flags;
+    return mongo_oper.open(path, fi);
+}
+
+static int bench_close(const char * path, struct fuse_file_info * fi) {
+    int res = mongo_oper.flush(path, fi);
+    mongo_oper.release(path, fi);
+    return res;
+}
+
+static int bench_mkdir(const char * path) {
+    int res = mongo_oper.mkdir(path, 0755);
+    if(res != 0 && res != -EEXIST) {
+        fprintf(stderr, "Could not create %s: %s\n", path, strerror(-res));
+        return res;
+    }
+    return 0;
+}
+
+// Writes a whole file of size bytes in bs sized calls.
+static int write_file(const char * path, size_t size, size_t bs,
+    char * buf, struct result * r) {
+    struct fuse_file_info fi;
+    off_t off;
+    int res;
+
+    if((res = bench_create(path, &fi)) != 0) {
+        fprintf(stderr, "Could not create %s: %s\n", path, strerror(-res));
+        return res;
+    }
+    for(off = 0; off < (off_t)size; off += bs) {
+        double start;
+
+        fill_unique(buf, bs);
+        start = now();
+        res = mongo_oper.write(path, buf, bs, off, &fi);
+        if(r)
+            record(r, start, res, bs);
+    }
+    return bench_close(path, &fi);
+}
+
+static int run_seq(const struct bench_config * cfg) {
+    size_t size = (size_t)cfg->size << 20, i;
+    struct fuse_file_info fi;
+    struct result r;
+    char path[64];
+    char * buf;
+    off_t off;
+    int res;
+
+    if((res = bench_mkdir("/seq")) != 0)
+        return res;
+    if((buf = malloc(block_sizes[NBLOCK_SIZES - 1])) == NULL)
+        return -ENOMEM;
+
+    for(i = 0; i < NBLOCK_SIZES; i++) {
+        size_t bs = block_sizes[i];
+
+        sprintf(path, "/seq/%zu", bs);
+        start_result(&r, "seq", "write", bs);
+        res = write_file(path, size, bs, buf, &r);
+        finish_result(&r);
+        if(res != 0)
+            break;
+
+        if((res = bench_open(path, O_RDONLY, &fi)) != 0)
+            break;
+        start_result(&r, "seq", "read", bs);
+        for(off = 0; off < (off_t)size; off += bs) {
+            double start = now();
+            record(&r, start, mongo_oper.read(path, buf, bs, off, &fi), bs);
+        }
+        bench_close(path, &fi);
+        finish_result(&r);
+    }
+    free(buf);
+    return res;
+}
+
+static int run_random(const struct bench_config * cfg) {
+    size_t size = (size_t)cfg->size << 20, i, n;
+    struct fuse_file_info fi;
+    struct result r;
+    char path[64];
+    char * buf;
+    int res;
+
+    if((res = bench_mkdir("/random")) != 0)
+        return res;
+    if((buf = malloc(block_sizes[NBLOCK_SIZES - 1])) == NULL)
+        return -ENOMEM;
+
+    for(i = 0; i < NBLOCK_SIZES; i++) {
+        size_t bs = block_sizes[i], nblocks = size / bs;
+
+        sprintf(path, "/random/%zu", bs);
+        if(nblocks == 0 || (res = write_file(path, size, bs, buf, NULL)) != 0)
+            break;
+
+        if((res = bench_open(path, O_RDWR, &fi)) != 0)
+            break;
+        start_result(&r, "random", "write", bs);
+        for(n = 0; n < nblocks; n++) {
+            off_t off = (next_rand() % nblocks) * bs;
+            double start;
+
+            fill_unique(buf, bs);
+            start = now();
+            record(&r, start, mongo_oper.write(path, buf, bs, off, &fi), bs);
+        }
+        bench_close(path, &fi);
+        finish_result(&r);
+
+        if((res = bench_open(path, O_RDONLY, &fi)) != 0)
+            break;
+        start_result(&r, "random", "read", bs);
+        for(n = 0; n < nblocks; n++) {
+            off_t off = (next_rand() % nblocks) * bs;
+            double start = now();
+            record(&r, start, mongo_oper.read(path, buf, bs, off, &fi), bs);
+        }
+        bench_close(path, &fi);
+        finish_result(&r);
+    }
+    free(buf);
+    return res;
+}
+
+static int run_small_files(const struct bench_config * cfg) {
+    struct fuse_file_info fi;
+    struct stat st;
+    struct result r;
+    char path[64], buf[STAMP_EVERY];
+    unsigned int n;
+    int res;
+
+    if((res = bench_mkdir("/small")) != 0)
+        return res;
+
+    start_result(&r, "small_files", "create", sizeof(buf));
+    for(n = 0; n < cfg->files; n++) {
+        double start;
+
+        sprintf(path, "/small/%u", n);
+        fill_unique(buf, sizeof(buf));
+        start = now();
+        if((res = bench_create(path, &fi)) == 0) {
+            if((res = mongo_oper.write(path, buf, sizeof(buf), 0, &fi)) >= 0)
+                res = bench_close(path, &fi);
+            else
+                bench_close(path, &fi);
+        }
+        record(&r, start, res, sizeof(buf));
+    }
+    finish_result(&r);
+
+    start_result(&r, "small_files", "stat", 0);
+    for(n = 0; n < cfg->files; n++) {
+        double start;
+
+        sprintf(path, "/small/%u", n);
+        start = now();
+        record(&r, start, mongo_oper.getattr(path, &st), 0);
+    }
+    finish_result(&r);
+
+    start_result(&r, "small_files", "unlink", 0);
+    for(n = 0; n < cfg->files; n++) {
+        double start;
+
+        sprintf(path, "/small/%u", n);
+        start = now();
+        record(&r, start, mongo_oper.unlink(path), 0);
+    }
+    finish_result(&r);
+    return 0;
+}
+
+static int count_entry(void * buf, const char * name,
+    const struct stat * st, off_t off) {
+    (*(size_t*)buf)++;
+    return 0;
+}
+
+static int run_readdir(const struct bench_config * cfg) {
+    struct fuse_file_info fi;
+    struct result r;
+    char path[64];
+    unsigned int n;
+    int res;
+
+    if((res = bench_mkdir("/readdir")) != 0)
+        return res;
+    for(n = 0; n < cfg->entries; n++) {
+        sprintf(path, "/readdir/%u", n);
+        if((res = bench_create(path, &fi)) != 0) {
+            fprintf(stderr, "Could not create %s: %s\n", path, strerror(-res));
+            return res;
+        }
+        bench_close(path, &fi);
+    }
+
+    start_result(&r, "readdir", "readdir", 0);
+    for(n = 0; n < READDIR_PASSES; n++) {
+        size_t seen = 0;
+        double start;
+
+        memset(&fi, 0, sizeof(fi));
+        start = now();
+        res = mongo_oper.readdir("/readdir", &seen, count_entry, 0, &fi);
+        record(&r, start, res, 0);
+        r.entries = seen;
+    }
+    finish_result(&r);
+    return 0;
+}
+
+static int run_snapshot(const struct bench_config * cfg) {
+    size_t size = (size_t)cfg->size << 20;
+    struct result r;
+    char path[64];
+    char * buf;
+    unsigned int n;
+    int res = 0;
+
+    if((res = bench_mkdir("/snapshot")) != 0)
+        return res;
+    if((buf = malloc(MAX_BLOCK_SIZE)) == NULL)
+        return -ENOMEM;
+    for(n = 0; n < cfg->snap_files && res == 0; n++) {
+        sprintf(path, "/snapshot/%u", n);
+        res = write_file(path, size / cfg->snap_files + MAX_BLOCK_SIZE,
+            MAX_BLOCK_SIZE, buf, NULL);
+    }
+    free(buf);
+    if(res != 0)
+        return res;
+
+    // Snapshots are named by the second they're taken in, so they're a
+    // second apart. The waiting doesn't count.
+    start_result(&r, "snapshot", "snapshot", 0);
+    r.entries = cfg->snap_files;
+    for(n = 0; n < SNAPSHOTS; n++) {
+        double start;
+
+        sleep(1);
+        r.started += 1;
+        start = now();
+        record(&r, start, mongo_oper.utimens("/snapshot/.snapshot", NULL), 0);
+    }
+    finish_result(&r);
+    return 0;
+}
+
+static int run_dedup_copy(const struct bench_config * cfg) {
+    size_t size = (size_t)cfg->size << 20;
+    const size_t bs = MAX_BLOCK_SIZE;
+    struct fuse_file_info src, dst;
+    struct result r;
+    char path[64];
+    char * buf;
+    unsigned int n;
+    off_t off;
+    int res;
+
+    if((res = bench_mkdir("/dedup")) != 0)
+        return res;
+    if((buf = malloc(bs)) == NULL)
+        return -ENOMEM;
+    if((res = write_file("/dedup/source", size, bs, buf, NULL)) != 0 ||
+        (res = bench_open("/dedup/source", O_RDONLY, &src)) != 0) {
+        free(buf);
+        return res;
+    }
+
+    start_result(&r, "dedup_copy", "copy", bs);
+    for(n = 0; n < cfg->copies; n++) {
+        sprintf(path, "/dedup/copy-%u", n);
+        if((res = bench_create(path, &dst)) != 0) {
+            r.errors++;
+            continue;
+        }
+        for(off = 0; off < (off_t)size; off += bs) {
+            double start = now();
+            res = mongo_oper.read("/dedup/source", buf, bs, off, &src);
+            if(res > 0)
+                res = mongo_oper.write(path, buf, res, off, &dst);
+            record(&r, start, res, res > 0 ? res : 0);
+        }
+        bench_close(path, &dst);
+    }
+    finish_result(&r);
+
+    bench_close("/dedup/source", &src);
+    free(buf);
+    return 0;
+}
+
+static const struct workload workloads[] = {
+    { "seq", run_seq },
+    { "random", run_random },
+    { "small_files", run_small_files },
+    { "readdir", run_readdir },
+    { "snapshot", run_snapshot },
+    { "dedup_copy", run_dedup_copy },
+    { NULL, NULL }
+};
+
+// Empties the benchmark database so every run starts the same way.
+static int reset_database() {
+    const char * db = mongoc_uri_get_database(dial_uri);
+    bson_error_t dberr;
+    int i;
+
+    if(!db || strstr(db, "bench") == NULL) {
+        fprintf(stderr, "Refusing to drop %s, use a database with "
+            "\"bench\" in its name\n", db ? db : "the database");
+        return -EINVAL;
+    }
+    for(i = 0; i < COLL_MAX; i++) {
+        if(!mongoc_collection_drop(get_coll(i), &dberr) &&
+            strstr(dberr.message, "ns not found") == NULL) {
+            fprintf(stderr, "Could not empty %s: %s\n", db, dberr.message);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+static int run_workload(const struct workload * w,
+    const struct bench_config * cfg) {
+    int res = w->run(cfg);
+    if(res != 0) {
+        fprintf(stderr, "%s failed: %s\n", w->name, strerror(-res));
+        failed = 1;
+    }
+    return res;
+}
+
+#define BENCH_OPT(t, p) { t, offsetof(struct bench_config, p), 0 }
+
+int main(int argc, char ** argv) {
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    struct fuse_conn_info conn;
+    struct bench_config cfg;
+    const struct workload * w;
+    int i, ran = 0;
+
+    static struct fuse_opt bench_opts[] = {
+        BENCH_OPT("size=%u", size),
+        BENCH_OPT("files=%u", files),
+        BENCH_OPT("entries=%u", entries),
+        BENCH_OPT("snap_files=%u", snap_files),
+        BENCH_OPT("copies=%u", copies),
+        BENCH_OPT("seed=%u", seed),
+        FUSE_OPT_END
+    };
+
+    cfg.size = 64;
+    cfg.files = 2000;
+    cfg.entries = 10000;
+    cfg.snap_files = 64;
+    cfg.copies = 4;
+    cfg.seed = 1;
+
+    // Goes first so a db= given on the command line wins.
+    for(i = 0; i < argc; i++)
+        fuse_opt_add_arg(&args, argv[i]);
+    fuse_opt_insert_arg(&args, 1, "-odb=mongodb://localhost/mongofuse-bench");
+    fuse_opt_parse(&args, &cfg, bench_opts, NULL);
+    if(cfg.size == 0 || cfg.snap_files == 0) {
+        fprintf(stderr, "size and snap_files have to be at least 1\n");
+        return 1;
+    }
+    parse_args(&args);
+    setup_threading();
+
+    // There's no FUSE session, so like the low-level front end outside of
+    // a request, everything is done as whoever runs the benchmark.
+    use_lowlevel = 1;
+
+    if(setup_fill(cfg.seed) != 0 || reset_database() != 0)
+        return 1;
+    memset(&conn, 0, sizeof(conn));
+    mongo_oper.init(&conn);
+
+    for(i = 1; i < args.argc; i++) {
+        if(args.argv[i][0] == '-')
+            continue;
+        for(w = workloads; w->name; w++) {
+            if(strcmp(w->name, args.argv[i]) == 0)
+                break;
+        }
+        if(!w->name) {
+            fprintf(stderr, "Unknown workload %s\n", args.argv[i]);
+            failed = 1;
+            continue;
+        }
+        run_workload(w, &cfg);
+        ran++;
+    }
+    if(ran == 0 && !failed) {
+        for(w = workloads; w->name; w++)
+            run_workload(w, &cfg);
+    }
+
+    mongo_oper.destroy(NULL);
+    fuse_opt_free_args(&args);
+    free(fill_pool);
+    return failed;
+}
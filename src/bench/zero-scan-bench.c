@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mongo-fuse.h"
+
+/*
+ * Times every zero scan kernel the CPU supports against 64 KiB blocks
+ * with different amounts of zero padding, and checks they all agree
+ * with the scalar one. Usage: zero-scan-bench [iterations]
+ */
+
+#define BLOCK_SIZE MAX_BLOCK_SIZE
+
+struct pattern {
+    const char * name;
+    size_t start;
+    size_t end;
+};
+
+static const struct pattern patterns[] = {
+    { "all zeros", 0, 0 },
+    { "dense", 0, BLOCK_SIZE },
+    { "short tail", 0, 4093 },
+    { "zero padded", 20011, 45007 },
+    { "one byte", 32769, 32770 },
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill(char * buf, const struct pattern * p) {
+    size_t i;
+
+    memset(buf, 0, BLOCK_SIZE);
+    for(i = p->start; i < p->end; i++)
+        buf[i] = (rand() % 255) + 1;
+}
+
+static double time_kernel(const struct zero_scan_kernel * k,
+    const char * buf, long iters, size_t * sum) {
+    size_t start, end;
+    double t = now();
+    long n;
+
+    for(n = 0; n < iters; n++) {
+        k->scan(buf, BLOCK_SIZE, &start, &end);
+        *sum += end;
+    }
+    return now() - t;
+}
+
+int main(int argc, char ** argv) {
+    const struct zero_scan_kernel * k, * scalar = NULL;
+    const size_t npatterns = sizeof(patterns) / sizeof(patterns[0]);
+    long iters = argc > 1 ? atol(argv[1]) : 20000;
+    char * buf = malloc(BLOCK_SIZE);
+    size_t i, sum = 0;
+    int failed = 0;
+
+    if(!buf)
+        return 1;
+    for(k = zero_scan_kernels; k->name; k++) {
+        if(strcmp(k->name, "scalar") == 0)
+            scalar = k;
+    }
+
+    printf("%-12s %-10s %10s %10s\n", "pattern", "kernel", "GB/s", "speedup");
+    for(i = 0; i < npatterns; i++) {
+        size_t sstart, send, start, end;
+        double base;
+
+        fill(buf, &patterns[i]);
+        scalar->scan(buf, BLOCK_SIZE, &sstart, &send);
+        base = time_kernel(scalar, buf, iters, &sum);
+
+        for(k = zero_scan_kernels; k->name; k++) {
+            double secs;
+
+            if(!k->supported())
+                continue;
+            k->scan(buf, BLOCK_SIZE, &start, &end);
+            if(start != sstart || end != send) {
+                printf("%s disagrees with scalar on %s: %zu-%zu vs %zu-%zu\n",
+                    k->name, patterns[i].name, start, end, sstart, send);
+                failed = 1;
+            }
+
+            secs = k == scalar ? base : time_kernel(k, buf, iters, &sum);
+            printf("%-12s %-10s %10.2f %9.2fx\n", patterns[i].name, k->name,
+                (double)BLOCK_SIZE * iters / secs / 1e9, base / secs);
+        }
+    }
+
+    // Print the checksum so the compiler can't drop the scans.
+    printf("checksum %zu\n", sum);
+    free(buf);
+    return failed;
+}
@@ -0,0 +1,172 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mongo-fuse.h"
+
+/*
+ * Blocks are content-addressed and never change once written, so this
+ * cache never has to invalidate anything. It's split into shards, each
+ * with its own lock and LRU list, so FUSE threads reading different blocks
+ * don't contend with each other. The shard is picked from the first byte
+ * of the hash, which is uniformly distributed.
+ */
+
+#define CACHE_SHARDS 64
+#define CACHE_BUCKETS 1024
+
+struct cache_entry {
+    struct cache_entry * next;
+    struct cache_entry * lru_prev;
+    struct cache_entry * lru_next;
+    uint8_t hash[HASH_LEN];
+    size_t len;
+    char data[1];
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_entry * buckets[CACHE_BUCKETS];
+    struct cache_entry * lru_head;
+    struct cache_entry * lru_tail;
+    size_t bytes;
+};
+
+static struct cache_shard * shards = NULL;
+static size_t shard_limit = 0;
+
+void setup_block_cache(size_t maxbytes) {
+    int i;
+
+    shard_limit = maxbytes / CACHE_SHARDS;
+    if(shard_limit < MAX_BLOCK_SIZE)
+        return;
+
+    shards = calloc(CACHE_SHARDS, sizeof(struct cache_shard));
+    if(!shards) {
+        logit(WARN, "Could not allocate block cache, running without it");
+        return;
+    }
+    for(i = 0; i < CACHE_SHARDS; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+static struct cache_shard * get_shard(const uint8_t hash[HASH_LEN]) {
+    return &shards[hash[0] % CACHE_SHARDS];
+}
+
+static size_t get_bucket(const uint8_t hash[HASH_LEN]) {
+    uint32_t h;
+    memcpy(&h, hash + 1, sizeof(h));
+    return h % CACHE_BUCKETS;
+}
+
+static void lru_unlink(struct cache_shard * s, struct cache_entry * ce) {
+    if(ce->lru_prev)
+        ce->lru_prev->lru_next = ce->lru_next;
+    else
+        s->lru_head = ce->lru_next;
+    if(ce->lru_next)
+        ce->lru_next->lru_prev = ce->lru_prev;
+    else
+        s->lru_tail = ce->lru_prev;
+    ce->lru_prev = ce->lru_next = NULL;
+}
+
+static void lru_push(struct cache_shard * s, struct cache_entry * ce) {
+    ce->lru_prev = NULL;
+    ce->lru_next = s->lru_head;
+    if(s->lru_head)
+        s->lru_head->lru_prev = ce;
+    s->lru_head = ce;
+    if(!s->lru_tail)
+        s->lru_tail = ce;
+}
+
+static struct cache_entry * find_entry(struct cache_shard * s,
+    const uint8_t hash[HASH_LEN]) {
+    struct cache_entry * ce = s->buckets[get_bucket(hash)];
+    while(ce && memcmp(ce->hash, hash, HASH_LEN) != 0)
+        ce = ce->next;
+    return ce;
+}
+
+static void evict_entry(struct cache_shard * s, struct cache_entry * ce) {
+    struct cache_entry ** pp = &s->buckets[get_bucket(ce->hash)];
+    while(*pp != ce)
+        pp = &(*pp)->next;
+    *pp = ce->next;
+    lru_unlink(s, ce);
+    s->bytes -= ce->len;
+    free(ce);
+}
+
+/*
+ * Copies len bytes starting at off within the cached block into out.
+ * Anything past the end of the cached block reads as zeros. A zero len
+ * just checks whether the block is cached. Returns -ENOENT if it isn't.
+ */
+int block_cache_get(const uint8_t hash[HASH_LEN], char * out,
+    size_t off, size_t len) {
+    struct cache_shard * s;
+    struct cache_entry * ce;
+    size_t tocopy = 0;
+
+    if(!shards)
+        return -ENOENT;
+
+    s = get_shard(hash);
+    pthread_mutex_lock(&s->lock);
+    ce = find_entry(s, hash);
+    if(!ce) {
+        pthread_mutex_unlock(&s->lock);
+        return -ENOENT;
+    }
+
+    if(off < ce->len)
+        tocopy = ce->len - off > len ? len : ce->len - off;
+    if(tocopy > 0)
+        memcpy(out, ce->data + off, tocopy);
+    lru_unlink(s, ce);
+    lru_push(s, ce);
+    pthread_mutex_unlock(&s->lock);
+
+    if(tocopy < len)
+        memset(out + tocopy, 0, len - tocopy);
+    return 0;
+}
+
+void block_cache_put(const uint8_t hash[HASH_LEN], const char * data,
+    size_t len) {
+    struct cache_shard * s;
+    struct cache_entry * ce;
+    size_t bucket;
+
+    if(!shards || len > shard_limit)
+        return;
+
+    ce = malloc(sizeof(struct cache_entry) + len);
+    if(!ce)
+        return;
+    memcpy(ce->hash, hash, HASH_LEN);
+    memcpy(ce->data, data, len);
+    ce->len = len;
+
+    s = get_shard(hash);
+    bucket = get_bucket(hash);
+    pthread_mutex_lock(&s->lock);
+    if(find_entry(s, hash) != NULL) {
+        pthread_mutex_unlock(&s->lock);
+        free(ce);
+        return;
+    }
+
+    while(s->lru_tail && s->bytes + len > shard_limit)
+        evict_entry(s, s->lru_tail);
+
+    ce->next = s->buckets[bucket];
+    s->buckets[bucket] = ce;
+    lru_push(s, ce);
+    s->bytes += len;
+    pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mongo-fuse.h"
+
+/*
+ * Content-defined chunking with FastCDC. Instead of cutting blocks at
+ * fixed offsets, the write-back buffer is cut wherever a rolling gear
+ * hash of the data hits a mask, so inserting or removing bytes only
+ * changes the chunks around the edit and everything after it still
+ * dedups against the old version of the file.
+ *
+ * No cut is made in the first cdc_min bytes of a chunk. Up to cdc_avg a
+ * mask with more bits makes cuts less likely, after that one with fewer
+ * bits makes them more likely, which keeps chunk sizes close to cdc_avg.
+ * Chunks are never longer than cdc_max. The gear table comes from a
+ * fixed seed, so every client cuts the same data in the same places.
+ */
+
+#define GEAR_SEED 0x6d6f6e676f667573ULL
+
+int chunk_mode = CHUNK_FIXED;
+static uint64_t gear[256];
+static size_t cdc_min, cdc_avg, cdc_max;
+static uint64_t mask_small, mask_large;
+
+static uint64_t splitmix64(uint64_t * state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// The fingerprint shifts left, so its top bits depend on the most bytes.
+static uint64_t top_bits(int bits) {
+    return ((1ULL << bits) - 1) << (64 - bits);
+}
+
+/*
+ * Turns on content-defined chunking with the given chunk sizes in bytes.
+ * avg is rounded down to a power of two. Returns -EINVAL if the sizes
+ * don't make sense.
+ */
+int setup_chunking(size_t min, size_t avg, size_t max) {
+    uint64_t state = GEAR_SEED;
+    int i, bits = 0;
+
+    if(min == 0 || min >= avg || avg >= max || max > MAX_BLOCK_SIZE)
+        return -EINVAL;
+
+    while(((size_t)2 << bits) <= avg)
+        bits++;
+    cdc_min = min;
+    cdc_avg = (size_t)1 << bits;
+    cdc_max = max;
+    mask_small = top_bits(bits + 1);
+    mask_large = top_bits(bits - 1);
+
+    for(i = 0; i < 256; i++)
+        gear[i] = splitmix64(&state);
+    chunk_mode = CHUNK_CDC;
+    return 0;
+}
+
+/*
+ * Looks for the end of the chunk that starts at buf. scan and fp carry
+ * the search over between calls as more data is appended, and should be
+ * zero for a new chunk. Returns the length of the chunk, or 0 if there
+ * isn't enough data yet to find where it ends.
+ */
+size_t cdc_next_cut(const char * buf, size_t len, size_t * scan, uint64_t * fp) {
+    const unsigned char * p = (const unsigned char *)buf;
+    size_t i = *scan, normal = cdc_avg, n = len;
+    uint64_t h = *fp;
+
+    if(n > cdc_max)
+        n = cdc_max;
+    if(normal > n)
+        normal = n;
+    if(i < cdc_min)
+        i = cdc_min;
+
+    for(; i < normal; i++) {
+        h = (h << 1) + gear[p[i]];
+        if(!(h & mask_small))
+            return i + 1;
+    }
+    for(; i < n; i++) {
+        h = (h << 1) + gear[p[i]];
+        if(!(h & mask_large))
+            return i + 1;
+    }
+
+    if(n == cdc_max)
+        return cdc_max;
+    *scan = i;
+    *fp = h;
+    return 0;
+}
@@ -0,0 +1,223 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include "mongo-fuse.h"
+#include <snappy-c.h>
+#include <lz4.h>
+#include <zstd.h>
+
+/*
+ * Block compression. Every block document records the codec its data was
+ * stored with in its codec field; documents without one predate codecs
+ * and are snappy. New blocks use block_codec, except that blocks which
+ * don't shrink by at least min_gain percent are stored raw, since
+ * decompressing them would only cost CPU on every read. For larger blocks
+ * a sample from the middle is compressed first so incompressible data
+ * like media or encrypted files is spotted without compressing the whole
+ * block.
+ */
+
+#define SAMPLE_LEN 4096
+
+struct codec_impl {
+    const char * name;
+    int (*compress)(const char * in, size_t len, char * out, size_t cap,
+        size_t * outlen);
+    int (*uncompress)(const char * in, size_t len, char * out, size_t * outlen);
+};
+
+static int block_codec = CODEC_SNAPPY;
+static int zstd_level = 3;
+static unsigned int min_gain = 10;
+static pthread_key_t zstd_key;
+
+static int raw_compress(const char * in, size_t len, char * out, size_t cap,
+    size_t * outlen) {
+    if(len > cap)
+        return -1;
+    memcpy(out, in, len);
+    *outlen = len;
+    return 0;
+}
+
+static int raw_uncompress(const char * in, size_t len, char * out,
+    size_t * outlen) {
+    if(len > *outlen)
+        return -1;
+    memcpy(out, in, len);
+    *outlen = len;
+    return 0;
+}
+
+static int snappy_compress_block(const char * in, size_t len, char * out,
+    size_t cap, size_t * outlen) {
+    *outlen = cap;
+    return snappy_compress(in, len, out, outlen) == SNAPPY_OK ? 0 : -1;
+}
+
+static int snappy_uncompress_block(const char * in, size_t len, char * out,
+    size_t * outlen) {
+    return snappy_uncompress(in, len, out, outlen) == SNAPPY_OK ? 0 : -1;
+}
+
+static int lz4_compress_block(const char * in, size_t len, char * out,
+    size_t cap, size_t * outlen) {
+    int res = LZ4_compress_default(in, out, len, cap);
+    if(res <= 0)
+        return -1;
+    *outlen = res;
+    return 0;
+}
+
+static int lz4_uncompress_block(const char * in, size_t len, char * out,
+    size_t * outlen) {
+    int res = LZ4_decompress_safe(in, out, len, *outlen);
+    if(res < 0)
+        return -1;
+    *outlen = res;
+    return 0;
+}
+
+// Compression contexts are expensive to set up, so each thread keeps one.
+static ZSTD_CCtx * get_zstd_ctx() {
+    ZSTD_CCtx * ctx = pthread_getspecific(zstd_key);
+    if(ctx)
+        return ctx;
+    ctx = ZSTD_createCCtx();
+    if(ctx)
+        pthread_setspecific(zstd_key, ctx);
+    return ctx;
+}
+
+static void free_zstd_ctx(void * p) {
+    ZSTD_freeCCtx((ZSTD_CCtx*)p);
+}
+
+static int zstd_compress_block(const char * in, size_t len, char * out,
+    size_t cap, size_t * outlen) {
+    ZSTD_CCtx * ctx = get_zstd_ctx();
+    size_t res;
+
+    if(!ctx)
+        return -1;
+    res = ZSTD_compressCCtx(ctx, out, cap, in, len, zstd_level);
+    if(ZSTD_isError(res))
+        return -1;
+    *outlen = res;
+    return 0;
+}
+
+static int zstd_uncompress_block(const char * in, size_t len, char * out,
+    size_t * outlen) {
+    size_t res = ZSTD_decompress(out, *outlen, in, len);
+    if(ZSTD_isError(res))
+        return -1;
+    *outlen = res;
+    return 0;
+}
+
+static const struct codec_impl codecs[CODEC_MAX] = {
+    { "raw", raw_compress, raw_uncompress },
+    { "snappy", snappy_compress_block, snappy_uncompress_block },
+    { "lz4", lz4_compress_block, lz4_uncompress_block },
+    { "zstd", zstd_compress_block, zstd_uncompress_block },
+};
+
+/*
+ * Sets the codec for new blocks by name, the zstd level, and the smallest
+ * gain in percent worth compressing for. Returns -EINVAL for an unknown
+ * codec or level.
+ */
+int setup_codec(const char * name, int level, unsigned int mingain) {
+    int i;
+
+    pthread_key_create(&zstd_key, free_zstd_ctx);
+    min_gain = mingain;
+
+    if(level < ZSTD_minCLevel() || level > ZSTD_maxCLevel())
+        return -EINVAL;
+    zstd_level = level;
+
+    if(name == NULL)
+        return 0;
+    for(i = 0; i < CODEC_MAX; i++) {
+        if(strcasecmp(name, codecs[i].name) == 0) {
+            block_codec = i;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+static int worth_compressing(size_t len, size_t complen) {
+    return complen * 100 <= len * (100 - min_gain);
+}
+
+static int compress_with_codec(const char * in, size_t len, char * out,
+    size_t cap, size_t * outlen) {
+    const struct codec_impl * c = &codecs[block_codec];
+    size_t complen;
+
+    if(block_codec == CODEC_RAW || min_gain >= 100)
+        goto raw;
+
+    if(len >= SAMPLE_LEN * 4) {
+        const char * sample = in + (len - SAMPLE_LEN) / 2;
+        if(c->compress(sample, SAMPLE_LEN, out, cap, &complen) != 0)
+            return -EIO;
+        if(!worth_compressing(SAMPLE_LEN, complen))
+            goto raw;
+    }
+
+    if(c->compress(in, len, out, cap, &complen) != 0) {
+        logit(ERROR, "Error compressing block with %s", c->name);
+        return -EIO;
+    }
+    if(worth_compressing(len, complen)) {
+        *outlen = complen;
+        return block_codec;
+    }
+
+raw:
+    if(raw_compress(in, len, out, cap, outlen) != 0)
+        return -EIO;
+    return CODEC_RAW;
+}
+
+/*
+ * Compresses len bytes of in into out, which holds cap bytes, and returns
+ * the codec it used or a negative errno.
+ */
+int compress_data(const char * in, size_t len, char * out, size_t cap,
+    size_t * outlen) {
+    uint64_t start = stats_start();
+    int res = compress_with_codec(in, len, out, cap, outlen);
+    stats_end(STAT_COMPRESS, start);
+    return res;
+}
+
+/*
+ * Uncompresses data stored with codec into out. outlen is the size of
+ * out going in and the uncompressed length coming out.
+ */
+int uncompress_data(int codec, const char * in, size_t len, char * out,
+    size_t * outlen) {
+    uint64_t start;
+    int res;
+
+    if(codec < 0 || codec >= CODEC_MAX) {
+        logit(ERROR, "Block stored with unknown codec %d", codec);
+        return -EIO;
+    }
+    start = stats_start();
+    res = codecs[codec].uncompress(in, len, out, outlen);
+    trace_docs(0, *outlen);
+    stats_end(STAT_DECOMPRESS, start);
+    if(res != 0) {
+        logit(ERROR, "Error uncompressing block with %s", codecs[codec].name);
+        return -EIO;
+    }
+    return 0;
+}
@@ -0,0 +1,608 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "mongo-fuse.h"
+
+/*
+ * Extent compaction. Every flush of a file inserts new extent documents
+ * and only removes the older ones they completely cover, so files that
+ * get lots of random writes pile up overlapping documents that every
+ * read has to fetch and replay. Compaction rewrites all of a file's
+ * extent documents as the smallest set of non-overlapping ones and then
+ * removes exactly the documents it read.
+ *
+ * Readers let documents with bigger _ids win, so the new documents get
+ * _ids just above the newest one they replace: the same timestamp with
+ * everything after it maxed out. A file is only compacted once its
+ * newest document is COMPACT_SETTLE seconds old, forced or not, so
+ * anything written during or after compaction gets a bigger _id and
+ * still wins.
+ * Truncates are the one thing that could make the new documents wrong.
+ * They change extgen on the inode, as does every flush, so if extgen
+ * changes while we're working the new documents are removed again and
+ * the file is retried later. Finishing a compaction changes extgen too,
+ * so other clients reload their extent maps.
+ *
+ * The new _ids are worked out from the old ones, so two compactions of
+ * the same file would write the same _ids and could remove each other's
+ * documents. Whoever compacts a file first takes a lease on it by
+ * setting compacting on the inode, and everyone else leaves it alone
+ * until that's cleared or has expired.
+ *
+ * serialize_extent queues every file it writes, and a background thread
+ * checks the queue every compact_interval seconds for files with at
+ * least compact_min_docs extent documents. Setting the
+ * user.mongofuse.compact xattr on a file compacts it right away.
+ */
+
+#define COMPACT_QUEUE_LEN 256
+#define COMPACT_SETTLE 5
+#define COMPACT_FORCE_TRIES 3
+#define COMPACT_DOC_NODES 4096
+#define REMOVE_BATCH 1000
+#define COMPACT_LEASE 600
+#define DUPLICATE_KEY 11000
+
+static bson_oid_t compact_queue[COMPACT_QUEUE_LEN];
+static size_t compact_count = 0;
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static int compact_interval = 0;
+static int64_t compact_min_docs = 0;
+
+uint64_t compact_runs = 0;
+uint64_t compact_aborts = 0;
+uint64_t compact_docs_before = 0;
+uint64_t compact_docs_after = 0;
+
+void setup_compaction(int interval, int mindocs) {
+    compact_interval = interval;
+    compact_min_docs = mindocs;
+}
+
+void note_extents_written(const bson_oid_t * oid) {
+    size_t i;
+
+    if(compact_interval == 0)
+        return;
+    pthread_mutex_lock(&compact_lock);
+    for(i = 0; i < compact_count; i++) {
+        if(bson_oid_equal(&compact_queue[i], oid))
+            break;
+    }
+    if(i == compact_count && compact_count < COMPACT_QUEUE_LEN)
+        bson_oid_copy(oid, &compact_queue[compact_count++]);
+    pthread_mutex_unlock(&compact_lock);
+}
+
+static int get_extgen(const bson_oid_t * oid, bson_oid_t * gen) {
+    mongoc_collection_t * coll = get_coll(COLL_INODES);
+    mongoc_cursor_t * curs;
+    const bson_t * doc;
+    bson_t query, fields;
+    bson_iter_t iter;
+    bson_error_t dberr;
+    int res = 0;
+
+    bson_init(&query);
+    bson_append_oid(&query, KEYEXP("_id"), oid);
+    bson_init(&fields);
+    bson_append_int32(&fields, KEYEXP("extgen"), 1);
+
+    curs = mongoc_collection_find(coll,
+        MONGOC_QUERY_NONE,
+        0, // skip
+        1, // limit
+        0, // batch size
+        &query,
+        &fields,
+        NULL); // read prefs
+
+    bson_destroy(&query);
+    bson_destroy(&fields);
+
+    if(!curs)
+        return -EIO;
+
+    memset(gen, 0, sizeof(bson_oid_t));
+    if(mongoc_cursor_next(curs, &doc)) {
+        if(bson_iter_init_find(&iter, doc, "extgen") &&
+            bson_iter_type(&iter) == BSON_TYPE_OID)
+            bson_oid_copy(bson_iter_oid(&iter), gen);
+    }
+    else if(mongoc_cursor_error(curs, &dberr)) {
+        logit(ERROR, "Error getting extent generation: %s", dberr.message);
+        res = -EIO;
+    }
+    else
+        res = -ENOENT;
+    mongoc_cursor_destroy(curs);
+    return res;
+}
+
+/*
+ * Takes the compaction lease on an inode, if nobody else holds one that
+ * hasn't expired. Returns -EAGAIN if somebody does.
+ */
+static int take_lease(const bson_oid_t * oid, const bson_oid_t * token) {
+    mongoc_collection_t * coll = get_coll(COLL_INODES);
+    bson_t query, orlist, clause, cond, update, set, lease, reply;
+    bson_iter_t iter;
+    bson_error_t dberr;
+    const time_t now = time(NULL);
+    int res = -EAGAIN;
+
+    bson_init(&query);
+    bson_append_oid(&query, KEYEXP("_id"), oid);
+    bson_append_array_begin(&query, KEYEXP("$or"), &orlist);
+    bson_append_document_begin(&orlist, KEYEXP("0"), &clause);
+    bson_append_document_begin(&clause, KEYEXP("compacting"), &cond);
+    bson_append_bool(&cond, KEYEXP("$exists"), false);
+    bson_append_document_end(&clause, &cond);
+    bson_append_document_end(&orlist, &clause);
+    bson_append_document_begin(&orlist, KEYEXP("1"), &clause);
+    bson_append_document_begin(&clause, KEYEXP("compacting.until"), &cond);
+    bson_append_time_t(&cond, KEYEXP("$lt"), now);
+    bson_append_document_end(&clause, &cond);
+    bson_append_document_end(&orlist, &clause);
+    bson_append_array_end(&query, &orlist);
+
+    bson_init(&update);
+    bson_append_document_begin(&update, KEYEXP("$set"), &set);
+    bson_append_document_begin(&set, KEYEXP("compacting"), &lease);
+    bson_append_oid(&lease, KEYEXP("by"), token);
+    bson_append_time_t(&lease, KEYEXP("until"), now + COMPACT_LEASE);
+    bson_append_document_end(&set, &lease);
+    bson_append_document_end(&update, &set);
+
+    if(!mongoc_collection_find_and_modify(coll,
+        &query,
+        NULL, // sort
+        &update,
+        NULL, // fields
+        false, // remove
+        false, // upsert
+        false, // new
+        &reply,
+        &dberr)) {
+        logit(WARN, "Error taking compaction lease: %s", dberr.message);
+        res = -EIO;
+    }
+    else if(bson_iter_init_find(&iter, &reply, "value") &&
+        bson_iter_type(&iter) == BSON_TYPE_DOCUMENT)
+        res = 0;
+
+    bson_destroy(&query);
+    bson_destroy(&update);
+    bson_destroy(&reply);
+    return res;
+}
+
+// Gives the lease back, unless it expired and somebody else has it now.
+static void release_lease(const bson_oid_t * oid, const bson_oid_t * token) {
+    bson_t cond, update, unset;
+    bson_error_t dberr;
+
+    bson_init(&cond);
+    bson_append_oid(&cond, KEYEXP("_id"), oid);
+    bson_append_oid(&cond, KEYEXP("compacting.by"), token);
+
+    bson_init(&update);
+    bson_append_document_begin(&update, KEYEXP("$unset"), &unset);
+    bson_append_int32(&unset, KEYEXP("compacting"), 1);
+    bson_append_document_end(&update, &unset);
+
+    if(!mongoc_collection_update(get_coll(COLL_INODES),
+        MONGOC_UPDATE_NONE,
+        &cond,
+        &update,
+        NULL, // write concern
+        &dberr))
+        logit(WARN, "Error releasing compaction lease: %s", dberr.message);
+    bson_destroy(&cond);
+    bson_destroy(&update);
+}
+
+/*
+ * Sets a new extgen once the compacted documents have replaced the old
+ * ones, as long as nobody else changed it first (they'll have set a new
+ * one themselves).
+ */
+static void finish_extgen(const bson_oid_t * oid, const bson_oid_t * gen) {
+    bson_t cond, update, set;
+    bson_oid_t newgen;
+    bson_error_t dberr;
+    static const bson_oid_t nogen;
+
+    bson_init(&cond);
+    bson_append_oid(&cond, KEYEXP("_id"), oid);
+    if(bson_oid_equal(gen, &nogen)) {
+        bson_t sub;
+        bson_append_document_begin(&cond, KEYEXP("extgen"), &sub);
+        bson_append_bool(&sub, KEYEXP("$exists"), false);
+        bson_append_document_end(&cond, &sub);
+    }
+    else
+        bson_append_oid(&cond, KEYEXP("extgen"), gen);
+
+    bson_oid_init(&newgen, NULL);
+    bson_init(&update);
+    bson_append_document_begin(&update, KEYEXP("$set"), &set);
+    bson_append_oid(&set, KEYEXP("extgen"), &newgen);
+    bson_append_document_end(&update, &set);
+
+    if(!mongoc_collection_update(get_coll(COLL_INODES),
+        MONGOC_UPDATE_NONE,
+        &cond,
+        &update,
+        NULL, // write concern
+        &dberr))
+        logit(WARN, "Error updating extent generation: %s", dberr.message);
+    bson_destroy(&cond);
+    bson_destroy(&update);
+}
+
+/*
+ * How many of an ordered bulk insert made it, going by its reply. A
+ * duplicate key means somebody else wrote documents with the same _ids,
+ * and those aren't ours to remove, so that counts as none.
+ */
+static size_t count_inserted(const bson_t * reply) {
+    bson_iter_t iter, errors, err, code;
+    size_t n = 0;
+
+    if(bson_iter_init_find(&iter, reply, "writeErrors") &&
+        bson_iter_recurse(&iter, &errors)) {
+        while(bson_iter_next(&errors)) {
+            if(bson_iter_recurse(&errors, &err) &&
+                bson_iter_find(&err, "code") &&
+                bson_iter_as_int64(&err) == DUPLICATE_KEY)
+                return 0;
+        }
+    }
+    if(bson_iter_init_find(&code, reply, "nInserted"))
+        n = bson_iter_as_int64(&code);
+    return n;
+}
+
+/*
+ * Works out the _id for the kth new document. The timestamp comes from
+ * maxid, 0xff fills the machine id byte, the next four bytes come from
+ * the inode so two files compacted in the same second don't collide, and
+ * k is the counter. If maxid is already that big (it came from an
+ * earlier compaction) the new _ids just count up from it instead.
+ */
+static void compact_id(const bson_oid_t * inode, const bson_oid_t * maxid,
+    int from_max, uint32_t k, bson_oid_t * out) {
+    uint8_t bytes[12];
+    int i;
+
+    if(from_max) {
+        uint32_t carry = k + 1;
+        memcpy(bytes, maxid->bytes, 12);
+        for(i = 11; i >= 0 && carry; i--) {
+            carry += bytes[i];
+            bytes[i] = carry & 0xff;
+            carry >>= 8;
+        }
+    }
+    else {
+        memcpy(bytes, maxid->bytes, 4);
+        bytes[4] = 0xff;
+        memcpy(bytes + 5, inode->bytes + 8, 4);
+        bytes[9] = (k >> 16) & 0xff;
+        bytes[10] = (k >> 8) & 0xff;
+        bytes[11] = k & 0xff;
+    }
+    bson_oid_init_from_data(out, bytes);
+}
+
+// How many documents write_compacted will turn map into.
+static size_t count_docs(struct elist * map) {
+    size_t idx, first, ndocs = 0;
+
+    for(idx = 0; idx < map->nnodes; ndocs++) {
+        off_t last_end = map->list[idx].off + map->list[idx].len;
+
+        first = idx;
+        for(idx++; idx < map->nnodes && idx - first < COMPACT_DOC_NODES &&
+            map->list[idx].off == last_end; idx++)
+            last_end += map->list[idx].len;
+    }
+    return ndocs;
+}
+
+static int remove_ids(const bson_oid_t * ids, size_t nids) {
+    mongoc_collection_t * coll = get_coll(COLL_EXTENTS);
+    bson_error_t dberr;
+    size_t done, i;
+
+    for(done = 0; done < nids; done += REMOVE_BATCH) {
+        bson_t cond, sub, inlist;
+        size_t n = nids - done > REMOVE_BATCH ? REMOVE_BATCH : nids - done;
+        bool res;
+
+        bson_init(&cond);
+        bson_append_document_begin(&cond, KEYEXP("_id"), &sub);
+        bson_append_array_begin(&sub, KEYEXP("$in"), &inlist);
+        for(i = 0; i < n; i++) {
+            char idxbuf[10];
+            const char * idxstr;
+            size_t idxlen = bson_uint32_to_string(i, &idxstr,
+                idxbuf, sizeof(idxbuf));
+            bson_append_oid(&inlist, idxstr, idxlen, &ids[done + i]);
+        }
+        bson_append_array_end(&sub, &inlist);
+        bson_append_document_end(&cond, &sub);
+
+        res = mongoc_collection_delete(coll,
+            MONGOC_DELETE_NONE,
+            &cond,
+            NULL, // write concern
+            &dberr);
+        bson_destroy(&cond);
+        if(!res) {
+            logit(ERROR, "Error removing extent documents: %s", dberr.message);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Updates the touched time of every block map refers to. The compacted
+ * documents get _ids from before garbage collection started scanning, so
+ * without this a pass that already read the old documents could remove
+ * blocks they share with the new ones.
+ */
+static int touch_blocks(struct elist * map) {
+    mongoc_collection_t * coll = get_coll(COLL_BLOCKS);
+    bson_error_t dberr;
+    const time_t now = time(NULL);
+    size_t done = 0, i;
+
+    while(done < map->nnodes) {
+        bson_t cond, sub, inlist, doc, set;
+        size_t n = 0;
+        bool res;
+
+        bson_init(&cond);
+        bson_append_document_begin(&cond, KEYEXP("_id"), &sub);
+        bson_append_array_begin(&sub, KEYEXP("$in"), &inlist);
+        for(i = done; i < map->nnodes && n < REMOVE_BATCH; i++) {
+            char idxbuf[10];
+            const char * idxstr;
+            size_t idxlen;
+
+            if(map->list[i].empty)
+                continue;
+            idxlen = bson_uint32_to_string(n++, &idxstr,
+                idxbuf, sizeof(idxbuf));
+            append_hash(&inlist, idxstr, idxlen, map->list[i].hashalg,
+                map->list[i].hash);
+        }
+        done = i;
+        bson_append_array_end(&sub, &inlist);
+        bson_append_document_end(&cond, &sub);
+
+        bson_init(&doc);
+        bson_append_document_begin(&doc, KEYEXP("$set"), &set);
+        bson_append_time_t(&set, KEYEXP("touched"), now);
+        bson_append_document_end(&doc, &set);
+
+        res = n == 0 || mongoc_collection_update(coll,
+            MONGOC_UPDATE_MULTI_UPDATE,
+            &cond,
+            &doc,
+            NULL, // write concern
+            &dberr);
+        bson_destroy(&cond);
+        bson_destroy(&doc);
+        if(!res) {
+            logit(ERROR, "Error touching compacted blocks: %s", dberr.message);
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes map out as new extent documents, with no document holding more
+ * than COMPACT_DOC_NODES enodes. Returns the new _ids in pnewids.
+ */
+static int write_compacted(const bson_oid_t * inode, struct elist * map,
+    const bson_oid_t * maxid, bson_oid_t ** pnewids, size_t * pnnew) {
+    mongoc_collection_t * coll = get_coll(COLL_EXTENTS);
+    mongoc_bulk_operation_t * bulk;
+    bson_oid_t * newids, first_id;
+    bson_t doc, reply;
+    bson_error_t dberr;
+    size_t idx, first, nnew = 0;
+    int from_max;
+    uint32_t res;
+
+    compact_id(inode, maxid, 0, 0, &first_id);
+    from_max = bson_oid_compare(&first_id, maxid) <= 0;
+
+    if((newids = calloc(map->nnodes, sizeof(bson_oid_t))) == NULL)
+        return -ENOMEM;
+    bulk = mongoc_collection_create_bulk_operation(coll,
+        true, // ordered
+        NULL); // write concern
+
+    for(idx = 0; idx < map->nnodes;) {
+        off_t last_end = map->list[idx].off + map->list[idx].len;
+
+        first = idx;
+        for(idx++; idx < map->nnodes && idx - first < COMPACT_DOC_NODES &&
+            map->list[idx].off == last_end; idx++)
+            last_end += map->list[idx].len;
+
+        compact_id(inode, maxid, from_max, nnew, &newids[nnew]);
+        build_extent_doc(&doc, &newids[nnew], inode,
+            &map->list[first], idx - first);
+        nnew++;
+        mongoc_bulk_operation_insert(bulk, &doc);
+        bson_destroy(&doc);
+    }
+
+    res = mongoc_bulk_operation_execute(bulk, &reply, &dberr);
+    mongoc_bulk_operation_destroy(bulk);
+
+    if(!res) {
+        size_t ninserted = count_inserted(&reply);
+
+        logit(ERROR, "Error writing compacted extents: %s", dberr.message);
+        // The ones before the error made it, since the bulk is ordered.
+        if(ninserted > nnew)
+            ninserted = nnew;
+        remove_ids(newids, ninserted);
+        bson_destroy(&reply);
+        free(newids);
+        return -EIO;
+    }
+    bson_destroy(&reply);
+
+    *pnewids = newids;
+    *pnnew = nnew;
+    return 0;
+}
+
+/*
+ * Compacts the extents of one file. Unless force is set, files with
+ * fewer than compact_min_docs extent documents are left alone. Files
+ * written in the last COMPACT_SETTLE seconds return -EAGAIN so they get
+ * retried once they've settled down; with force we wait for that and
+ * read the file again instead, a few times before giving up.
+ */
+int compact_inode(const bson_oid_t * oid, int force) {
+    mongoc_collection_t * coll = get_coll(COLL_EXTENTS);
+    struct inode e;
+    struct elist * map = NULL;
+    bson_oid_t * ids = NULL, * newids = NULL, gen, newgen, maxid, token;
+    bson_error_t dberr;
+    size_t nids = 0, nnew = 0, idx;
+    char oidstr[25];
+    time_t newest, now;
+    int res, tries = 0;
+
+    if(!force) {
+        bson_t query;
+        int64_t count;
+
+        bson_init(&query);
+        bson_append_oid(&query, KEYEXP("inode"), oid);
+        count = mongoc_collection_count(coll, MONGOC_QUERY_NONE,
+            &query, 0, 0, NULL, &dberr);
+        bson_destroy(&query);
+        if(count < 0) {
+            logit(WARN, "Error counting extents: %s", dberr.message);
+            return -EIO;
+        }
+        if(count < compact_min_docs)
+            return 0;
+    }
+
+    bson_oid_init(&token, NULL);
+    if((res = take_lease(oid, &token)) != 0)
+        return res;
+again:
+    if((res = get_extgen(oid, &gen)) != 0)
+        goto end;
+
+    init_inode(&e);
+    bson_oid_copy(oid, &e.oid);
+    if((res = read_extent_map(&e, &map, &ids, &nids)) != 0)
+        goto end;
+    if(nids < 2 || count_docs(map) >= nids || map->nnodes == 0)
+        goto end;
+
+    maxid = ids[0];
+    for(idx = 1; idx < nids; idx++) {
+        if(bson_oid_compare(&ids[idx], &maxid) > 0)
+            maxid = ids[idx];
+    }
+
+    // Anything written in the same second as maxid could get an _id
+    // below ours, so the map has to be read well after it.
+    newest = bson_oid_get_time_t(&maxid);
+    if((now = time(NULL)) < newest + COMPACT_SETTLE) {
+        if(!force || ++tries > COMPACT_FORCE_TRIES) {
+            res = -EAGAIN;
+            goto end;
+        }
+        free(ids);
+        free(map);
+        ids = NULL;
+        map = NULL;
+        sleep(newest + COMPACT_SETTLE - now);
+        goto again;
+    }
+
+    if((res = touch_blocks(map)) != 0)
+        goto end;
+    if((res = write_compacted(oid, map, &maxid, &newids, &nnew)) != 0)
+        goto end;
+
+    if((res = get_extgen(oid, &newgen)) != 0 ||
+        !bson_oid_equal(&gen, &newgen)) {
+        remove_ids(newids, nnew);
+        __sync_fetch_and_add(&compact_aborts, 1);
+        if(res == 0)
+            res = -EAGAIN;
+        goto end;
+    }
+
+    if((res = remove_ids(ids, nids)) != 0)
+        goto end;
+    finish_extgen(oid, &gen);
+
+    __sync_fetch_and_add(&compact_runs, 1);
+    __sync_fetch_and_add(&compact_docs_before, nids);
+    __sync_fetch_and_add(&compact_docs_after, nnew);
+    bson_oid_to_string(oid, oidstr);
+    logit(INFO, "Compacted extents of %s from %zu documents to %zu "
+        "(%zu enodes)", oidstr, nids, nnew, map->nnodes);
+
+end:
+    release_lease(oid, &token);
+    free(newids);
+    free(ids);
+    free(map);
+    return res;
+}
+
+static void * compact_worker(void * p) {
+    bson_oid_t batch[COMPACT_QUEUE_LEN];
+    size_t n, i;
+
+    for(;;) {
+        sleep(compact_interval);
+
+        pthread_mutex_lock(&compact_lock);
+        n = compact_count;
+        memcpy(batch, compact_queue, n * sizeof(bson_oid_t));
+        compact_count = 0;
+        pthread_mutex_unlock(&compact_lock);
+
+        for(i = 0; i < n; i++) {
+            if(compact_inode(&batch[i], 0) == -EAGAIN)
+                note_extents_written(&batch[i]);
+        }
+    }
+    return NULL;
+}
+
+void start_compactor() {
+    pthread_t thread;
+
+    if(compact_interval == 0)
+        return;
+    if(pthread_create(&thread, NULL, compact_worker, NULL) != 0) {
+        logit(WARN, "Could not start extent compaction thread");
+        return;
+    }
+    pthread_detach(thread);
+}
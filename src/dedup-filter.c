@@ -0,0 +1,169 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mongo-fuse.h"
+
+/*
+ * A Bloom filter of block hashes we know are already in the blocks
+ * collection, either because we stored them, read them, or saw them when
+ * seeding the filter from the _id index at mount time. The write path
+ * checks it before compressing a block; a hit still has to be confirmed
+ * against the database, since a false positive would otherwise lose the
+ * block, but that's an _id-only lookup instead of compressing and
+ * shipping the whole block.
+ *
+ * Bits are only ever set, so adding and checking don't need a lock.
+ * The block hashes are already uniformly distributed, so the bit
+ * positions come straight from them with double hashing. The same
+ * filter code is used by garbage collection to track referenced blocks.
+ */
+
+#define FILTER_HASHES 7
+
+static struct hash_filter dedup_filter = { NULL, 0 };
+
+uint64_t dedup_checks = 0;
+uint64_t dedup_hits = 0;
+uint64_t dedup_bytes = 0;
+
+int hash_filter_init(struct hash_filter * f, size_t bytes) {
+    size_t nwords = bytes / sizeof(uint64_t);
+
+    f->bits = NULL;
+    f->nbits = 0;
+    if(nwords == 0)
+        return 0;
+    if((f->bits = calloc(nwords, sizeof(uint64_t))) == NULL)
+        return -ENOMEM;
+    f->nbits = (uint64_t)nwords * 64;
+    return 0;
+}
+
+void hash_filter_free(struct hash_filter * f) {
+    free(f->bits);
+    f->bits = NULL;
+    f->nbits = 0;
+}
+
+static void filter_positions(const struct hash_filter * f,
+    const uint8_t hash[HASH_LEN], uint64_t pos[FILTER_HASHES]) {
+    uint64_t h1, h2;
+    int i;
+
+    memcpy(&h1, hash, sizeof(h1));
+    memcpy(&h2, hash + sizeof(h1), sizeof(h2));
+    h2 |= 1;
+    for(i = 0; i < FILTER_HASHES; i++)
+        pos[i] = (h1 + i * h2) % f->nbits;
+}
+
+void hash_filter_add(struct hash_filter * f, const uint8_t hash[HASH_LEN]) {
+    uint64_t pos[FILTER_HASHES];
+    int i;
+
+    if(!f->bits)
+        return;
+    filter_positions(f, hash, pos);
+    for(i = 0; i < FILTER_HASHES; i++)
+        __sync_fetch_and_or(&f->bits[pos[i] / 64],
+            (uint64_t)1 << (pos[i] % 64));
+}
+
+/*
+ * Returns 1 if the hash might have been added, 0 if it definitely
+ * wasn't.
+ */
+int hash_filter_check(const struct hash_filter * f,
+    const uint8_t hash[HASH_LEN]) {
+    uint64_t pos[FILTER_HASHES];
+    int i;
+
+    if(!f->bits)
+        return 0;
+    filter_positions(f, hash, pos);
+    for(i = 0; i < FILTER_HASHES; i++) {
+        uint64_t word = f->bits[pos[i] / 64];
+        if(!(word & ((uint64_t)1 << (pos[i] % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+void setup_dedup_filter(size_t bytes) {
+    if(hash_filter_init(&dedup_filter, bytes) != 0)
+        logit(WARN, "Could not allocate dedup filter, running without it");
+}
+
+void dedup_filter_add(const uint8_t hash[HASH_LEN]) {
+    hash_filter_add(&dedup_filter, hash);
+}
+
+/*
+ * Returns 1 if the block might already be stored, 0 if it definitely
+ * isn't.
+ */
+int dedup_filter_check(const uint8_t hash[HASH_LEN]) {
+    return hash_filter_check(&dedup_filter, hash);
+}
+
+static void * seed_worker(void * p) {
+    mongoc_collection_t * coll = get_coll(COLL_BLOCKS);
+    mongoc_cursor_t * curs;
+    const bson_t * doc;
+    bson_t query, fields;
+    bson_error_t dberr;
+    uint64_t count = 0;
+
+    bson_init(&query);
+    bson_init(&fields);
+    bson_append_int32(&fields, KEYEXP("_id"), 1);
+
+    curs = mongoc_collection_find(coll,
+        MONGOC_QUERY_NONE,
+        0, // skip
+        0, // limit
+        0, // batch size
+        &query,
+        &fields,
+        NULL); // read prefs
+
+    bson_destroy(&query);
+    bson_destroy(&fields);
+
+    if(!curs) {
+        logit(ERROR, "Error getting cursor to seed dedup filter");
+        return NULL;
+    }
+
+    while(mongoc_cursor_next(curs, &doc)) {
+        bson_iter_t iter;
+        uint8_t hash[HASH_LEN];
+
+        if(!bson_iter_init_find(&iter, doc, "_id") ||
+            read_hash(&iter, -1, hash) < 0)
+            continue;
+        dedup_filter_add(hash);
+        count++;
+    }
+
+    if(mongoc_cursor_error(curs, &dberr))
+        logit(ERROR, "Error seeding dedup filter: %s", dberr.message);
+    else
+        logit(INFO, "Seeded dedup filter with %llu blocks",
+            (unsigned long long)count);
+    mongoc_cursor_destroy(curs);
+    return NULL;
+}
+
+void start_dedup_seed() {
+    pthread_t thread;
+
+    if(!dedup_filter.bits)
+        return;
+    if(pthread_create(&thread, NULL, seed_worker, NULL) != 0) {
+        logit(WARN, "Could not start dedup filter seeding thread");
+        return;
+    }
+    pthread_detach(thread);
+}
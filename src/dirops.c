@@ -17,21 +17,39 @@ struct readdir_data {
     void * buf;
 };
 
-int read_dirents(const char * directory,
+/*
+ * Calls dirent_cb for everything in directory. If its _id is known, the
+ * entries are found by that, so this still works while the directory is
+ * being renamed.
+ */
+static int read_dir_entries(const bson_oid_t * dirid, const char * directory,
     int (*dirent_cb)(struct inode *e, void * p,
     const char * parent, size_t parentlen), void * p) {
     size_t pathlen = strlen(directory);
     char regexp[PATH_MAX + 10];
-    int res;
+    int res = 0;
     mongoc_collection_t * coll = get_coll(COLL_INODES);
     bson_t query;
     const bson_t *doc;
     bson_error_t dberr;
     mongoc_cursor_t * curs;
+    bson_oid_t found;
 
-    sprintf(regexp, "^%s/[^/]+$", pathlen == 1 ? directory + 1 : directory);
     bson_init(&query);
-    bson_append_regex(&query, KEYEXP("dirents"), regexp, "");
+    if(links_migrated) {
+        if(!dirid) {
+            if((res = path_to_oid(directory, pathlen, &found)) != 0) {
+                bson_destroy(&query);
+                return res;
+            }
+            dirid = &found;
+        }
+        bson_append_oid(&query, KEYEXP("links.parent"), dirid);
+    }
+    else {
+        sprintf(regexp, "^%s/[^/]+$", pathlen == 1 ? directory + 1 : directory);
+        bson_append_regex(&query, KEYEXP("dirents"), regexp, "");
+    }
 
     curs = mongoc_collection_find(coll,
         MONGOC_QUERY_NONE,
@@ -71,7 +89,13 @@ int read_dirents(const char * directory,
     }
 
     mongoc_cursor_destroy(curs);
-    return 0;
+    return res;
+}
+
+int read_dirents(const char * directory,
+    int (*dirent_cb)(struct inode *e, void * p,
+    const char * parent, size_t parentlen), void * p) {
+    return read_dir_entries(NULL, directory, dirent_cb, p);
 }
 
 int readdir_cb(struct inode * e, void * p,
@@ -82,20 +106,14 @@ int readdir_cb(struct inode * e, void * p,
     if(parentlen > 1)
         printlen++;
 
-    stbuf.st_nlink = 1;
-    stbuf.st_mode = e->mode;
-    if(stbuf.st_mode & S_IFDIR)
-        stbuf.st_nlink++;
-    stbuf.st_uid = e->owner;
-    stbuf.st_gid = e->group;
-    stbuf.st_size = e->size;
-    stbuf.st_ctime = e->created;
-    stbuf.st_mtime = e->modified;
-    stbuf.st_atime = e->modified;
+    inode_to_stat(e, &stbuf);
+    stbuf.st_ino = oid_ino(&e->oid);
 
     struct dirent * cde = e->dirents;
     while(cde) {
         if(strncmp(cde->path, parent, parentlen) != 0 ||
+            cde->len <= printlen || cde->path[printlen - 1] != '/' ||
+            strchr(cde->path + printlen, '/') != NULL ||
             strcmp(cde->path + printlen, ".snapshot") == 0) {
             cde = cde->next;
             continue;
@@ -132,72 +150,81 @@ int mongo_mkdir(const char * path, mode_t mode) {
     return res;
 }
 
+/*
+ * Moves everything in a directory's .snapshot to orphaned-<name> in the
+ * .snapshot of the directory above it, keeping its place in the tree.
+ * Each directory is renamed before anything in it, so their new paths
+ * can be linked to it.
+ */
 int orphan_snapshot(struct inode *e, void * p,
     const char * parent, size_t parentlen) {
     const char * topparent = (const char*)p;
     struct dirent * cde = e->dirents, *desave = NULL;
+    int rootlen = strlen(topparent);
+    const char * rest;
+    int res;
+
     while(cde && strncmp(cde->path, parent, parentlen) != 0) {
         desave = cde;
         cde = cde->next;
     }
-    const char * shortname = cde->path + cde->len;
-    int rootlen = strlen(topparent);
+    if(!cde)
+        return 0;
+    rest = cde->path + rootlen + strlen("/.snapshot");
     while(topparent[--rootlen] != '/');
-    int res, nslashes = 1;
-
-    if(e->mode & S_IFDIR) {
-            nslashes--;
-        if((res = read_dirents(cde->path,
-            orphan_snapshot, (void*)topparent)) != 0)
-            return res;
-    }
-
-    while(nslashes > 0 || *(shortname - 1) != '/') {
-        if(*(shortname - 1) == '/')
-            nslashes--;
-        shortname--;
-    }
 
     struct dirent * nd = malloc(sizeof(struct dirent) + PATH_MAX);
     if(!nd)
         return -ENOMEM;
-    if(strcmp(shortname, ".snapshot") == 0) {
-        nd->len = sprintf(nd->path, "/%*.s.snapshot/orphaned-%s",
-            rootlen, topparent, topparent + rootlen + 1);
-    } else {
-        nd->len = sprintf(nd->path, "/%*.s.snapshot/orphaned-%s/%s",
-            rootlen, topparent, topparent + rootlen + 1, shortname);
-    }
+    nd->len = sprintf(nd->path, "%.*s/.snapshot/orphaned-%s%s",
+        rootlen, topparent, topparent + rootlen + 1, rest);
+    nd->linked = 0;
     nd->next = cde->next;
     if(desave)
         desave->next = nd;
     else
         e->dirents = nd;
-    commit_inode(e);
+    res = commit_inode(e);
     if(desave)
         desave->next = cde;
     else
         e->dirents = cde;
     free(nd);
+    if(res != 0)
+        return res;
 
+    if(e->mode & S_IFDIR)
+        return read_dir_entries(&e->oid, cde->path, orphan_snapshot,
+            (void*)topparent);
     return 0;
 }
 
+// Builds a query for the entries in a directory, by links if we can.
+static void children_query(bson_t * cond, const bson_oid_t * dirid,
+    const char * prefix) {
+    bson_init(cond);
+    if(links_migrated)
+        bson_append_oid(cond, KEYEXP("links.parent"), dirid);
+    else
+        bson_append_regex(cond, KEYEXP("dirents"), prefix, "");
+}
+
 int mongo_rmdir(const char * path) {
     struct inode e;
     bson_error_t dberr;
     int64_t dres;
-    int res;
-    bson_t cond;
+    uint64_t start;
+    int res, orphaned = 0;
+    bson_t cond, sub, ids;
+    bson_oid_t dirid;
     char regexp[PATH_MAX + 25];
     mongoc_collection_t * coll = get_coll(COLL_INODES);
 
-    if((res = inode_exists(path)) != 0)
+    if((res = path_to_oid(path, strlen(path), &dirid)) != 0)
         return res;
 
     sprintf(regexp, "^%s/[^/]+$", path);
-    bson_init(&cond);
-    bson_append_regex(&cond, KEYEXP("dirents"), regexp, "");
+    children_query(&cond, &dirid, regexp);
 
     dres = mongoc_collection_count(coll,
         0, // flags
@@ -217,14 +244,14 @@ int mongo_rmdir(const char * path) {
     if(dres > 1)
         return -ENOTEMPTY;
 
+    init_inode(&e);
     if(strstr(path, "/.snapshot") == NULL) {
         sprintf(regexp, "%s/.snapshot", path);
         if((res = get_inode(regexp, &e)) != 0)
             return res;
 
         sprintf(regexp, "^%s/.snapshot/", path);
-        bson_init(&cond);
-        bson_append_regex(&cond, KEYEXP("dirents"), regexp, "");
+        children_query(&cond, &e.oid, regexp);
 
         dres = mongoc_collection_count(coll,
             0, // flags
@@ -238,28 +265,49 @@ int mongo_rmdir(const char * path) {
 
         if(dres == -1) {
             logit(ERROR, "Error counting directory entries: %s", dberr.message);
+            free_inode(&e);
             return -EIO;
         }
 
         if(dres > 0) {
             res = orphan_snapshot(&e, (void*)path, NULL, 0);
-            free_inode(&e);
-            if(res != 0)
+            if(res != 0) {
+                free_inode(&e);
                 return res;
+            }
+            orphaned = 1;
         }
     }
 
-    sprintf(regexp, "^%s", path);
     bson_init(&cond);
-    bson_append_regex(&cond, KEYEXP("dirents"), regexp, "");
+    if(links_migrated) {
+        // The directory and its .snapshot, unless that was just orphaned.
+        bson_append_document_begin(&cond, KEYEXP("_id"), &sub);
+        bson_append_array_begin(&sub, KEYEXP("$in"), &ids);
+        bson_append_oid(&ids, KEYEXP("0"), &dirid);
+        if(e.dirents && !orphaned)
+            bson_append_oid(&ids, KEYEXP("1"), &e.oid);
+        bson_append_array_end(&sub, &ids);
+        bson_append_document_end(&cond, &sub);
+    }
+    else {
+        sprintf(regexp, "^%s", path);
+        bson_append_regex(&cond, KEYEXP("dirents"), regexp, "");
+    }
+    free_inode(&e);
 
+    start = stats_start();
     res = mongoc_collection_delete(coll,
         0, // flags
         &cond,
         NULL, // write concern
         &dberr);
+    stats_end(STAT_DB_DELETE, start);
 
     bson_destroy(&cond);
+    attr_cache_invalidate(path);
+    sprintf(regexp, "%s/.snapshot", path);
+    attr_cache_invalidate(regexp);
 
     if(!res) {
         logit(ERROR, "Error removing directory entry %s: %s", path, dberr.message);
@@ -278,9 +326,6 @@ int create_snapshot(struct inode * e, void * p, const char * parent, size_t plen
     char * generation = (char*)p;
     struct elist * root = NULL;
 
-    if(!root)
-        return -ENOMEM;
-
     if(e->mode & S_IFDIR)
         return 0;
 
@@ -289,12 +334,17 @@ int create_snapshot(struct inode * e, void * p, const char * parent, size_t plen
         return res;
     bson_oid_init(&newid, NULL);
     memcpy(&e->oid, &newid, sizeof(bson_oid_t));
-    res = serialize_extent(e, root);
-    free(root);
+    if(root) {
+        res = serialize_extent(e, root);
+        free(root);
+        if(res != 0)
+            return res;
+    }
     
     while(*(filename-1) != '/') filename--;
     struct dirent * d = malloc(sizeof(struct dirent) + pathlen + 21);
     d->len = sprintf(d->path, "%s/.snapshot/%s/%s", parent, generation, filename);
+    d->linked = 0;
     d->next = NULL;
 
     struct dirent * freeme = e->dirents;
@@ -333,33 +383,43 @@ int snapshot_dir(const char * path, size_t pathlen, mode_t mode) {
 }
 
 int mongo_rename(const char * path, const char * newpath) {
-    mongoc_collection_t * coll = get_coll(COLL_INODES);
-    bson_t query, doc, setdoc;
-    bson_error_t dberr;
+    struct inode e;
+    struct dirent * cde, * nd, ** prev;
+    size_t newpathlen = strlen(newpath);
     int res;
 
-    bson_init(&query);
-    bson_append_utf8(&query, KEYEXP("dirents"), path, strlen(path));
-
-    bson_init(&doc);
-    bson_append_document_begin(&doc, KEYEXP("$set"), &setdoc);
-    bson_append_utf8(&setdoc, KEYEXP("dirents.$"), newpath, strlen(path));
-    bson_append_document_end(&doc, &setdoc);
-
-    res = mongoc_collection_update(coll,
-        MONGOC_UPDATE_NONE,
-        &query,
-        &doc,
-        NULL, // write concern
-        &dberr);
-
-    bson_destroy(&query);
-    bson_destroy(&doc);
+    if(stats_file(newpath))
+        return -EPERM;
+    if((res = get_inode(path, &e)) != 0)
+        return res;
 
-    if(!res) {
-        logit(ERROR, "Error renaming inode %s: %s", path, dberr.message);
-        return -EIO;
+    for(prev = &e.dirents; (cde = *prev) != NULL; prev = &cde->next) {
+        if(strcmp(cde->path, path) == 0)
+            break;
+    }
+    if(!cde) {
+        free_inode(&e);
+        return -ENOENT;
     }
 
-    return inode_exists(newpath);
+    if((nd = malloc(sizeof(struct dirent) + newpathlen)) == NULL) {
+        free_inode(&e);
+        return -ENOMEM;
+    }
+    strcpy(nd->path, newpath);
+    nd->len = newpathlen;
+    nd->linked = 0;
+    nd->next = cde->next;
+    *prev = nd;
+    free(cde);
+
+    res = commit_inode(&e);
+    attr_cache_invalidate(path);
+    // What was cached under either name is stale, including misses.
+    if(e.mode & S_IFDIR) {
+        attr_cache_invalidate_tree(path);
+        attr_cache_invalidate_tree(newpath);
+    }
+    free_inode(&e);
+    return res;
 }
@@ -36,7 +36,7 @@ int ensure_elist(struct elist ** pout) {
 	return 0;
 }
 
-int insert_hash(struct elist ** pout, off_t off, size_t len,
+int insert_hash(struct elist ** pout, off_t off, size_t len, int alg,
 	const uint8_t hash[HASH_LEN]) {
 	int res, idx;
 	if((res = ensure_elist(pout)) != 0)
@@ -47,8 +47,10 @@ int insert_hash(struct elist ** pout, off_t off, size_t len,
 	idx = out->nnodes++;
 	out->list[idx].off = off;
 	out->list[idx].len = len;
+	out->list[idx].boff = 0;
 	out->list[idx].empty = 0;
 	out->list[idx].seq = idx;
+	out->list[idx].hashalg = alg;
 	memcpy(out->list[idx].hash, hash, HASH_LEN);
 
 	return 0;
@@ -64,6 +66,7 @@ int insert_empty(struct elist ** pout, off_t off, size_t len) {
 	idx = out->nnodes++;
 	out->list[idx].off = off;
 	out->list[idx].len = len;
+	out->list[idx].boff = 0;
 	out->list[idx].empty = 1;
 	out->list[idx].seq = idx;
 	
@@ -80,105 +83,407 @@ int enode_cmp(const void * ra, const void * rb) {
 	return res;
 }
 
-int serialize_extent(struct inode * e, struct elist * list) {
+/*
+ * extgen on the inode document changes every time the file's extents
+ * change, so anyone holding an extent map for it can tell it's stale.
+ * Our own map only stays valid if it was current before the change and
+ * nobody else changed extgen since we last saw it, so the old value
+ * comes back from the same findAndModify that sets the new one.
+ */
+int bump_extgen(struct inode * e, const bson_oid_t * gen) {
+	mongoc_collection_t * coll = get_coll(COLL_INODES);
+	bson_t cond, doc, set, fields, reply;
+	bson_iter_t iter, value;
+	bson_error_t dberr;
+	bson_oid_t old;
+	int was_current = bson_oid_equal(&e->map_gen, &e->extgen);
+	int found = 0;
+	uint64_t start;
+	bool res;
+
+	bson_init(&cond);
+	bson_append_oid(&cond, KEYEXP("_id"), &e->oid);
+
+	bson_init(&doc);
+	bson_append_document_begin(&doc, KEYEXP("$set"), &set);
+	bson_append_oid(&set, KEYEXP("extgen"), gen);
+	bson_append_document_end(&doc, &set);
+
+	bson_init(&fields);
+	bson_append_int32(&fields, KEYEXP("extgen"), 1);
+
+	start = stats_start();
+	res = mongoc_collection_find_and_modify(coll,
+		&cond,
+		NULL, // sort
+		&doc,
+		&fields,
+		false, // remove
+		false, // upsert
+		false, // new
+		&reply,
+		&dberr);
+	stats_end(STAT_DB_UPDATE, start);
+
+	bson_destroy(&cond);
+	bson_destroy(&doc);
+	bson_destroy(&fields);
+
+	if(!res) {
+		bson_destroy(&reply);
+		logit(WARN, "Error updating extent generation: %s", dberr.message);
+		return -EIO;
+	}
+
+	// A missing extgen is the same as the zeroed one read_inode leaves.
+	memset(&old, 0, sizeof(old));
+	if(bson_iter_init_find(&iter, &reply, "value") &&
+		bson_iter_type(&iter) == BSON_TYPE_DOCUMENT) {
+		found = 1;
+		if(bson_iter_recurse(&iter, &value) &&
+			bson_iter_find(&value, "extgen") &&
+			bson_iter_type(&value) == BSON_TYPE_OID)
+			bson_oid_copy(bson_iter_oid(&value), &old);
+	}
+	bson_destroy(&reply);
+
+	if(found && was_current && bson_oid_equal(&old, &e->extgen))
+		bson_oid_copy(gen, &e->map_gen);
+	bson_oid_copy(gen, &e->extgen);
+	return 0;
+}
+
+/*
+ * Builds an extent document for n enodes that follow each other with no
+ * gaps. boff is only stored for enodes that don't start at the beginning
+ * of their block, which only compaction writes.
+ */
+void build_extent_doc(bson_t * doc, const bson_oid_t * id,
+	const bson_oid_t * inode, const struct enode * nodes, size_t n) {
+	bson_t blocklist, blockentry;
+	char idxbuf[10];
+	const char * idxstr;
+	size_t idx, idxlen;
+
+	bson_init(doc);
+	bson_append_oid(doc, KEYEXP("_id"), id);
+	bson_append_oid(doc, KEYEXP("inode"), inode);
+	bson_append_int64(doc, KEYEXP("start"), nodes[0].off);
+	bson_append_array_begin(doc, KEYEXP("blocks"), &blocklist);
+	for(idx = 0; idx < n; idx++) {
+		const struct enode * cur = &nodes[idx];
+
+		idxlen = bson_uint32_to_string(idx, &idxstr, idxbuf, sizeof(idxbuf));
+		bson_append_document_begin(&blocklist, idxstr, idxlen, &blockentry);
+		if(cur->empty)
+			bson_append_null(&blockentry, KEYEXP("hash"));
+		else {
+			append_hash(&blockentry, KEYEXP("hash"),
+				cur->hashalg, cur->hash);
+			if(cur->hashalg != HASH_SHA1)
+				bson_append_int32(&blockentry, KEYEXP("alg"),
+					cur->hashalg);
+			if(cur->boff > 0)
+				bson_append_int32(&blockentry, KEYEXP("boff"), cur->boff);
+		}
+		bson_append_int32(&blockentry, KEYEXP("len"), cur->len);
+		bson_append_document_end(&blocklist, &blockentry);
+	}
+	bson_append_array_end(doc, &blocklist);
+	bson_append_int64(doc, KEYEXP("end"),
+		nodes[n - 1].off + nodes[n - 1].len);
+}
+
+/*
+ * Every run of contiguous enodes becomes one extent document, and each
+ * insert comes with a delete of the older documents it covers. The whole
+ * list goes out as one ordered bulk operation with all the inserts ahead
+ * of all the deletes, which does the same thing as running them run by
+ * run (each delete only removes documents older than its own insert) in
+ * two round-trips instead of two per run.
+ */
+static int write_extents(struct inode * e, struct elist * list) {
 	mongoc_collection_t * coll = get_coll(COLL_EXTENTS);
-	bson_t doc, cond;
+	mongoc_bulk_operation_t * bulk;
+	bson_t doc, reply;
+	bson_t * conds;
 	bson_error_t dberr;
-	int res, idx, towrite = 0;
+	bson_oid_t docid;
+	uint64_t start;
+	int idx, ncond = 0;
+	uint32_t res;
 
 	if(list->nnodes == 0)
 		return 0;
 	qsort(list->list, list->nnodes, sizeof(struct enode), enode_cmp);
 
-	for(idx = 0; idx < list->nnodes;) {
-		bson_oid_t docid;
-		bson_t blocklist, sub;
-		off_t last_end = 0;
-		struct enode * cur = &list->list[idx];
-		const off_t cur_start = cur->off;
-		int nhashes = 0;
-
-		bson_oid_init(&docid, NULL);
-		bson_init(&doc);
-		bson_append_oid(&doc, KEYEXP("_id"), &docid);
-		bson_append_oid(&doc, KEYEXP("inode"), &e->oid);
-		bson_append_int64(&doc, KEYEXP("start"), cur->off);
-		bson_append_array_begin(&doc, KEYEXP("blocks"), &blocklist);
-		towrite = 0;
-		for(; idx < list->nnodes; idx++) {
-			bson_t blockentry;
-			cur = &list->list[idx];
-			char idxbuf[10];
-			const char *idxstr;
-
-			if(last_end > 0 && cur->off != last_end)
-				break;
-
-			size_t idxlen = bson_uint32_to_string(
-				nhashes++, &idxstr, idxbuf, sizeof(idxbuf));
-			
-			bson_append_document_begin(&blocklist, idxstr, idxlen, &blockentry);
-			if(cur->empty)
-				bson_append_null(&blockentry, KEYEXP("hash"));
-			else
-				bson_append_binary(&blockentry, KEYEXP("hash"), 0,
-					cur->hash, HASH_LEN);
-			bson_append_int32(&blockentry, KEYEXP("len"), cur->len);
-			bson_append_document_end(&blocklist, &blockentry);
+	// There can't be more runs than there are enodes.
+	if((conds = calloc(list->nnodes, sizeof(bson_t))) == NULL)
+		return -ENOMEM;
+	bulk = mongoc_collection_create_bulk_operation(coll,
+		true, // ordered
+		NULL); // write concern
 
-			last_end = cur->off + cur->len;
-			towrite++;
-		}
-		
-		bson_append_array_end(&doc, &blocklist);
-		bson_append_int64(&doc, KEYEXP("end"), last_end);
+	for(idx = 0; idx < list->nnodes;) {
+		bson_t sub;
+		const int first = idx;
+		const off_t cur_start = list->list[idx].off;
+		off_t last_end = cur_start + list->list[idx].len;
 
-		res = mongoc_collection_insert(coll,
-			0, // flags
-			&doc,
-			NULL, // write concern
-			&dberr);
+		for(idx++; idx < list->nnodes && list->list[idx].off == last_end;
+			idx++)
+			last_end += list->list[idx].len;
 
+		bson_oid_init(&docid, NULL);
+		build_extent_doc(&doc, &docid, &e->oid,
+			&list->list[first], idx - first);
+		mongoc_bulk_operation_insert(bulk, &doc);
 		bson_destroy(&doc);
-		
-		if(!res) {
-			logit(ERROR, "Error inserting extent: %s", dberr.message);
-			return -EIO;
-		}
 
 		// { 
 		//   _id: { $lt: ObjectId(this) }, 
 		//   start: { $gte: cur_start },
 		//   end: { $lte: last_end }
 	    // }
-		bson_init(&cond);
-		bson_append_document_begin(&cond, KEYEXP("_id"), &sub);
-		bson_append_oid(&cond, KEYEXP("$lt"), &docid);
-		bson_append_document_end(&cond, &sub);
-		bson_append_oid(&cond, KEYEXP("inode"), &e->oid);
-		bson_append_document_begin(&cond, KEYEXP("start"), &sub);
+		bson_t * c = &conds[ncond++];
+		bson_init(c);
+		bson_append_document_begin(c, KEYEXP("_id"), &sub);
+		bson_append_oid(&sub, KEYEXP("$lt"), &docid);
+		bson_append_document_end(c, &sub);
+		bson_append_oid(c, KEYEXP("inode"), &e->oid);
+		bson_append_document_begin(c, KEYEXP("start"), &sub);
 		bson_append_int64(&sub, KEYEXP("$gte"), cur_start);
-		bson_append_document_end(&cond, &sub);
-		bson_append_document_begin(&cond, KEYEXP("end"), &sub);
+		bson_append_document_end(c, &sub);
+		bson_append_document_begin(c, KEYEXP("end"), &sub);
 		bson_append_int64(&sub, KEYEXP("$lte"), last_end);
-		bson_append_document_end(&cond, &sub);
-
-		res = mongoc_collection_delete(coll,
-			0, // flags
-			&cond,
-			NULL, // write concern
-			&dberr);
-		bson_destroy(&cond);
+		bson_append_document_end(c, &sub);
+	}
 
-		if(!res)
-			logit(WARN, "Error cleaning up extent: %s", dberr.message);
+	for(idx = 0; idx < ncond; idx++) {
+		mongoc_bulk_operation_remove(bulk, &conds[idx]);
+		bson_destroy(&conds[idx]);
+	}
+	free(conds);
+
+	start = stats_start();
+	res = mongoc_bulk_operation_execute(bulk, &reply, &dberr);
+	trace_docs(ncond, 0);
+	stats_end(STAT_DB_INSERT, start);
+	bson_destroy(&reply);
+	mongoc_bulk_operation_destroy(bulk);
+
+	if(!res) {
+		logit(ERROR, "Error writing extents: %s", dberr.message);
+		return -EIO;
 	}
 
 	list->nnodes = 0;
+	note_extents_written(&e->oid);
+	return bump_extgen(e, &docid);
+}
+
+int serialize_extent(struct inode * e, struct elist * list) {
+	int span = span_begin("serialize_extent");
+	int res = write_extents(e, list);
+	span_end(span, 0, 0);
+	return res;
+}
+
+// Drops everything in list at or past off, and trims what runs into it.
+void elist_truncate(struct elist * list, off_t off) {
+	size_t idx, keep = 0;
+
+	for(idx = 0; idx < list->nnodes; idx++) {
+		struct enode * cur = &list->list[idx];
+		if(cur->off >= off)
+			continue;
+		if(cur->off + cur->len > off)
+			cur->len = off - cur->off;
+		list->list[keep++] = *cur;
+	}
+	list->nnodes = keep;
+}
+
+// Rewrites one extent document to end at off.
+static int cut_extent_doc(const bson_t * doc, off_t off) {
+	mongoc_collection_t * coll = get_coll(COLL_EXTENTS);
+	bson_t cond, update, set, newblocks, newentry;
+	bson_iter_t iter, blocks, entry;
+	bson_error_t dberr;
+	char idxbuf[10];
+	const char * idxstr;
+	size_t idxlen;
+	uint32_t i = 0;
+	off_t curoff;
+	uint64_t start;
+	bool res;
+
+	if(!bson_iter_init_find(&iter, doc, "start"))
+		return -EIO;
+	curoff = bson_iter_int64(&iter);
+	if(!bson_iter_init_find(&iter, doc, "blocks") ||
+		!bson_iter_recurse(&iter, &blocks))
+		return -EIO;
+
+	bson_init(&update);
+	bson_append_document_begin(&update, KEYEXP("$set"), &set);
+	bson_append_array_begin(&set, KEYEXP("blocks"), &newblocks);
+	while(curoff < off && bson_iter_next(&blocks)) {
+		int32_t len = 0;
+
+		idxlen = bson_uint32_to_string(i++, &idxstr, idxbuf, sizeof(idxbuf));
+		bson_append_document_begin(&newblocks, idxstr, idxlen, &newentry);
+		bson_iter_recurse(&blocks, &entry);
+		while(bson_iter_next(&entry)) {
+			if(strcmp(bson_iter_key(&entry), "len") == 0)
+				len = bson_iter_int32(&entry);
+			else
+				bson_append_iter(&newentry, NULL, 0, &entry);
+		}
+		bson_append_int32(&newentry, KEYEXP("len"),
+			curoff + len > off ? off - curoff : len);
+		bson_append_document_end(&newblocks, &newentry);
+		curoff += len;
+	}
+	bson_append_array_end(&set, &newblocks);
+	bson_append_int64(&set, KEYEXP("end"), off);
+	bson_append_document_end(&update, &set);
+
+	bson_init(&cond);
+	bson_iter_init_find(&iter, doc, "_id");
+	bson_append_iter(&cond, NULL, 0, &iter);
+
+	start = stats_start();
+	res = mongoc_collection_update(coll,
+		MONGOC_UPDATE_NONE,
+		&cond,
+		&update,
+		NULL, // write concern
+		&dberr);
+	stats_end(STAT_DB_UPDATE, start);
+	bson_destroy(&cond);
+	bson_destroy(&update);
+
+	if(!res) {
+		logit(ERROR, "Error cutting extent: %s", dberr.message);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Cuts the extent documents of e that run past off so they end there.
+ * Documents that start at or past off are left for the caller to
+ * remove.
+ */
+int cut_extents(struct inode * e, off_t off) {
+	mongoc_collection_t * coll = get_coll(COLL_EXTENTS);
+	mongoc_cursor_t * curs;
+	const bson_t * doc;
+	bson_t query, sub;
+	bson_t ** docs = NULL;
+	bson_error_t dberr;
+	size_t idx, ndocs = 0;
+	uint64_t start;
+	int res = 0;
+
+	bson_init(&query);
+	bson_append_oid(&query, KEYEXP("inode"), &e->oid);
+	bson_append_document_begin(&query, KEYEXP("start"), &sub);
+	bson_append_int64(&sub, KEYEXP("$lt"), off);
+	bson_append_document_end(&query, &sub);
+	bson_append_document_begin(&query, KEYEXP("end"), &sub);
+	bson_append_int64(&sub, KEYEXP("$gt"), off);
+	bson_append_document_end(&query, &sub);
+
+	start = stats_start();
+	curs = mongoc_collection_find(coll,
+		MONGOC_QUERY_NONE,
+		0, // skip
+		0, // limit
+		0, // batch size
+		&query,
+		NULL, // fields
+		NULL); // read prefs
+	bson_destroy(&query);
+	if(!curs)
+		return -EIO;
+
+	while(res == 0 && mongoc_cursor_next(curs, &doc)) {
+		bson_t ** tmp = realloc(docs, (ndocs + 1) * sizeof(bson_t *));
+		if(!tmp || (tmp[ndocs] = bson_copy(doc)) == NULL) {
+			if(tmp)
+				docs = tmp;
+			res = -ENOMEM;
+			break;
+		}
+		docs = tmp;
+		ndocs++;
+	}
+	stats_end(STAT_DB_FIND, start);
+	if(res == 0 && mongoc_cursor_error(curs, &dberr)) {
+		logit(ERROR, "Error finding extents to cut: %s", dberr.message);
+		res = -EIO;
+	}
+	mongoc_cursor_destroy(curs);
+
+	for(idx = 0; idx < ndocs; idx++) {
+		if(res == 0)
+			res = cut_extent_doc(docs[idx], off);
+		bson_destroy(docs[idx]);
+	}
+	free(docs);
+	return res;
+}
+
+struct doc_run {
+	bson_oid_t id;
+	size_t first;
+	size_t count;
+};
+
+static int doc_run_cmp(const void * ra, const void * rb) {
+	const struct doc_run * a = (const struct doc_run *)ra;
+	const struct doc_run * b = (const struct doc_run *)rb;
+	return bson_oid_compare(&a->id, &b->id);
+}
+
+/*
+ * The query comes back sorted by start so it can use the index, but
+ * documents with bigger _ids win. This puts each document's enodes
+ * back in _id order, so the enodes from newer documents get the bigger
+ * seqs.
+ */
+static int order_by_id(struct elist ** pout, struct doc_run * runs,
+	size_t nruns) {
+	struct elist * in = *pout, * out;
+	size_t i, j, n = 0;
+
+	if(!in || nruns < 2)
+		return 0;
+	qsort(runs, nruns, sizeof(struct doc_run), doc_run_cmp);
+	out = malloc(sizeof(struct elist) + (sizeof(struct enode) * in->nslots));
+	if(!out)
+		return -ENOMEM;
+	out->nnodes = in->nnodes;
+	out->nslots = in->nslots;
+	for(i = 0; i < nruns; i++) {
+		for(j = 0; j < runs[i].count; j++, n++) {
+			out->list[n] = in->list[runs[i].first + j];
+			out->list[n].seq = n;
+		}
+	}
+	free(in);
+	*pout = out;
 	return 0;
 }
 
-int deserialize_extent(struct inode * e, off_t off, size_t len, struct elist ** pout) {
+/*
+ * If pids isn't NULL it gets the _ids of every extent document that was
+ * read, which the caller must free.
+ */
+static int query_extents(struct inode * e, off_t off, size_t len,
+	struct elist ** pout, bson_oid_t ** pids, size_t * pnids) {
 	bson_t cond, query, orderby, sub;
 	const bson_t * curdoc;
 	mongoc_collection_t * coll = get_coll(COLL_EXTENTS);
@@ -186,6 +491,11 @@ int deserialize_extent(struct inode * e, off_t off, size_t len, struct elist **
 	int res;
 	const off_t end = off + len;
 	struct elist * out = NULL;
+	bson_oid_t * ids = NULL;
+	size_t nids = 0, idslots = 0;
+	struct doc_run * runs = NULL;
+	size_t nruns = 0;
+	uint64_t ndocs = 0, nbytes = 0;
 
 	/* start <= end && end >= start */
 	/* {
@@ -227,6 +537,26 @@ int deserialize_extent(struct inode * e, off_t off, size_t len, struct elist **
 		bson_iter_t topi, i, sub;
 		off_t curoff = 0;
 		const char * key;
+		struct doc_run * run;
+
+		ndocs++;
+		nbytes += curdoc->len;
+		if(nruns % BLOCKS_PER_EXTENT == 0) {
+			struct doc_run * tmp = realloc(runs,
+				(nruns + BLOCKS_PER_EXTENT) * sizeof(struct doc_run));
+			if(!tmp) {
+				mongoc_cursor_destroy(curs);
+				bson_destroy(&cond);
+				free(runs);
+				free(ids);
+				free(out);
+				return -ENOMEM;
+			}
+			runs = tmp;
+		}
+		run = &runs[nruns++];
+		memset(run, 0, sizeof(struct doc_run));
+		run->first = out ? out->nnodes : 0;
 
 		bson_iter_init(&topi, curdoc);
 		while(bson_iter_next(&topi)) {
@@ -235,14 +565,35 @@ int deserialize_extent(struct inode * e, off_t off, size_t len, struct elist **
 				bson_iter_recurse(&topi, &i);
 			else if(strcmp(key, "start") == 0)
 				curoff = bson_iter_int64(&topi);
+			else if(strcmp(key, "_id") == 0) {
+				bson_oid_copy(bson_iter_oid(&topi), &run->id);
+				if(!pids)
+					continue;
+				if(nids == idslots) {
+					bson_oid_t * tmp;
+					idslots += BLOCKS_PER_EXTENT;
+					tmp = realloc(ids, idslots * sizeof(bson_oid_t));
+					if(!tmp) {
+						mongoc_cursor_destroy(curs);
+						bson_destroy(&cond);
+						free(runs);
+						free(ids);
+						free(out);
+						return -ENOMEM;
+					}
+					ids = tmp;
+				}
+				bson_oid_copy(bson_iter_oid(&topi), &ids[nids++]);
+			}
 		}
 
 		while(bson_iter_next(&i)) {
 			bson_iter_recurse(&i, &sub);
-			const uint8_t * hash;
-			int curlen = 0;
+			uint8_t hash[HASH_LEN];
+			bson_iter_t hashi;
+			int curlen = 0, boff = 0;
 			off_t curend;
-			int empty = 0;
+			int empty = 0, alg = -1, hashfound = 0;
 
 			while(bson_iter_next(&sub)) {
 				key = bson_iter_key(&sub);
@@ -251,17 +602,29 @@ int deserialize_extent(struct inode * e, off_t off, size_t len, struct elist **
 					if(bt == BSON_TYPE_NULL)
 						empty = 1;
 					else {
-						bson_subtype_t subtype;
-						uint32_t hashsize;
-						bson_iter_binary(
-							&sub,
-							&subtype,
-							&hashsize,
-							&hash);
+						hashi = sub;
+						hashfound = 1;
 					}
 				}
+				else if(strcmp(key, "alg") == 0)
+					alg = bson_iter_int32(&sub);
 				else if(strcmp(key, "len") == 0)
 					curlen = bson_iter_int32(&sub);
+				else if(strcmp(key, "boff") == 0)
+					boff = bson_iter_int32(&sub);
+			}
+
+			if(!empty) {
+				if(!hashfound ||
+					(alg = read_hash(&hashi, alg, hash)) < 0) {
+					logit(ERROR, "Unknown block hash in extent");
+					mongoc_cursor_destroy(curs);
+					bson_destroy(&cond);
+					free(runs);
+					free(ids);
+					free(out);
+					return -EIO;
+				}
 			}
 
 			curend = curoff + curlen;
@@ -272,18 +635,209 @@ int deserialize_extent(struct inode * e, off_t off, size_t len, struct elist **
 
 			if(empty)
 				res = insert_empty(&out, curoff, curlen);
-			else
-				res = insert_hash(&out, curoff, curlen, hash);
+			else if((res = insert_hash(&out, curoff, curlen,
+				alg, hash)) == 0)
+				out->list[out->nnodes - 1].boff = boff;
 			if(res != 0) {
 				fprintf(stderr, "Error adding hash to extent tree\n");
+				free(runs);
+				free(ids);
 				return res;
 			}
 			curoff += curlen;
 		}
+		run->count = (out ? out->nnodes : 0) - run->first;
 	}
 	mongoc_cursor_destroy(curs);
 	bson_destroy(&cond);
+	trace_docs(ndocs, nbytes);
+	res = order_by_id(&out, runs, nruns);
+	free(runs);
+	if(res != 0) {
+		free(ids);
+		free(out);
+		return res;
+	}
 	*pout = out;
+	if(pids) {
+		*pids = ids;
+		*pnids = nids;
+	}
+
+	return 0;
+}
+
+static int read_extents(struct inode * e, off_t off, size_t len,
+	struct elist ** pout, bson_oid_t ** pids, size_t * pnids) {
+	uint64_t start = stats_start();
+	int res = query_extents(e, off, len, pout, pids, pnids);
+	stats_end(STAT_DB_FIND, start);
+	return res;
+}
+
+int deserialize_extent(struct inode * e, off_t off, size_t len,
+	struct elist ** pout) {
+	int span = span_begin("deserialize_extent");
+	int res = read_extents(e, off, len, pout, NULL, NULL);
+	span_end(span, 0, 0);
+	return res;
+}
+
+
+/*
+ * The extent map is an elist kept sorted by offset with no two enodes
+ * overlapping, so finding the enodes for a range is a binary search.
+ * Inserting an enode trims or splits whatever it covers, the same way
+ * a later enode wins over an earlier one in mongo_read. boff keeps
+ * track of where a trimmed enode's data starts inside its block.
+ */
+static size_t map_search(struct elist * map, off_t off) {
+	size_t lo = 0, hi = map->nnodes;
+
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct enode * cur = &map->list[mid];
+		if(cur->off + (off_t)cur->len <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int map_insert(struct elist ** pmap, const struct enode * n) {
+	struct enode pieces[3];
+	const off_t nend = n->off + n->len;
+	size_t lo, hi, npieces = 0;
+	int res;
+
+	if(n->len == 0)
+		return 0;
+	// ensure_elist leaves at least two free slots, which is all a split
+	// can add.
+	if((res = ensure_elist(pmap)) != 0)
+		return res;
+
+	struct elist * map = *pmap;
+
+	lo = map_search(map, n->off);
+	for(hi = lo; hi < map->nnodes && map->list[hi].off < nend; hi++);
+
+	if(lo < hi && map->list[lo].off < n->off) {
+		pieces[npieces] = map->list[lo];
+		pieces[npieces].len = n->off - map->list[lo].off;
+		npieces++;
+	}
+	pieces[npieces++] = *n;
+	if(lo < hi) {
+		const struct enode * last = &map->list[hi - 1];
+		const off_t lastend = last->off + last->len;
+		if(lastend > nend) {
+			pieces[npieces] = *last;
+			pieces[npieces].off = nend;
+			pieces[npieces].len = lastend - nend;
+			pieces[npieces].boff += nend - last->off;
+			npieces++;
+		}
+	}
+
+	memmove(&map->list[lo + npieces], &map->list[hi],
+		(map->nnodes - hi) * sizeof(struct enode));
+	memcpy(&map->list[lo], pieces, npieces * sizeof(struct enode));
+	map->nnodes = map->nnodes - (hi - lo) + npieces;
+	return 0;
+}
+
+void map_truncate(struct elist * map, off_t off) {
+	size_t idx = map_search(map, off);
+
+	if(idx < map->nnodes && map->list[idx].off < off) {
+		map->list[idx].len = off - map->list[idx].off;
+		idx++;
+	}
+	if(idx < map->nnodes)
+		map->nnodes = idx;
+}
+
+int map_lookup(struct elist * map, off_t off, size_t len, struct elist ** pout) {
+	const off_t end = off + len;
+	size_t idx;
+	int res;
+
+	*pout = NULL;
+	for(idx = map_search(map, off); idx < map->nnodes; idx++) {
+		const struct enode * cur = &map->list[idx];
+		if(cur->off >= end)
+			break;
+		if((res = ensure_elist(pout)) != 0)
+			return res;
+		(*pout)->list[(*pout)->nnodes++] = *cur;
+	}
+	return 0;
+}
+
+#define MAP_LOAD_ALL ((size_t)INT64_MAX)
+
+/*
+ * Builds an extent map of everything for e in the database. If pids
+ * isn't NULL it also gets the _ids of the extent documents it was built
+ * from.
+ */
+int read_extent_map(struct inode * e, struct elist ** pmap,
+	bson_oid_t ** pids, size_t * pnids) {
+	struct elist * list = NULL, * map;
+	size_t idx;
+	int res;
+
+	*pmap = NULL;
+	if((res = read_extents(e, 0, MAP_LOAD_ALL, &list, pids, pnids)) != 0)
+		return res;
+
+	if((map = init_elist()) == NULL) {
+		res = -ENOMEM;
+		goto fail;
+	}
+
+	for(idx = 0; list && idx < list->nnodes; idx++) {
+		if((res = map_insert(&map, &list->list[idx])) != 0)
+			goto fail;
+	}
+	free(list);
+	*pmap = map;
+	return 0;
+
+fail:
+	free(list);
+	free(map);
+	if(pids) {
+		free(*pids);
+		*pids = NULL;
+	}
+	return res;
+}
+
+/*
+ * Must be called with e->wr_lock held.
+ */
+int load_extent_map(struct inode * e) {
+	struct elist * map;
+	size_t idx;
+	int res;
+
+	if((res = read_extent_map(e, &map, NULL, NULL)) != 0)
+		return res;
+
+	// Anything written through this handle that hasn't been serialized
+	// yet goes on top of what's in the database.
+	for(idx = 0; e->wr_extent && idx < e->wr_extent->nnodes; idx++) {
+		if((res = map_insert(&map, &e->wr_extent->list[idx])) != 0) {
+			free(map);
+			return res;
+		}
+	}
 
+	free(e->map);
+	e->map = map;
+	bson_oid_copy(&e->extgen, &e->map_gen);
 	return 0;
 }
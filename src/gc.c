@@ -0,0 +1,369 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "mongo-fuse.h"
+
+/*
+ * Garbage collection of blocks. Truncating, unlinking and overwriting
+ * files drops references to blocks, but the blocks themselves are shared
+ * between files by hash, so nothing removes them when the last reference
+ * goes away. Every gc_interval seconds a background thread streams the
+ * hashes out of every extent document into a filter, then removes the
+ * blocks that aren't in it.
+ *
+ * Blocks are written before the extents that refer to them, so anything
+ * created or touched in the last gc_grace seconds is left alone. Files
+ * that stay open write their extents out at least every
+ * writeout_interval seconds, which is kept well below gc_grace. Finding
+ * an existing block when deduplicating touches it too. Extents inserted
+ * while the filter is being built are scanned again before anything is
+ * removed, and compaction touches the blocks it rewrites because its new
+ * documents get old _ids. The filter can have false positives, which
+ * only means some garbage survives until a later pass.
+ *
+ * Each pass looks at no more than GC_MAX_CANDIDATES blocks and removes at
+ * most gc_rate blocks per second, so a big backlog is cleared over
+ * several passes without swamping the database.
+ */
+
+#define GC_MAX_CANDIDATES 100000
+#define GC_FILTER_MIN (1 << 20)
+// Extents from clocks a little behind ours still get scanned again.
+#define GC_CLOCK_SKEW 60
+
+struct gc_candidate {
+    uint8_t alg;
+    uint8_t hash[HASH_LEN];
+};
+
+static int gc_interval = 0;
+static int gc_grace = 0;
+static int gc_rate = 0;
+
+uint64_t gc_runs = 0;
+uint64_t gc_blocks_deleted = 0;
+uint64_t gc_bytes_reclaimed = 0;
+
+void setup_gc(int interval, int grace, int rate) {
+    gc_interval = interval;
+    gc_grace = grace;
+    gc_rate = rate;
+}
+
+// Adds every block hash in the extent documents matching query to f.
+static int mark_extents(struct hash_filter * f, const bson_t * query,
+    uint64_t * pcount) {
+    mongoc_collection_t * coll = get_coll(COLL_EXTENTS);
+    mongoc_cursor_t * curs;
+    const bson_t * doc;
+    bson_t fields;
+    bson_error_t dberr;
+    int res = 0;
+
+    bson_init(&fields);
+    bson_append_int32(&fields, KEYEXP("blocks.hash"), 1);
+    bson_append_int32(&fields, KEYEXP("blocks.alg"), 1);
+
+    curs = mongoc_collection_find(coll,
+        MONGOC_QUERY_NONE,
+        0, // skip
+        0, // limit
+        0, // batch size
+        query,
+        &fields,
+        NULL); // read prefs
+
+    bson_destroy(&fields);
+
+    if(!curs)
+        return -EIO;
+
+    while(mongoc_cursor_next(curs, &doc)) {
+        bson_iter_t iter, blocks, sub, hashi;
+
+        if(!bson_iter_init_find(&iter, doc, "blocks") ||
+            !bson_iter_recurse(&iter, &blocks))
+            continue;
+
+        while(bson_iter_next(&blocks)) {
+            uint8_t hash[HASH_LEN];
+            int alg = -1, hashfound = 0;
+
+            bson_iter_recurse(&blocks, &sub);
+            while(bson_iter_next(&sub)) {
+                const char * key = bson_iter_key(&sub);
+                if(strcmp(key, "hash") == 0) {
+                    hashi = sub;
+                    hashfound = 1;
+                }
+                else if(strcmp(key, "alg") == 0)
+                    alg = bson_iter_int32(&sub);
+            }
+
+            if(hashfound && read_hash(&hashi, alg, hash) >= 0) {
+                hash_filter_add(f, hash);
+                (*pcount)++;
+            }
+        }
+    }
+
+    if(mongoc_cursor_error(curs, &dberr)) {
+        logit(ERROR, "Error scanning extents for GC: %s", dberr.message);
+        res = -EIO;
+    }
+    mongoc_cursor_destroy(curs);
+    return res;
+}
+
+// Collects blocks older than cutoff that aren't in f.
+static int find_candidates(struct hash_filter * f, time_t cutoff,
+    struct gc_candidate * out, size_t * pcount) {
+    mongoc_collection_t * coll = get_coll(COLL_BLOCKS);
+    mongoc_cursor_t * curs;
+    const bson_t * doc;
+    bson_t query, sub, fields;
+    bson_error_t dberr;
+    size_t count = 0;
+    int res = 0;
+
+    bson_init(&query);
+    bson_append_document_begin(&query, KEYEXP("created"), &sub);
+    bson_append_time_t(&sub, KEYEXP("$lt"), cutoff);
+    bson_append_document_end(&query, &sub);
+    bson_init(&fields);
+    bson_append_int32(&fields, KEYEXP("_id"), 1);
+    bson_append_int32(&fields, KEYEXP("alg"), 1);
+
+    curs = mongoc_collection_find(coll,
+        MONGOC_QUERY_NONE,
+        0, // skip
+        0, // limit
+        0, // batch size
+        &query,
+        &fields,
+        NULL); // read prefs
+
+    bson_destroy(&query);
+    bson_destroy(&fields);
+
+    if(!curs)
+        return -EIO;
+
+    while(count < GC_MAX_CANDIDATES && mongoc_cursor_next(curs, &doc)) {
+        bson_iter_t iter;
+        int alg = -1;
+
+        if(bson_iter_init_find(&iter, doc, "alg"))
+            alg = bson_iter_int32(&iter);
+        if(!bson_iter_init_find(&iter, doc, "_id") ||
+            (alg = read_hash(&iter, alg, out[count].hash)) < 0)
+            continue;
+        if(hash_filter_check(f, out[count].hash))
+            continue;
+        out[count++].alg = alg;
+    }
+
+    if(mongoc_cursor_error(curs, &dberr)) {
+        logit(ERROR, "Error scanning blocks for GC: %s", dberr.message);
+        res = -EIO;
+    }
+    mongoc_cursor_destroy(curs);
+    *pcount = count;
+    return res;
+}
+
+/*
+ * Removes one block if it still hasn't been created or touched since
+ * cutoff. Returns 1 and the bytes it held in freed if it was removed, 0
+ * if it was left alone, or a negative errno.
+ */
+static int remove_block(const struct gc_candidate * c, time_t cutoff,
+    uint64_t * freed) {
+    mongoc_collection_t * coll = get_coll(COLL_BLOCKS);
+    bson_t query, sub, orlist, clause, cond, fields, reply;
+    bson_iter_t iter, data;
+    bson_error_t dberr;
+    int res = 0;
+
+    bson_init(&query);
+    append_hash(&query, KEYEXP("_id"), c->alg, c->hash);
+    bson_append_document_begin(&query, KEYEXP("created"), &sub);
+    bson_append_time_t(&sub, KEYEXP("$lt"), cutoff);
+    bson_append_document_end(&query, &sub);
+    bson_append_array_begin(&query, KEYEXP("$or"), &orlist);
+    bson_append_document_begin(&orlist, KEYEXP("0"), &clause);
+    bson_append_document_begin(&clause, KEYEXP("touched"), &cond);
+    bson_append_bool(&cond, KEYEXP("$exists"), false);
+    bson_append_document_end(&clause, &cond);
+    bson_append_document_end(&orlist, &clause);
+    bson_append_document_begin(&orlist, KEYEXP("1"), &clause);
+    bson_append_document_begin(&clause, KEYEXP("touched"), &cond);
+    bson_append_time_t(&cond, KEYEXP("$lt"), cutoff);
+    bson_append_document_end(&clause, &cond);
+    bson_append_document_end(&orlist, &clause);
+    bson_append_array_end(&query, &orlist);
+
+    bson_init(&fields);
+    bson_append_int32(&fields, KEYEXP("data"), 1);
+
+    if(!mongoc_collection_find_and_modify(coll,
+        &query,
+        NULL, // sort
+        NULL, // update
+        &fields,
+        true, // remove
+        false, // upsert
+        false, // new
+        &reply,
+        &dberr)) {
+        logit(WARN, "Error removing unreferenced block: %s", dberr.message);
+        res = -EIO;
+    }
+    else if(bson_iter_init_find(&iter, &reply, "value") &&
+        bson_iter_type(&iter) == BSON_TYPE_DOCUMENT) {
+        res = 1;
+        *freed = 0;
+        if(bson_iter_recurse(&iter, &data) && bson_iter_find(&data, "data") &&
+            bson_iter_type(&data) == BSON_TYPE_BINARY) {
+            bson_subtype_t subtype;
+            uint32_t len = 0;
+            const uint8_t * buf;
+
+            bson_iter_binary(&data, &subtype, &len, &buf);
+            *freed = len;
+        }
+    }
+
+    bson_destroy(&query);
+    bson_destroy(&fields);
+    bson_destroy(&reply);
+    return res;
+}
+
+// An ObjectId that sorts before every one generated at or after when.
+static void oid_from_time(time_t when, bson_oid_t * out) {
+    uint8_t bytes[12];
+    uint32_t t = (uint32_t)when;
+
+    memset(bytes, 0, sizeof(bytes));
+    bytes[0] = (t >> 24) & 0xff;
+    bytes[1] = (t >> 16) & 0xff;
+    bytes[2] = (t >> 8) & 0xff;
+    bytes[3] = t & 0xff;
+    bson_oid_init_from_data(out, bytes);
+}
+
+static int gc_pass() {
+    struct hash_filter filter;
+    struct gc_candidate * candidates = NULL;
+    bson_t query, sub;
+    bson_oid_t since;
+    bson_error_t dberr;
+    time_t start = time(NULL), cutoff = start - gc_grace, batch_start;
+    uint64_t nrefs = 0, deleted = 0, reclaimed = 0;
+    size_t ncand = 0, i, bytes;
+    int64_t nblocks;
+    int res, inbatch = 0;
+
+    bson_init(&query);
+    nblocks = mongoc_collection_count(get_coll(COLL_BLOCKS),
+        MONGOC_QUERY_NONE, &query, 0, 0, NULL, &dberr);
+    bson_destroy(&query);
+    if(nblocks < 0) {
+        logit(WARN, "Error counting blocks for GC: %s", dberr.message);
+        return -EIO;
+    }
+    if(nblocks == 0)
+        return 0;
+
+    // About 16 bits per block keeps false positives well under 1%.
+    bytes = (size_t)nblocks * 2;
+    if(bytes < GC_FILTER_MIN)
+        bytes = GC_FILTER_MIN;
+    if(hash_filter_init(&filter, bytes) != 0)
+        return -ENOMEM;
+
+    bson_init(&query);
+    res = mark_extents(&filter, &query, &nrefs);
+    bson_destroy(&query);
+    if(res != 0)
+        goto end;
+
+    if((candidates = calloc(GC_MAX_CANDIDATES,
+        sizeof(struct gc_candidate))) == NULL) {
+        res = -ENOMEM;
+        goto end;
+    }
+    if((res = find_candidates(&filter, cutoff, candidates, &ncand)) != 0)
+        goto end;
+
+    oid_from_time(start - GC_CLOCK_SKEW, &since);
+    bson_init(&query);
+    bson_append_document_begin(&query, KEYEXP("_id"), &sub);
+    bson_append_oid(&sub, KEYEXP("$gte"), &since);
+    bson_append_document_end(&query, &sub);
+    res = mark_extents(&filter, &query, &nrefs);
+    bson_destroy(&query);
+    if(res != 0)
+        goto end;
+
+    batch_start = time(NULL);
+    for(i = 0; i < ncand; i++) {
+        uint64_t freed;
+
+        if(hash_filter_check(&filter, candidates[i].hash))
+            continue;
+        if(gc_rate > 0 && inbatch == gc_rate) {
+            while(time(NULL) <= batch_start)
+                sleep(1);
+            batch_start = time(NULL);
+            inbatch = 0;
+        }
+        inbatch++;
+
+        if((res = remove_block(&candidates[i], cutoff, &freed)) < 0)
+            break;
+        if(res == 1) {
+            deleted++;
+            reclaimed += freed;
+        }
+        res = 0;
+    }
+
+    __sync_fetch_and_add(&gc_runs, 1);
+    __sync_fetch_and_add(&gc_blocks_deleted, deleted);
+    __sync_fetch_and_add(&gc_bytes_reclaimed, reclaimed);
+    logit(INFO, "Garbage collection removed %llu of %zu unreferenced blocks "
+        "(%llu bytes) out of %lld, %llu block references",
+        (unsigned long long)deleted, ncand,
+        (unsigned long long)reclaimed, (long long)nblocks,
+        (unsigned long long)nrefs);
+
+end:
+    free(candidates);
+    hash_filter_free(&filter);
+    return res;
+}
+
+static void * gc_worker(void * p) {
+    for(;;) {
+        sleep(gc_interval);
+        gc_pass();
+    }
+    return NULL;
+}
+
+void start_gc() {
+    pthread_t thread;
+
+    if(gc_interval == 0)
+        return;
+    if(pthread_create(&thread, NULL, gc_worker, NULL) != 0) {
+        logit(WARN, "Could not start garbage collection thread");
+        return;
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include "mongo-fuse.h"
+#ifdef __APPLE__
+#include <CommonCrypto/CommonDigest.h>
+#else
+#include <openssl/sha.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+/*
+ * Blocks are identified by a hash of their contents. Older versions of
+ * mongo-fuse always used SHA1, so a block or extent entry without an
+ * algorithm ID is SHA1, and SHA1 hashes can always be read back.
+ *
+ * New blocks are hashed with block_hash_alg, which is SHA1 unless the
+ * hash= mount option says otherwise. It's the same on every host by
+ * default because a block is only deduplicated against blocks hashed
+ * with the same algorithm. hash=auto picks SHA-256 on CPUs with the SHA
+ * extensions, where libcrypto runs it in hardware for about the cost of
+ * SHA1, so it's only for databases every client mounts from the same
+ * kind of CPU. Hashes shorter than HASH_LEN are zero-padded in memory so
+ * every hash can live in the same fixed-size buffers.
+ */
+
+static void hash_sha1(const char * buf, size_t len, uint8_t * out) {
+#ifdef __APPLE__
+    CC_SHA1(buf, len, out);
+#else
+    SHA1((const unsigned char*)buf, len, out);
+#endif
+}
+
+static void hash_sha256(const char * buf, size_t len, uint8_t * out) {
+#ifdef __APPLE__
+    CC_SHA256(buf, len, out);
+#else
+    SHA256((const unsigned char*)buf, len, out);
+#endif
+}
+
+struct hash_impl {
+    const char * name;
+    size_t len;
+    void (*hash)(const char * buf, size_t len, uint8_t * out);
+};
+
+static const struct hash_impl hash_impls[HASH_ALG_MAX] = {
+    { "sha1", 20, hash_sha1 },
+    { "sha256", 32, hash_sha256 },
+};
+
+int block_hash_alg = HASH_SHA1;
+
+static int have_sha_extensions() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (ebx & (1 << 29)) != 0;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Picks the algorithm for new blocks by name, or by what the CPU supports
+ * if name is "auto". NULL keeps SHA1. Returns -EINVAL for an unknown name.
+ */
+int setup_hash(const char * name) {
+    int i;
+
+    if(name == NULL)
+        return 0;
+    if(strcasecmp(name, "auto") == 0) {
+        block_hash_alg = have_sha_extensions() ? HASH_SHA256 : HASH_SHA1;
+        logit(INFO, "Hashing new blocks with %s",
+            hash_impls[block_hash_alg].name);
+        return 0;
+    }
+
+    for(i = 0; i < HASH_ALG_MAX; i++) {
+        if(strcasecmp(name, hash_impls[i].name) == 0) {
+            block_hash_alg = i;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+size_t hash_len(int alg) {
+    return hash_impls[alg].len;
+}
+
+/*
+ * Returns the algorithm that produces hashes of len bytes, for documents
+ * that don't say which one they used, or -1 if nothing does.
+ */
+int hash_alg_for_len(size_t len) {
+    int i;
+    for(i = 0; i < HASH_ALG_MAX; i++) {
+        if(hash_impls[i].len == len)
+            return i;
+    }
+    return -1;
+}
+
+void hash_block(int alg, const char * buf, size_t len, uint8_t out[HASH_LEN]) {
+    memset(out, 0, HASH_LEN);
+    hash_impls[alg].hash(buf, len, out);
+}
+
+
+/*
+ * Copies a binary hash out of a BSON document into a zero-padded buffer.
+ * If alg is -1 the algorithm is inferred from the length. Returns the
+ * algorithm, or -1 if the hash isn't one we know.
+ */
+int read_hash(const bson_iter_t * iter, int alg, uint8_t out[HASH_LEN]) {
+    bson_subtype_t subtype;
+    uint32_t len = 0;
+    const uint8_t * data = NULL;
+
+    if(bson_iter_type(iter) != BSON_TYPE_BINARY)
+        return -1;
+    bson_iter_binary(iter, &subtype, &len, &data);
+    if(alg < 0)
+        alg = hash_alg_for_len(len);
+    if(alg < 0 || alg >= HASH_ALG_MAX || hash_impls[alg].len != len)
+        return -1;
+    memset(out, 0, HASH_LEN);
+    memcpy(out, data, len);
+    return alg;
+}
+
+void append_hash(bson_t * doc, const char * key, size_t keylen,
+    int alg, const uint8_t hash[HASH_LEN]) {
+    bson_append_binary(doc, key, keylen, 0, hash, hash_impls[alg].len);
+}
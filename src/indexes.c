@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mongo-fuse.h"
+
+/*
+ * Indexes the hot queries depend on. Without them every path lookup,
+ * directory listing and extent read is a collection scan, which works
+ * fine on a test deployment and falls over on a real one. They're
+ * created at mount if they don't exist, in the background so mounting
+ * against a big existing database doesn't lock it while they build.
+ *
+ * After that each hot query is explained, and any that would still scan
+ * a whole collection is reported. An index that's still building counts
+ * as missing. With strict_indexes that stops the mount instead.
+ */
+
+#define MAX_INDEX_KEYS 3
+
+struct required_index {
+    int coll;
+    const char * keys[MAX_INDEX_KEYS];
+};
+
+static const struct required_index required_indexes[] = {
+    // get_inode, inode_exists and path_to_oid
+    { COLL_INODES, { "dirents" } },
+    // read_dirents and mongo_rmdir
+    { COLL_INODES, { "links.parent", "links.name" } },
+    // read_extents and the range deletes in serialize_extent
+    { COLL_EXTENTS, { "inode", "start", "end" } },
+    // find_candidates in gc
+    { COLL_BLOCKS, { "created" } },
+};
+
+#define NREQUIRED (sizeof(required_indexes) / sizeof(required_indexes[0]))
+
+static const char * coll_label(int coll) {
+    const char * names[] = { "inodes", "blocks", "extents" };
+    return names[coll];
+}
+
+static int ensure_indexes() {
+    mongoc_index_opt_t opt;
+    bson_error_t dberr;
+    size_t i, k;
+    int res = 0;
+
+    mongoc_index_opt_init(&opt);
+    opt.background = true;
+
+    for(i = 0; i < NREQUIRED; i++) {
+        const struct required_index * ri = &required_indexes[i];
+        bson_t keys;
+
+        bson_init(&keys);
+        for(k = 0; k < MAX_INDEX_KEYS && ri->keys[k]; k++)
+            bson_append_int32(&keys, ri->keys[k], -1, 1);
+        if(!mongoc_collection_ensure_index(get_coll(ri->coll), &keys,
+            &opt, &dberr)) {
+            logit(ERROR, "Could not create index on %s.%s: %s",
+                coll_label(ri->coll), ri->keys[0], dberr.message);
+            res = -EIO;
+        }
+        bson_destroy(&keys);
+    }
+    return res;
+}
+
+/*
+ * Looks through explain output for a collection scan. Older servers say
+ * BasicCursor, newer ones have a COLLSCAN stage somewhere in the plan.
+ * Plans the server didn't pick don't matter.
+ */
+static int plan_scans(bson_iter_t * iter) {
+    while(bson_iter_next(iter)) {
+        bson_iter_t sub;
+        const char * str;
+        uint32_t len;
+
+        if(strcmp(bson_iter_key(iter), "rejectedPlans") == 0)
+            continue;
+
+        switch(bson_iter_type(iter)) {
+        case BSON_TYPE_UTF8:
+            str = bson_iter_utf8(iter, &len);
+            if(strcmp(str, "COLLSCAN") == 0 || strcmp(str, "BasicCursor") == 0)
+                return 1;
+            break;
+        case BSON_TYPE_DOCUMENT:
+        case BSON_TYPE_ARRAY:
+            if(bson_iter_recurse(iter, &sub) && plan_scans(&sub))
+                return 1;
+            break;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Explains query against coll. Returns 1 if it would scan the whole
+ * collection, 0 if it wouldn't, or a negative errno.
+ */
+static int explain_scans(int coll, const char * what, bson_t * query) {
+    mongoc_cursor_t * curs;
+    const bson_t * doc;
+    bson_error_t dberr;
+    bson_iter_t iter;
+    int res = -EIO;
+
+    bson_append_bool(query, KEYEXP("$explain"), true);
+
+    curs = mongoc_collection_find(get_coll(coll),
+        MONGOC_QUERY_NONE,
+        0, // skip
+        1, // limit
+        0, // batch size
+        query,
+        NULL, // fields
+        NULL); // read prefs
+
+    if(!curs)
+        return -EIO;
+
+    if(mongoc_cursor_next(curs, &doc)) {
+        bson_iter_init(&iter, doc);
+        res = plan_scans(&iter);
+    }
+    else if(mongoc_cursor_error(curs, &dberr))
+        logit(WARN, "Could not explain %s: %s", what, dberr.message);
+    mongoc_cursor_destroy(curs);
+    return res;
+}
+
+static int verify_indexes() {
+    bson_t cond, query, sub;
+    bson_oid_t oid;
+    int res, scans = 0;
+
+    memset(&oid, 0, sizeof(oid));
+
+    bson_init(&cond);
+    bson_append_document_begin(&cond, KEYEXP("$query"), &query);
+    bson_append_utf8(&query, KEYEXP("dirents"), KEYEXP("/"));
+    bson_append_document_end(&cond, &query);
+    res = explain_scans(COLL_INODES, "path lookups", &cond);
+    bson_destroy(&cond);
+    if(res > 0)
+        logit(ERROR, "Path lookups scan the whole inodes collection");
+    scans += res > 0;
+
+    bson_init(&cond);
+    bson_append_document_begin(&cond, KEYEXP("$query"), &query);
+    bson_append_oid(&query, KEYEXP("links.parent"), &oid);
+    bson_append_document_end(&cond, &query);
+    res = explain_scans(COLL_INODES, "directory listings", &cond);
+    bson_destroy(&cond);
+    if(res > 0)
+        logit(ERROR, "Directory listings scan the whole inodes collection");
+    scans += res > 0;
+
+    bson_init(&cond);
+    bson_append_document_begin(&cond, KEYEXP("$query"), &query);
+    bson_append_oid(&query, KEYEXP("inode"), &oid);
+    bson_append_document_begin(&query, KEYEXP("start"), &sub);
+    bson_append_int64(&sub, KEYEXP("$lte"), 0);
+    bson_append_document_end(&query, &sub);
+    bson_append_document_begin(&query, KEYEXP("end"), &sub);
+    bson_append_int64(&sub, KEYEXP("$gte"), 0);
+    bson_append_document_end(&query, &sub);
+    bson_append_document_end(&cond, &query);
+    bson_append_document_begin(&cond, KEYEXP("$orderby"), &query);
+    bson_append_int32(&query, KEYEXP("start"), 1);
+    bson_append_int32(&query, KEYEXP("_id"), 1);
+    bson_append_document_end(&cond, &query);
+    res = explain_scans(COLL_EXTENTS, "extent reads", &cond);
+    bson_destroy(&cond);
+    if(res > 0)
+        logit(ERROR, "Extent reads scan the whole extents collection");
+    scans += res > 0;
+
+    bson_init(&cond);
+    bson_append_document_begin(&cond, KEYEXP("$query"), &query);
+    bson_append_document_begin(&query, KEYEXP("created"), &sub);
+    bson_append_time_t(&sub, KEYEXP("$lt"), 0);
+    bson_append_document_end(&query, &sub);
+    bson_append_document_end(&cond, &query);
+    res = explain_scans(COLL_BLOCKS, "garbage collection", &cond);
+    bson_destroy(&cond);
+    if(res > 0)
+        logit(ERROR, "Garbage collection scans the whole blocks collection");
+    scans += res > 0;
+
+    return scans ? -EIO : 0;
+}
+
+/*
+ * Creates any missing indexes and checks the hot queries use them.
+ * Returns -EIO if something is wrong, which has already been logged.
+ */
+int check_indexes() {
+    int res = ensure_indexes();
+    if(verify_indexes() != 0)
+        res = -EIO;
+    return res;
+}
@@ -64,9 +64,16 @@ int commit_inode(struct inode * e) {
     mongoc_collection_t * coll = get_coll(COLL_INODES);
     char istr_buf[4];
     struct dirent * cde = e->dirents;
-    int i;
+    uint64_t start;
+    int i, err;
     bool res;
 
+    for(; cde; cde = cde->next) {
+        if((err = link_parent(cde)) != 0)
+            return err;
+    }
+    cde = e->dirents;
+
     bson_init(&top);
     bson_append_document_begin(&top, KEYEXP("$set"), &doc);
     bson_append_oid(&doc, KEYEXP("_id"), &e->oid);
@@ -81,6 +88,7 @@ int commit_inode(struct inode * e) {
         cde = cde->next;
     }
     bson_append_array_end(&doc, &direntsarray);
+    append_links(&doc, e->dirents);
 
     bson_append_int32(&doc, KEYEXP("mode"), e->mode);
     bson_append_int64(&doc, KEYEXP("owner"), e->owner);
@@ -95,15 +103,18 @@ int commit_inode(struct inode * e) {
     bson_init(&cond);
     bson_append_oid(&cond, KEYEXP("_id"), &e->oid);
 
+    start = stats_start();
     res = mongoc_collection_update(coll,
         MONGOC_UPDATE_UPSERT,
         &cond,
         &top,
         NULL, // write_concern,
         &dberr);
+    stats_end(STAT_DB_UPSERT, start);
 
     bson_destroy(&cond);
     bson_destroy(&top);
+    attr_cache_invalidate_inode(e);
     if(!res) {
         char oidstr[25];
         bson_oid_to_string(&e->oid, oidstr);
@@ -117,10 +128,37 @@ int commit_inode(struct inode * e) {
 void init_inode(struct inode * e) {
     memset(e, 0, sizeof(struct inode));
     pthread_mutex_init(&e->wr_lock, NULL);
+    pthread_cond_init(&e->wr_cond, NULL);
+}
+
+// Picks up the parents in links if it matches the dirents we just read.
+static void read_links(const bson_t * doc, struct inode * out) {
+    bson_iter_t iter, sub, link;
+    struct dirent * cde;
+    int count = 0;
+
+    if(!bson_iter_init_find(&iter, doc, "links") ||
+        !bson_iter_recurse(&iter, &sub))
+        return;
+    while(bson_iter_next(&sub))
+        count++;
+    if(count != out->direntcount)
+        return;
+
+    bson_iter_recurse(&iter, &sub);
+    for(cde = out->dirents; cde && bson_iter_next(&sub); cde = cde->next) {
+        memset(&cde->parent, 0, sizeof(bson_oid_t));
+        if(bson_iter_recurse(&sub, &link) &&
+            bson_iter_find(&link, "parent") &&
+            bson_iter_type(&link) == BSON_TYPE_OID)
+            bson_oid_copy(bson_iter_oid(&link), &cde->parent);
+        cde->linked = 1;
+    }
 }
 
 int read_inode(const bson_t * doc, struct inode * out) {
     bson_iter_t iter, sub;
+    struct dirent ** tail = &out->dirents;
 
     bson_iter_init(&iter, doc);
 
@@ -140,6 +178,8 @@ int read_inode(const bson_t * doc, struct inode * out) {
             out->created = bson_iter_time_t(&iter);
         else if(strcmp(key, "modified") == 0)
             out->modified = bson_iter_time_t(&iter);
+        else if(strcmp(key, "extgen") == 0)
+            bson_oid_copy(bson_iter_oid(&iter), &out->extgen);
         else if(strcmp(key, "data") == 0)
             out->data = bson_iter_dup_utf8(&iter, (uint32_t*)&out->datalen);
         else if(strcmp(key, "dirents") == 0) {
@@ -148,7 +188,10 @@ int read_inode(const bson_t * doc, struct inode * out) {
                 free(out->dirents);
                 out->dirents = next;
             }
+            out->direntcount = 0;
+            tail = &out->dirents;
 
+            // Kept in the same order as the document so links line up.
             bson_iter_recurse(&iter, &sub);
             while(bson_iter_next(&sub)) {
                 uint32_t len;
@@ -158,49 +201,53 @@ int read_inode(const bson_t * doc, struct inode * out) {
                     return -ENOMEM;
                 strcpy(cde->path, pathstr);
                 cde->len = len;
-                cde->next = out->dirents;
-                out->dirents = cde;
+                cde->linked = 0;
+                cde->next = NULL;
+                *tail = cde;
+                tail = &cde->next;
                 out->direntcount++;
             }
         }
     }
 
+    read_links(doc, out);
     return 0;
 }
 
-int get_inode_impl(const char * path, struct inode * out) {
-    bson_t query;
+static int find_inode(bson_t * query, struct inode * out, const char * what) {
     const bson_t *doc;
-    int res;
+    int res, found;
     mongoc_collection_t * coll = get_coll(COLL_INODES);
     mongoc_cursor_t * curs;
-
-    bson_init(&query);
-    bson_append_utf8(&query, KEYEXP("dirents"), path, strlen(path));
+    uint64_t start = stats_start();
 
     curs = mongoc_collection_find(coll,
         MONGOC_QUERY_NONE,
         0, // skip
         1, // limit
         0, // batch size ??
-        &query,
+        query,
         NULL, // fields
         NULL); // write concern
 
-    bson_destroy(&query);
+    bson_destroy(query);
 
     if(!curs) {
-        logit(ERROR, "Error getting cursor for %s", path);
+        logit(ERROR, "Error getting cursor for %s", what);
         return -EIO;
     }
 
-    if(!mongoc_cursor_next(curs, &doc)) {
+    found = mongoc_cursor_next(curs, &doc);
+    stats_end(STAT_DB_FIND, start);
+    if(!found) {
         bson_error_t dberr;
+        res = -ENOENT;
         if(mongoc_cursor_error(curs, &dberr)) {
-            logit(ERROR, "Error getting inode for %s: %s", path, dberr.message);
-            return -EIO;
+            logit(ERROR, "Error getting inode for %s: %s", what, dberr.message);
+            res = -EIO;
         }
-        return -ENOENT;
+        mongoc_cursor_destroy(curs);
+        return res;
     }
 
     res = read_inode(doc, out);
@@ -209,15 +256,74 @@ int get_inode_impl(const char * path, struct inode * out) {
     return res;
 }
 
+int get_inode_impl(const char * path, struct inode * out) {
+    bson_t query;
+
+    bson_init(&query);
+    bson_append_utf8(&query, KEYEXP("dirents"), path, strlen(path));
+    return find_inode(&query, out, path);
+}
+
+int get_inode_by_oid(const bson_oid_t * oid, struct inode * out) {
+    bson_t query;
+    char oidstr[25];
+
+    init_inode(out);
+    bson_init(&query);
+    bson_append_oid(&query, KEYEXP("_id"), oid);
+    bson_oid_to_string(oid, oidstr);
+    return find_inode(&query, out, oidstr);
+}
+
+/*
+ * Gets the inode called name in the directory parent. This needs every
+ * inode to have links, so callers should check links_migrated.
+ */
+int get_child_inode(const bson_oid_t * parent, const char * name,
+    struct inode * out) {
+    bson_t query, links, match;
+
+    init_inode(out);
+    bson_init(&query);
+    bson_append_document_begin(&query, KEYEXP("links"), &links);
+    bson_append_document_begin(&links, KEYEXP("$elemMatch"), &match);
+    bson_append_oid(&match, KEYEXP("parent"), parent);
+    bson_append_utf8(&match, KEYEXP("name"), name, strlen(name));
+    bson_append_document_end(&links, &match);
+    bson_append_document_end(&query, &links);
+    return find_inode(&query, out, name);
+}
+
+/*
+ * Refreshes the attributes of an open file if they're more than a few
+ * seconds old. The inode is shared by everything using the file and
+ * extgen decides when its extent map is reloaded, so it's read into a
+ * copy and published under wr_lock.
+ */
 int get_cached_inode(const char * path, struct inode * out) {
     time_t now = time(NULL);
-    int res;
+    struct inode fresh;
+    int res, span;
     if(now - out->updated < 3)
         return 0;
 
-    res = get_inode_impl(path, out);
-    if(res == 0)
+    span = span_begin("get_cached_inode");
+    init_inode(&fresh);
+    res = get_inode_impl(path, &fresh);
+    span_end(span, 0, 0);
+    if(res == 0) {
+        pthread_mutex_lock(&out->wr_lock);
+        out->mode = fresh.mode;
+        out->owner = fresh.owner;
+        out->group = fresh.group;
+        out->size = fresh.size;
+        out->created = fresh.created;
+        out->modified = fresh.modified;
+        bson_oid_copy(&fresh.extgen, &out->extgen);
         out->updated = now;
+        pthread_mutex_unlock(&out->wr_lock);
+    }
+    free_inode(&fresh);
     return res;
 }
 
@@ -226,16 +332,71 @@ int get_inode(const char * path, struct inode * out) {
     return get_inode_impl(path, out);
 }
 
+/*
+ * Like get_inode, but only fills in the attributes in struct inode_attr
+ * and may answer from the attribute cache.
+ */
+int get_inode_attr(const char * path, struct inode * out) {
+    struct inode_attr attr;
+    uint64_t gen;
+    int res;
+
+    init_inode(out);
+    if((res = attr_cache_get(path, &attr, &gen)) == 0) {
+        out->mode = attr.mode;
+        out->owner = attr.owner;
+        out->group = attr.group;
+        out->size = attr.size;
+        out->created = attr.created;
+        out->modified = attr.modified;
+        out->direntcount = attr.direntcount;
+        return 0;
+    }
+    else if(res < 0)
+        return res;
+
+    res = get_inode_impl(path, out);
+    if(res == 0) {
+        attr.mode = out->mode;
+        attr.owner = out->owner;
+        attr.group = out->group;
+        attr.size = out->size;
+        attr.created = out->created;
+        attr.modified = out->modified;
+        attr.direntcount = out->direntcount;
+        attr_cache_put(path, &attr, gen);
+    }
+    else if(res == -ENOENT)
+        attr_cache_put(path, NULL, gen);
+    return res;
+}
+
+void inode_to_stat(struct inode * e, struct stat * stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_nlink = e->direntcount;
+    stbuf->st_mode = e->mode;
+    if(stbuf->st_mode & S_IFDIR)
+        stbuf->st_nlink++;
+    stbuf->st_uid = e->owner;
+    stbuf->st_gid = e->group;
+    stbuf->st_size = e->size;
+    stbuf->st_ctime = e->created;
+    stbuf->st_mtime = e->modified;
+    stbuf->st_atime = e->modified;
+}
+
 int check_access(struct inode * e, int amode) {
-    const struct fuse_context * fcx = fuse_get_context();
     mode_t mode = e->mode;
+    uid_t uid;
+    gid_t gid;
 
-    if(fcx->uid == 0 || amode == 0)
+    get_caller(&uid, &gid);
+    if(uid == 0 || amode == 0)
         return 0;
 
-    if(fcx->uid == e->owner)
+    if(uid == e->owner)
         mode >>= 6;
-    else if(fcx->gid == e->group)
+    else if(gid == e->group)
         mode >>= 3;
 
     return (((mode & S_IRWXO) & amode) == 0);
@@ -244,7 +405,8 @@ int check_access(struct inode * e, int amode) {
 int create_inode(const char * path, mode_t mode, const char * data) {
     struct inode e;
     int pathlen = strlen(path);
-    const struct fuse_context * fcx = fuse_get_context();
+    uid_t uid;
+    gid_t gid;
     int res;
 
     res = inode_exists(path);
@@ -259,12 +421,14 @@ int create_inode(const char * path, mode_t mode, const char * data) {
     e.dirents = malloc(sizeof(struct dirent) + pathlen);
     e.dirents->len = pathlen;
     strcpy(e.dirents->path, path);
+    e.dirents->linked = 0;
     e.dirents->next = NULL;
     e.direntcount = 1;
 
     e.mode = mode;
-    e.owner = fcx->uid;
-    e.group = fcx->gid;
+    get_caller(&uid, &gid);
+    e.owner = uid;
+    e.group = gid;
     e.created = time(NULL);
     e.modified = time(NULL);
     if(data) {
@@ -294,4 +458,7 @@ void free_inode(struct inode *e) {
     }
     if(e->wr_extent)
         free(e->wr_extent);
+    if(e->map)
+        free(e->map);
+    free_writeback(e);
 }
@@ -0,0 +1,259 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mongo-fuse.h"
+
+/*
+ * Directory links. Besides its full paths in dirents, every inode has a
+ * links array in the same order with the _id of the directory each path
+ * is in and the name it has there. Listing a directory or checking that
+ * it's empty is then an equality query on links.parent instead of a
+ * regex over every path in the filesystem.
+ *
+ * Inodes written before links existed are migrated in the background at
+ * mount. Until every inode has links, read_dirents falls back to the
+ * regex so nothing goes missing from listings in the meantime.
+ */
+
+int links_migrated = 0;
+
+int path_to_oid(const char * path, size_t len, bson_oid_t * out) {
+    mongoc_collection_t * coll = get_coll(COLL_INODES);
+    mongoc_cursor_t * curs;
+    const bson_t * doc;
+    bson_t query, fields;
+    bson_iter_t iter;
+    bson_error_t dberr;
+    uint64_t start;
+    int res = -ENOENT;
+
+    bson_init(&query);
+    bson_append_utf8(&query, KEYEXP("dirents"), path, len);
+    bson_init(&fields);
+    bson_append_int32(&fields, KEYEXP("_id"), 1);
+
+    start = stats_start();
+    curs = mongoc_collection_find(coll,
+        MONGOC_QUERY_NONE,
+        0, // skip
+        1, // limit
+        0, // batch size
+        &query,
+        &fields,
+        NULL); // read prefs
+
+    bson_destroy(&query);
+    bson_destroy(&fields);
+
+    if(!curs)
+        return -EIO;
+
+    res = mongoc_cursor_next(curs, &doc) ? 0 : -ENOENT;
+    stats_end(STAT_DB_FIND, start);
+    if(res == 0) {
+        res = -ENOENT;
+        if(bson_iter_init_find(&iter, doc, "_id") &&
+            bson_iter_type(&iter) == BSON_TYPE_OID) {
+            bson_oid_copy(bson_iter_oid(&iter), out);
+            res = 0;
+        }
+    }
+    else if(mongoc_cursor_error(curs, &dberr)) {
+        logit(ERROR, "Error looking up %.*s: %s", (int)len, path,
+            dberr.message);
+        res = -EIO;
+    }
+    mongoc_cursor_destroy(curs);
+    return res;
+}
+
+/*
+ * Looks up the directory d is in, if that hasn't been done yet. Only the
+ * root gets a zeroed parent, which is stored as null. Any other path
+ * whose directory doesn't exist is left unlinked and gets -ENOENT, so it
+ * can't be stored where no listing would find it.
+ */
+int link_parent(struct dirent * d) {
+    size_t plen = d->len;
+    int res;
+
+    if(d->linked)
+        return 0;
+
+    memset(&d->parent, 0, sizeof(bson_oid_t));
+    while(plen > 0 && d->path[plen - 1] != '/')
+        plen--;
+    if(plen > 1)
+        plen--;
+
+    if(plen > 0 && plen < d->len) {
+        res = path_to_oid(d->path, plen, &d->parent);
+        if(res == -ENOENT)
+            logit(WARN, "Not linking %.*s, its directory doesn't exist",
+                (int)d->len, d->path);
+        if(res != 0)
+            return res;
+    }
+    d->linked = 1;
+    return 0;
+}
+
+void append_links(bson_t * doc, struct dirent * dirents) {
+    static const bson_oid_t noparent;
+    bson_t linksarray, link;
+    char istr_buf[16];
+    uint32_t i = 0;
+
+    bson_append_array_begin(doc, KEYEXP("links"), &linksarray);
+    for(; dirents; dirents = dirents->next) {
+        const char * keystr, * name = dirents->path + dirents->len;
+        size_t keylen;
+
+        while(name > dirents->path && *(name - 1) != '/')
+            name--;
+
+        keylen = bson_uint32_to_string(i++, &keystr, istr_buf, sizeof(istr_buf));
+        bson_append_document_begin(&linksarray, keystr, keylen, &link);
+        if(bson_oid_equal(&dirents->parent, &noparent))
+            bson_append_null(&link, KEYEXP("parent"));
+        else
+            bson_append_oid(&link, KEYEXP("parent"), &dirents->parent);
+        bson_append_utf8(&link, KEYEXP("name"), name,
+            dirents->path + dirents->len - name);
+        bson_append_document_end(&linksarray, &link);
+    }
+    bson_append_array_end(doc, &linksarray);
+}
+
+static int migrate_inode(const bson_t * doc) {
+    mongoc_collection_t * coll = get_coll(COLL_INODES);
+    struct inode e;
+    struct dirent * d;
+    bson_t cond, sub, update, set;
+    bson_error_t dberr;
+    int res;
+
+    init_inode(&e);
+    if((res = read_inode(doc, &e)) != 0)
+        goto end;
+    for(d = e.dirents; d; d = d->next) {
+        if((res = link_parent(d)) != 0)
+            goto end;
+    }
+
+    // Anything that changed the inode since we read it wrote links too.
+    bson_init(&cond);
+    bson_append_oid(&cond, KEYEXP("_id"), &e.oid);
+    bson_append_document_begin(&cond, KEYEXP("links"), &sub);
+    bson_append_bool(&sub, KEYEXP("$exists"), false);
+    bson_append_document_end(&cond, &sub);
+
+    bson_init(&update);
+    bson_append_document_begin(&update, KEYEXP("$set"), &set);
+    append_links(&set, e.dirents);
+    bson_append_document_end(&update, &set);
+
+    if(!mongoc_collection_update(coll,
+        MONGOC_UPDATE_NONE,
+        &cond,
+        &update,
+        NULL, // write concern
+        &dberr)) {
+        logit(ERROR, "Error adding links to inode: %s", dberr.message);
+        res = -EIO;
+    }
+    bson_destroy(&cond);
+    bson_destroy(&update);
+
+end:
+    free_inode(&e);
+    return res;
+}
+
+static int64_t count_unmigrated() {
+    bson_t query, sub;
+    bson_error_t dberr;
+    int64_t count;
+
+    bson_init(&query);
+    bson_append_document_begin(&query, KEYEXP("links"), &sub);
+    bson_append_bool(&sub, KEYEXP("$exists"), false);
+    bson_append_document_end(&query, &sub);
+    count = mongoc_collection_count(get_coll(COLL_INODES),
+        MONGOC_QUERY_NONE, &query, 0, 0, NULL, &dberr);
+    bson_destroy(&query);
+    if(count < 0)
+        logit(ERROR, "Error counting inodes without links: %s",
+            dberr.message);
+    return count;
+}
+
+static void * migrate_worker(void * p) {
+    mongoc_collection_t * coll = get_coll(COLL_INODES);
+    mongoc_cursor_t * curs;
+    const bson_t * doc;
+    bson_t query, sub;
+    bson_error_t dberr;
+    uint64_t count = 0;
+    int64_t left;
+
+    bson_init(&query);
+    bson_append_document_begin(&query, KEYEXP("links"), &sub);
+    bson_append_bool(&sub, KEYEXP("$exists"), false);
+    bson_append_document_end(&query, &sub);
+
+    curs = mongoc_collection_find(coll,
+        MONGOC_QUERY_NONE,
+        0, // skip
+        0, // limit
+        0, // batch size
+        &query,
+        NULL, // fields
+        NULL); // read prefs
+
+    bson_destroy(&query);
+
+    if(!curs) {
+        logit(ERROR, "Error getting cursor to migrate directory links");
+        return NULL;
+    }
+
+    while(mongoc_cursor_next(curs, &doc)) {
+        if(migrate_inode(doc) == 0)
+            count++;
+    }
+    if(mongoc_cursor_error(curs, &dberr))
+        logit(ERROR, "Error migrating directory links: %s", dberr.message);
+    mongoc_cursor_destroy(curs);
+
+    if((left = count_unmigrated()) == 0) {
+        links_migrated = 1;
+        logit(INFO, "Added directory links to %llu inodes",
+            (unsigned long long)count);
+    }
+    else if(left > 0)
+        logit(WARN, "%lld inodes still have no directory links, "
+            "directories will be listed by path until the next mount",
+            (long long)left);
+    return NULL;
+}
+
+void start_link_migration() {
+    pthread_t thread;
+    int64_t left;
+
+    if((left = count_unmigrated()) == 0) {
+        links_migrated = 1;
+        return;
+    }
+    else if(left < 0)
+        return;
+
+    logit(INFO, "Adding directory links to %lld inodes", (long long)left);
+    if(pthread_create(&thread, NULL, migrate_worker, NULL) != 0) {
+        logit(WARN, "Could not start directory links migration thread");
+        return;
+    }
+    pthread_detach(thread);
+}
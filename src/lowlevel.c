@@ -0,0 +1,938 @@
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "mongo-fuse.h"
+
+/*
+ * Front end for the low-level FUSE API. The kernel hands us inode
+ * numbers instead of paths, and caches lookups for entry_ttl and
+ * attributes for attr_ttl, so walking a path or stat-ing the same file
+ * over and over doesn't come back to us at all.
+ *
+ * Inode numbers come from hashing the inode's ObjectId, so they're the
+ * same on every mount and every client. The root is always 1. The table
+ * here maps the numbers the kernel knows about back to the ObjectId and
+ * the path we found it by, and forget drops them again. Lookups go by
+ * (parent, name) through links and getattr goes by _id; everything else
+ * calls the path-based operations in mongo_oper with the path from the
+ * table, so both front ends share one implementation. Renaming a
+ * directory moves the paths of everything under it in the table too,
+ * and a node whose path is unlinked or renamed over is pointed at
+ * another of its paths, found by _id.
+ *
+ * The stats files in the root aren't inodes. They get the numbers right
+ * after the root, which hashed inodes never use, and stay in the table
+ * for the whole mount.
+ */
+
+#define NODE_BUCKETS 4096
+#define STATS_TEXT_INO 2
+#define STATS_JSON_INO 3
+#define STATS_SLOWLOG_INO 4
+#define FIRST_HASHED_INO 5
+
+struct ll_node {
+    struct ll_node * next;
+    fuse_ino_t ino;
+    bson_oid_t oid;
+    uint64_t nlookup;
+    struct inode * open_file;
+    char * path;
+};
+
+struct ll_dirbuf {
+    fuse_req_t req;
+    char * buf;
+    size_t size;
+};
+
+extern struct fuse_operations mongo_oper;
+
+int use_lowlevel = 0;
+static struct ll_node * nodes[NODE_BUCKETS];
+static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static bson_oid_t root_oid;
+static double entry_timeout = 1.0;
+static double attr_timeout = 1.0;
+static double negative_timeout = 1.0;
+static struct fuse_session * ll_session = NULL;
+static __thread fuse_req_t cur_req = NULL;
+
+void setup_lowlevel(unsigned int entryttl, unsigned int attrttl,
+    unsigned int negttl) {
+    use_lowlevel = 1;
+    entry_timeout = entryttl / 1000.0;
+    attr_timeout = attrttl / 1000.0;
+    negative_timeout = negttl / 1000.0;
+}
+
+/*
+ * Who's making the current request. The high-level API keeps this in
+ * the fuse context; here it comes from the request, and things done
+ * outside of a request (like creating the root at mount) belong to
+ * whoever mounted the filesystem.
+ */
+void get_caller(uid_t * uid, gid_t * gid) {
+    if(!use_lowlevel) {
+        const struct fuse_context * fcx = fuse_get_context();
+        *uid = fcx->uid;
+        *gid = fcx->gid;
+    }
+    else if(cur_req) {
+        const struct fuse_ctx * ctx = fuse_req_ctx(cur_req);
+        *uid = ctx->uid;
+        *gid = ctx->gid;
+    }
+    else {
+        *uid = getuid();
+        *gid = getgid();
+    }
+}
+
+uint64_t oid_ino(const bson_oid_t * oid) {
+    uint64_t h = 0;
+    int i;
+
+    if(bson_oid_equal(oid, &root_oid))
+        return FUSE_ROOT_ID;
+    for(i = 0; i < 12; i++) {
+        h ^= oid->bytes[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 29;
+    return h < FIRST_HASHED_INO ? h + FIRST_HASHED_INO : h;
+}
+
+static struct ll_node ** find_node(fuse_ino_t ino) {
+    struct ll_node ** pp = &nodes[ino % NODE_BUCKETS];
+    while(*pp && (*pp)->ino != ino)
+        pp = &(*pp)->next;
+    return pp;
+}
+
+/*
+ * Adds a lookup of oid by path and returns its inode number, or 0 if
+ * it's out of memory or another inode got the same number.
+ */
+static fuse_ino_t remember(const bson_oid_t * oid, const char * path) {
+    fuse_ino_t ino = oid_ino(oid);
+    struct ll_node ** pp, * n;
+    char * newpath = strdup(path);
+
+    if(!newpath)
+        return 0;
+
+    pthread_mutex_lock(&nodes_lock);
+    pp = find_node(ino);
+    if((n = *pp) == NULL) {
+        if((n = calloc(1, sizeof(struct ll_node))) == NULL) {
+            pthread_mutex_unlock(&nodes_lock);
+            free(newpath);
+            return 0;
+        }
+        n->ino = ino;
+        bson_oid_copy(oid, &n->oid);
+        *pp = n;
+    }
+    else if(!bson_oid_equal(&n->oid, oid)) {
+        pthread_mutex_unlock(&nodes_lock);
+        free(newpath);
+        logit(ERROR, "Inode number collision on %s", path);
+        return 0;
+    }
+    free(n->path);
+    n->path = newpath;
+    n->nlookup++;
+    pthread_mutex_unlock(&nodes_lock);
+    return ino;
+}
+
+// Points a known inode at a new path without counting a lookup.
+static void repath(const bson_oid_t * oid, const char * path) {
+    struct ll_node * n;
+    char * newpath;
+
+    pthread_mutex_lock(&nodes_lock);
+    n = *find_node(oid_ino(oid));
+    if(n && bson_oid_equal(&n->oid, oid) && (newpath = strdup(path))) {
+        free(n->path);
+        n->path = newpath;
+    }
+    pthread_mutex_unlock(&nodes_lock);
+}
+
+// Moves every node under oldpath to the same place under newpath.
+static void repath_tree(const char * oldpath, const char * newpath) {
+    size_t oldlen = strlen(oldpath), newlen = strlen(newpath);
+    struct ll_node * n;
+    char * moved;
+    int i;
+
+    pthread_mutex_lock(&nodes_lock);
+    for(i = 0; i < NODE_BUCKETS; i++) {
+        for(n = nodes[i]; n; n = n->next) {
+            if(strncmp(n->path, oldpath, oldlen) != 0 ||
+                n->path[oldlen] != '/')
+                continue;
+            moved = malloc(newlen + strlen(n->path + oldlen) + 1);
+            if(!moved)
+                continue;
+            sprintf(moved, "%s%s", newpath, n->path + oldlen);
+            free(n->path);
+            n->path = moved;
+        }
+    }
+    pthread_mutex_unlock(&nodes_lock);
+}
+
+/*
+ * Finds a node other than keep that still remembers path after it was
+ * unlinked or renamed over, and points it at another path of the same
+ * inode if there is one. keep may be NULL.
+ */
+static void resolve_stale(const char * path, const bson_oid_t * keep) {
+    struct ll_node * n = NULL;
+    struct dirent * cde;
+    struct inode e;
+    bson_oid_t oid;
+    int i;
+
+    pthread_mutex_lock(&nodes_lock);
+    for(i = 0; i < NODE_BUCKETS && !n; i++) {
+        for(n = nodes[i]; n; n = n->next) {
+            if(n->ino >= FIRST_HASHED_INO && strcmp(n->path, path) == 0 &&
+                (!keep || !bson_oid_equal(&n->oid, keep)))
+                break;
+        }
+    }
+    if(n)
+        bson_oid_copy(&n->oid, &oid);
+    pthread_mutex_unlock(&nodes_lock);
+    if(!n || get_inode_by_oid(&oid, &e) != 0)
+        return;
+
+    for(cde = e.dirents; cde && strcmp(cde->path, path) == 0;
+        cde = cde->next);
+    if(cde)
+        repath(&oid, cde->path);
+    free_inode(&e);
+}
+
+static int node_info(fuse_ino_t ino, bson_oid_t * oid, char * path) {
+    struct ll_node * n;
+
+    pthread_mutex_lock(&nodes_lock);
+    if((n = *find_node(ino)) == NULL) {
+        pthread_mutex_unlock(&nodes_lock);
+        return -ESTALE;
+    }
+    if(oid)
+        bson_oid_copy(&n->oid, oid);
+    if(path)
+        strcpy(path, n->path);
+    pthread_mutex_unlock(&nodes_lock);
+    return 0;
+}
+
+static int child_path(fuse_ino_t parent, const char * name, char * out,
+    bson_oid_t * parentoid) {
+    char dir[PATH_MAX];
+    int res;
+
+    if((res = node_info(parent, parentoid, dir)) != 0)
+        return res;
+    if(strlen(dir) + strlen(name) + 2 > PATH_MAX)
+        return -ENAMETOOLONG;
+    sprintf(out, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+    return 0;
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    struct ll_node ** pp, * n;
+
+    pthread_mutex_lock(&nodes_lock);
+    pp = find_node(ino);
+    if((n = *pp) != NULL && ino >= FIRST_HASHED_INO) {
+        n->nlookup = n->nlookup > nlookup ? n->nlookup - nlookup : 0;
+        if(n->nlookup == 0 && !n->open_file) {
+            *pp = n->next;
+            free(n->path);
+            free(n);
+        }
+    }
+    pthread_mutex_unlock(&nodes_lock);
+    fuse_reply_none(req);
+}
+
+static void reply_entry(fuse_req_t req, struct inode * e, const char * path) {
+    struct fuse_entry_param ep;
+
+    memset(&ep, 0, sizeof(ep));
+    if((ep.ino = remember(&e->oid, path)) == 0) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    inode_to_stat(e, &ep.attr);
+    ep.attr.st_ino = ep.ino;
+    ep.attr_timeout = attr_timeout;
+    ep.entry_timeout = entry_timeout;
+    fuse_reply_entry(req, &ep);
+}
+
+static void reply_stats_entry(fuse_req_t req, const char * path) {
+    struct fuse_entry_param ep;
+
+    memset(&ep, 0, sizeof(ep));
+    switch(stats_file(path)) {
+    case STATS_JSON:
+        ep.ino = STATS_JSON_INO;
+        break;
+    case STATS_SLOWLOG:
+        ep.ino = STATS_SLOWLOG_INO;
+        break;
+    default:
+        ep.ino = STATS_TEXT_INO;
+    }
+    stats_stat(&ep.attr);
+    ep.attr.st_ino = ep.ino;
+    fuse_reply_entry(req, &ep);
+}
+
+static int lookup_path(fuse_ino_t parent, const char * name, char * path,
+    struct inode * e) {
+    bson_oid_t parentoid;
+    int res;
+
+    if((res = child_path(parent, name, path, &parentoid)) != 0)
+        return res;
+    if(links_migrated)
+        return get_child_inode(&parentoid, name, e);
+    return get_inode(path, e);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char * name) {
+    char path[PATH_MAX];
+    struct inode e;
+    uint64_t start = stats_start();
+    int res;
+
+    cur_req = req;
+    if(parent == FUSE_ROOT_ID && child_path(parent, name, path, NULL) == 0 &&
+        stats_file(path)) {
+        reply_stats_entry(req, path);
+        stats_end(STAT_LOOKUP, start);
+        return;
+    }
+
+    trace_begin("lookup", name);
+    acquire_conn();
+    res = lookup_path(parent, name, path, &e);
+    release_conn();
+    trace_end(res);
+    if(res == -ENOENT) {
+        // Tells the kernel to remember that it isn't there.
+        struct fuse_entry_param ep;
+        memset(&ep, 0, sizeof(ep));
+        ep.entry_timeout = negative_timeout;
+        fuse_reply_entry(req, &ep);
+    }
+    else if(res != 0)
+        fuse_reply_err(req, -res);
+    else
+        reply_entry(req, &e, path);
+    free_inode(&e);
+    stats_end(STAT_LOOKUP, start);
+}
+
+// Looks up path after an operation created it and replies with it.
+static void reply_created(fuse_req_t req, int res, const char * path) {
+    struct inode e;
+
+    if(res == 0) {
+        acquire_conn();
+        res = get_inode(path, &e);
+        release_conn();
+    }
+    if(res == 0)
+        reply_entry(req, &e, path);
+    if(res != 0)
+        fuse_reply_err(req, -res);
+    else
+        free_inode(&e);
+}
+
+static void reply_attr(fuse_req_t req, fuse_ino_t ino) {
+    struct ll_node * n;
+    struct inode e;
+    struct stat st;
+    bson_oid_t oid;
+    char path[PATH_MAX];
+    int res;
+
+    if(ino < FIRST_HASHED_INO && ino != FUSE_ROOT_ID &&
+        node_info(ino, NULL, path) == 0) {
+        stats_stat(&st);
+        st.st_ino = ino;
+        fuse_reply_attr(req, &st, 0);
+        return;
+    }
+
+    if((res = node_info(ino, &oid, NULL)) == 0) {
+        acquire_conn();
+        res = get_inode_by_oid(&oid, &e);
+        release_conn();
+    }
+    if(res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    inode_to_stat(&e, &st);
+    free_inode(&e);
+    st.st_ino = ino;
+
+    // Writes that haven't been flushed yet are only in the open file.
+    pthread_mutex_lock(&nodes_lock);
+    n = *find_node(ino);
+    if(n && n->open_file && n->open_file->size > st.st_size)
+        st.st_size = n->open_file->size;
+    pthread_mutex_unlock(&nodes_lock);
+
+    fuse_reply_attr(req, &st, attr_timeout);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    uint64_t start = stats_start();
+
+    cur_req = req;
+    trace_begin("getattr", NULL);
+    reply_attr(req, ino);
+    trace_end(0);
+    stats_end(STAT_GETATTR, start);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat * attr,
+    int to_set, struct fuse_file_info * fi) {
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = node_info(ino, NULL, path)) != 0)
+        goto err;
+
+    if(to_set & FUSE_SET_ATTR_MODE) {
+        if((res = mongo_oper.chmod(path, attr->st_mode)) != 0)
+            goto err;
+    }
+    if(to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        struct inode e;
+        uid_t uid;
+        gid_t gid;
+
+        acquire_conn();
+        res = get_inode(path, &e);
+        release_conn();
+        if(res != 0)
+            goto err;
+        uid = to_set & FUSE_SET_ATTR_UID ? attr->st_uid : e.owner;
+        gid = to_set & FUSE_SET_ATTR_GID ? attr->st_gid : e.group;
+        free_inode(&e);
+        if((res = mongo_oper.chown(path, uid, gid)) != 0)
+            goto err;
+    }
+    if(to_set & FUSE_SET_ATTR_SIZE) {
+        if(fi)
+            res = mongo_oper.ftruncate(path, attr->st_size, fi);
+        else
+            res = mongo_oper.truncate(path, attr->st_size);
+        if(res != 0)
+            goto err;
+    }
+    if(to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)) {
+        struct timespec tv[2];
+
+        memset(tv, 0, sizeof(tv));
+        tv[0].tv_sec = attr->st_atime;
+        tv[1].tv_sec = attr->st_mtime;
+        res = mongo_oper.utimens(path,
+            to_set & FUSE_SET_ATTR_MTIME_NOW ? NULL : tv);
+        if(res != 0)
+            goto err;
+    }
+
+    reply_attr(req, ino);
+    return;
+
+err:
+    fuse_reply_err(req, -res);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    char path[PATH_MAX], target[PATH_MAX + 1];
+    int res;
+
+    cur_req = req;
+    memset(target, 0, sizeof(target));
+    if((res = node_info(ino, NULL, path)) != 0 ||
+        (res = mongo_oper.readlink(path, target, PATH_MAX)) != 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_readlink(req, target);
+}
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char * name,
+    mode_t mode, dev_t rdev) {
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if(!S_ISREG(mode))
+        res = -EPERM;
+    else if((res = child_path(parent, name, path, NULL)) == 0) {
+        acquire_conn();
+        res = create_inode(path, mode, NULL);
+        release_conn();
+    }
+    reply_created(req, res, path);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char * name,
+    mode_t mode) {
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = child_path(parent, name, path, NULL)) == 0)
+        res = mongo_oper.mkdir(path, mode);
+    reply_created(req, res, path);
+}
+
+static void ll_symlink(fuse_req_t req, const char * link, fuse_ino_t parent,
+    const char * name) {
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = child_path(parent, name, path, NULL)) == 0)
+        res = mongo_oper.symlink(link, path);
+    reply_created(req, res, path);
+}
+
+static void ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+    const char * newname) {
+    char path[PATH_MAX], newpath[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = node_info(ino, NULL, path)) == 0 &&
+        (res = child_path(newparent, newname, newpath, NULL)) == 0)
+        res = mongo_oper.link(path, newpath);
+    reply_created(req, res, newpath);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char * name) {
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = child_path(parent, name, path, NULL)) == 0 &&
+        (res = mongo_oper.unlink(path)) == 0) {
+        acquire_conn();
+        resolve_stale(path, NULL);
+        release_conn();
+    }
+    fuse_reply_err(req, -res);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char * name) {
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = child_path(parent, name, path, NULL)) == 0)
+        res = mongo_oper.rmdir(path);
+    fuse_reply_err(req, -res);
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char * name,
+    fuse_ino_t newparent, const char * newname) {
+    char path[PATH_MAX], newpath[PATH_MAX];
+    bson_oid_t oid;
+    int res;
+
+    cur_req = req;
+    acquire_conn();
+    if((res = child_path(parent, name, path, NULL)) == 0 &&
+        (res = child_path(newparent, newname, newpath, NULL)) == 0 &&
+        (res = mongo_oper.rename(path, newpath)) == 0 &&
+        path_to_oid(newpath, strlen(newpath), &oid) == 0) {
+        resolve_stale(newpath, &oid);
+        repath(&oid, newpath);
+        repath_tree(path, newpath);
+    }
+    release_conn();
+    fuse_reply_err(req, -res);
+}
+
+// Keeps track of the open file so getattr can see unflushed writes.
+static void note_open(fuse_ino_t ino, struct fuse_file_info * fi) {
+    struct ll_node * n;
+
+    if(ino < FIRST_HASHED_INO && ino != FUSE_ROOT_ID)
+        return;
+    pthread_mutex_lock(&nodes_lock);
+    if((n = *find_node(ino)) != NULL)
+        n->open_file = (struct inode*)fi->fh;
+    pthread_mutex_unlock(&nodes_lock);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = node_info(ino, NULL, path)) != 0 ||
+        (res = mongo_oper.open(path, fi)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    note_open(ino, fi);
+    fuse_reply_open(req, fi);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char * name,
+    mode_t mode, struct fuse_file_info * fi) {
+    struct fuse_entry_param ep;
+    struct inode * e;
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = child_path(parent, name, path, NULL)) != 0 ||
+        (res = mongo_oper.create(path, mode, fi)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    e = (struct inode*)fi->fh;
+    memset(&ep, 0, sizeof(ep));
+    if((ep.ino = remember(&e->oid, path)) == 0) {
+        mongo_oper.release(path, fi);
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    note_open(ep.ino, fi);
+    inode_to_stat(e, &ep.attr);
+    ep.attr.st_ino = ep.ino;
+    ep.attr_timeout = attr_timeout;
+    ep.entry_timeout = entry_timeout;
+    fuse_reply_create(req, &ep, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+    struct fuse_file_info * fi) {
+    char path[PATH_MAX];
+    char * buf;
+    int res;
+
+    cur_req = req;
+    if((res = node_info(ino, NULL, path)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if((buf = malloc(size)) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    if((res = mongo_oper.read(path, buf, size, off, fi)) < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_buf(req, buf, res);
+    free(buf);
+}
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_bufvec * bufv, off_t off, struct fuse_file_info * fi) {
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = node_info(ino, NULL, path)) != 0 ||
+        (res = mongo_oper.write_buf(path, bufv, off, fi)) < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = node_info(ino, NULL, path)) == 0)
+        res = mongo_oper.flush(path, fi);
+    fuse_reply_err(req, -res);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+    struct fuse_file_info * fi) {
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = node_info(ino, NULL, path)) == 0)
+        res = mongo_oper.fsync(path, datasync, fi);
+    fuse_reply_err(req, -res);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    char path[PATH_MAX];
+    struct ll_node ** pp, * n;
+
+    cur_req = req;
+    path[0] = '\0';
+    node_info(ino, NULL, path);
+
+    pthread_mutex_lock(&nodes_lock);
+    pp = find_node(ino);
+    if((n = *pp) != NULL && n->open_file == (struct inode*)fi->fh) {
+        n->open_file = NULL;
+        if(n->nlookup == 0 && ino >= FIRST_HASHED_INO) {
+            *pp = n->next;
+            free(n->path);
+            free(n);
+        }
+    }
+    pthread_mutex_unlock(&nodes_lock);
+
+    mongo_oper.release(path, fi);
+    fuse_reply_err(req, 0);
+}
+
+static int dirbuf_fill(void * p, const char * name,
+    const struct stat * stbuf, off_t off) {
+    struct ll_dirbuf * db = (struct ll_dirbuf*)p;
+    struct stat st;
+    size_t oldsize = db->size, len;
+    char * newbuf;
+
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR;
+    if(stbuf) {
+        st.st_ino = stbuf->st_ino;
+        st.st_mode = stbuf->st_mode;
+    }
+
+    len = fuse_add_direntry(db->req, NULL, 0, name, NULL, 0);
+    if((newbuf = realloc(db->buf, oldsize + len)) == NULL)
+        return 1;
+    db->buf = newbuf;
+    db->size += len;
+    fuse_add_direntry(db->req, db->buf + oldsize, len, name, &st, db->size);
+    return 0;
+}
+
+// Reads the whole directory at opendir so readdir can hand it out in pieces.
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    char path[PATH_MAX];
+    struct ll_dirbuf * db;
+    int res;
+
+    cur_req = req;
+    if((res = node_info(ino, NULL, path)) != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if((db = calloc(1, sizeof(struct ll_dirbuf))) == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    db->req = req;
+    if((res = mongo_oper.readdir(path, db, dirbuf_fill, 0, fi)) != 0) {
+        free(db->buf);
+        free(db);
+        fuse_reply_err(req, -res);
+        return;
+    }
+    db->req = NULL;
+    fi->fh = (uintptr_t)db;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+    off_t off, struct fuse_file_info * fi) {
+    struct ll_dirbuf * db = (struct ll_dirbuf*)fi->fh;
+
+    if(off < db->size)
+        fuse_reply_buf(req, db->buf + off,
+            db->size - off < size ? db->size - off : size);
+    else
+        fuse_reply_buf(req, NULL, 0);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+    struct fuse_file_info * fi) {
+    struct ll_dirbuf * db = (struct ll_dirbuf*)fi->fh;
+
+    free(db->buf);
+    free(db);
+    fuse_reply_err(req, 0);
+}
+
+#ifdef __APPLE__
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char * name,
+    const char * value, size_t size, int flags, uint32_t position) {
+#else
+static void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char * name,
+    const char * value, size_t size, int flags) {
+#endif
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = node_info(ino, NULL, path)) == 0)
+#ifdef __APPLE__
+        res = mongo_oper.setxattr(path, name, value, size, flags, position);
+#else
+        res = mongo_oper.setxattr(path, name, value, size, flags);
+#endif
+    fuse_reply_err(req, -res);
+}
+
+static void ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+    char path[PATH_MAX];
+    int res;
+
+    cur_req = req;
+    if((res = node_info(ino, NULL, path)) == 0)
+        res = mongo_oper.access(path, mask);
+    fuse_reply_err(req, -res);
+}
+
+// Puts one of the stats files in the table for good.
+static int add_stats_node(fuse_ino_t ino, const char * path) {
+    struct ll_node * n;
+
+    if((n = calloc(1, sizeof(struct ll_node))) == NULL ||
+        (n->path = strdup(path)) == NULL) {
+        free(n);
+        return -ENOMEM;
+    }
+    n->ino = ino;
+    n->nlookup = 1;
+    pthread_mutex_lock(&nodes_lock);
+    *find_node(ino) = n;
+    pthread_mutex_unlock(&nodes_lock);
+    return 0;
+}
+
+static void ll_init(void * userdata, struct fuse_conn_info * conn) {
+    struct ll_node * n;
+
+    mongo_oper.init(conn);
+
+    if(path_to_oid("/", 1, &root_oid) != 0) {
+        logit(ERROR, "Could not find the root directory. Unmounting.");
+        lowlevel_exit();
+        return;
+    }
+    if((n = calloc(1, sizeof(struct ll_node))) == NULL ||
+        (n->path = strdup("/")) == NULL) {
+        free(n);
+        lowlevel_exit();
+        return;
+    }
+    n->ino = FUSE_ROOT_ID;
+    bson_oid_copy(&root_oid, &n->oid);
+    n->nlookup = 1;
+    pthread_mutex_lock(&nodes_lock);
+    *find_node(FUSE_ROOT_ID) = n;
+    pthread_mutex_unlock(&nodes_lock);
+
+    if(add_stats_node(STATS_TEXT_INO, "/.stats") != 0 ||
+        add_stats_node(STATS_JSON_INO, "/.stats.json") != 0 ||
+        add_stats_node(STATS_SLOWLOG_INO, "/.slowlog") != 0)
+        lowlevel_exit();
+}
+
+static void ll_destroy(void * userdata) {
+    mongo_oper.destroy(userdata);
+}
+
+static struct fuse_lowlevel_ops mongo_ll_oper = {
+    .init       = ll_init,
+    .destroy    = ll_destroy,
+    .lookup     = ll_lookup,
+    .forget     = ll_forget,
+    .getattr    = ll_getattr,
+    .setattr    = ll_setattr,
+    .readlink   = ll_readlink,
+    .mknod      = ll_mknod,
+    .mkdir      = ll_mkdir,
+    .unlink     = ll_unlink,
+    .rmdir      = ll_rmdir,
+    .symlink    = ll_symlink,
+    .rename     = ll_rename,
+    .link       = ll_link,
+    .open       = ll_open,
+    .read       = ll_read,
+    .write_buf  = ll_write_buf,
+    .flush      = ll_flush,
+    .release    = ll_release,
+    .fsync      = ll_fsync,
+    .opendir    = ll_opendir,
+    .readdir    = ll_readdir,
+    .releasedir = ll_releasedir,
+    .setxattr   = ll_setxattr,
+    .access     = ll_access,
+    .create     = ll_create,
+};
+
+void lowlevel_exit() {
+    if(ll_session)
+        fuse_session_exit(ll_session);
+}
+
+int run_lowlevel(struct fuse_args * args) {
+    struct fuse_chan * ch;
+    char * mountpoint = NULL;
+    int multithreaded, foreground, err = -1;
+
+    if(fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+        &foreground) == -1)
+        return 1;
+
+    if((ch = fuse_mount(mountpoint, args)) != NULL) {
+        ll_session = fuse_lowlevel_new(args, &mongo_ll_oper,
+            sizeof(mongo_ll_oper), NULL);
+        if(ll_session) {
+            if(fuse_set_signal_handlers(ll_session) != -1) {
+                fuse_session_add_chan(ll_session, ch);
+                fuse_daemonize(foreground);
+                if(multithreaded)
+                    err = fuse_session_loop_mt(ll_session);
+                else
+                    err = fuse_session_loop(ll_session);
+                fuse_remove_signal_handlers(ll_session);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(ll_session);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+    return err ? 1 : 0;
+}
@@ -23,6 +23,10 @@
 
 mongoc_uri_t * dial_uri = NULL;
 int loglevel = ERROR;
+int dedup_seed = 0;
+int strict_indexes = 0;
+int pool_prewarm = 0;
+static time_t mounted = 0;
 
 int mongo_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     off_t offset, struct fuse_file_info *fi);
@@ -32,30 +36,24 @@ int mongo_read(const char *path, char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi);
 int mongo_write(const char *path, const char *buf, size_t size,
                off_t offset, struct fuse_file_info *fi);
+int mongo_write_buf(const char * path, struct fuse_bufvec * bufv,
+    off_t offset, struct fuse_file_info * fi);
 int mongo_rename(const char * path, const char * newpath);
 
-static void getattr_impl(struct inode * e, struct stat * stbuf) {
-    memset(stbuf, 0, sizeof(struct stat));
-    stbuf->st_nlink = e->direntcount;
-    stbuf->st_mode = e->mode;
-    if(stbuf->st_mode & S_IFDIR)
-        stbuf->st_nlink++;
-    stbuf->st_uid = e->owner;
-    stbuf->st_gid = e->group;
-    stbuf->st_size = e->size;
-    stbuf->st_ctime = e->created;
-    stbuf->st_mtime = e->modified;
-    stbuf->st_atime = e->modified;
-}
 static int mongo_getattr(const char *path, struct stat *stbuf) {
     int res = 0;
     struct inode e;
 
-    res = get_inode(path, &e);
+    if(stats_file(path)) {
+        stats_stat(stbuf);
+        return 0;
+    }
+
+    res = get_inode_attr(path, &e);
     if(res != 0)
         return res;
 
-    getattr_impl(&e, stbuf);
+    inode_to_stat(&e, stbuf);
     free_inode(&e);
     return res;
 }
@@ -63,15 +61,25 @@ static int mongo_getattr(const char *path, struct stat *stbuf) {
 static int mongo_fgetattr(const char *path, struct stat *stbuf,
     struct fuse_file_info *fi) {
     struct inode * e = (struct inode *)fi->fh;
-    getattr_impl(e, stbuf);
+    uint64_t start = stats_start();
+
+    if(stats_file(path))
+        stats_stat(stbuf);
+    else
+        inode_to_stat(e, stbuf);
+    stats_end(STAT_GETATTR, start);
     return 0;
 }
 
 static int mongo_open(const char *path, struct fuse_file_info *fi)
 {
-    struct inode * e = malloc(sizeof(struct inode));
+    struct inode * e;
     int res;
 
+    if(stats_file(path))
+        return stats_open(path, fi);
+
+    e = malloc(sizeof(struct inode));
     res = get_inode(path, e);
     if(res != 0) {
         free_inode(e);
@@ -81,6 +89,7 @@ static int mongo_open(const char *path, struct fuse_file_info *fi)
     fi->fh = (uintptr_t)e;
     e->updated = time(NULL);
     e->wr_age = e->updated;
+    note_inode_open(e);
 
     return 0;
 }
@@ -95,6 +104,8 @@ static int mongo_create(const char * path, mode_t mode, struct fuse_file_info *
 }
 
 static int mongo_symlink(const char * path, const char * target) {
+    if(stats_file(target))
+        return -EEXIST;
     return create_inode(target, 0120777, path);
 }
 
@@ -160,6 +171,8 @@ static int mongo_link(const char * path, const char * newpath) {
     int res;
     size_t newpathlen = strlen(newpath);
 
+    if(stats_file(newpath))
+        return -EEXIST;
     if((res = get_inode(path, &e)) != 0)
         return res;
 
@@ -172,6 +185,7 @@ static int mongo_link(const char * path, const char * newpath) {
     strcpy(newlink->path, newpath);
     newlink->next = e.dirents;
     newlink->len = newpathlen;
+    newlink->linked = 0;
     e.dirents = newlink;
     e.direntcount++;
     res = commit_inode(&e);
@@ -185,6 +199,7 @@ static int mongo_unlink(const char * path) {
     mongoc_collection_t * coll = get_coll(COLL_INODES);
     bson_t cond;
     bson_error_t dberr;
+    uint64_t start;
 
     if((res = get_inode(path, &e)) != 0)
         return res;
@@ -202,6 +217,7 @@ static int mongo_unlink(const char * path) {
         free(c);
         e.direntcount--;
         res = commit_inode(&e);
+        attr_cache_invalidate(path);
         free_inode(&e);
         return res;
     }
@@ -211,12 +227,15 @@ static int mongo_unlink(const char * path) {
         bson_init(&cond);
         bson_append_oid(&cond, KEYEXP("_id"), &e.oid);
 
+        start = stats_start();
         res = mongoc_collection_delete(coll,
             0, // flags
             &cond,
             NULL, // write concern
             &dberr);
+        stats_end(STAT_DB_DELETE, start);
         bson_destroy(&cond);
+        attr_cache_invalidate(path);
 
         if(!res) {
             logit(ERROR, "Error removing inode for %s: %s", path, dberr.message);
@@ -290,14 +309,19 @@ static int mongo_utimens(const char * path, const struct timespec tv[2]) {
 }
 
 static int mongo_access(const char * path, int amode) {
-    const struct fuse_context * fcx = fuse_get_context();
     struct inode e;
+    uid_t uid;
+    gid_t gid;
     int res;
 
-    if(fcx->uid == 0)
+    if(stats_file(path))
+        return amode & W_OK ? -EACCES : 0;
+
+    get_caller(&uid, &gid);
+    if(uid == 0)
         return 0;
 
-    if((res = get_inode(path, &e)) != 0) {
+    if((res = get_inode_attr(path, &e)) != 0) {
         if(res == -ENOENT && strcmp(path, "/") == 0) {
             res = mongo_mkdir("/", 0755);
         }
@@ -312,7 +336,12 @@ static int mongo_access(const char * path, int amode) {
 static int mongo_flush(const char * path, struct fuse_file_info * fi) {
     struct inode * e = (struct inode*)fi->fh;
     int res = 0;
+
+    if(stats_file(path))
+        return 0;
     pthread_mutex_lock(&e->wr_lock);
+    if((res = flush_writeback(e)) != 0 || (res = wait_for_blocks(e)) != 0)
+        goto end;
     if(e->wr_extent) {
         res = serialize_extent(e, e->wr_extent);
         if(res != 0)
@@ -334,53 +363,293 @@ static int mongo_fsync(const char * path, int syncdata,
 
 static int mongo_release(const char * path, struct fuse_file_info * fi) {
     struct inode * e = (struct inode*)fi->fh;
+    int res;
+
+    if(stats_file(path)) {
+        stats_release(fi);
+        return 0;
+    }
+
+    note_inode_closed(e);
+
+    // flush normally gets here first, but don't lose anything if it didn't.
+    pthread_mutex_lock(&e->wr_lock);
+    res = flush_writeback(e);
+    if(wait_for_blocks(e) != 0 && res == 0)
+        res = -EIO;
+    if(res == 0 && e->wr_extent)
+        res = serialize_extent(e, e->wr_extent);
+    pthread_mutex_unlock(&e->wr_lock);
+    if(res != 0)
+        logit(ERROR, "Error flushing %s on release: %d", path, res);
+
     free_inode(e);
     free(e);
     return 0;
 }
 
+/*
+ * Setting user.mongofuse.compact on a file compacts its extents now
+ * instead of waiting for the background compactor.
+ */
+#ifdef __APPLE__
+static int mongo_setxattr(const char * path, const char * name,
+    const char * value, size_t size, int flags, uint32_t position) {
+#else
+static int mongo_setxattr(const char * path, const char * name,
+    const char * value, size_t size, int flags) {
+#endif
+    struct inode e;
+    int res;
+
+    if(strcmp(name, "user.mongofuse.compact") != 0)
+        return -ENOTSUP;
+    if((res = get_inode(path, &e)) != 0)
+        return res;
+
+    if(e.mode & S_IFDIR)
+        res = -EISDIR;
+    else if(check_access(&e, W_OK))
+        res = -EACCES;
+    else
+        res = compact_inode(&e.oid, 1);
+    free_inode(&e);
+    return res;
+}
+
 static void *mongo_initfs(struct fuse_conn_info * conn) {
     struct inode e;
-    int res = get_inode("/", &e);
+    int res;
+
+    start_stats();
+
+#ifdef FUSE_CAP_SPLICE_READ
+    // Have the kernel splice written data into a pipe for write_buf
+    // rather than libfuse copying it into a request buffer.
+    if(conn->capable & FUSE_CAP_SPLICE_READ)
+        conn->want |= FUSE_CAP_SPLICE_READ;
+#endif
+
+    if(check_indexes() != 0) {
+        if(strict_indexes) {
+            logit(ERROR, "Required indexes are missing. Unmounting.");
+            if(use_lowlevel)
+                lowlevel_exit();
+            else
+                fuse_exit(fuse_get_context()->fuse);
+            return NULL;
+        }
+        logit(WARN, "Required indexes are missing, "
+            "expect collection scans until they're built");
+    }
+
+    res = get_inode("/", &e);
     if(res != 0) {
          mongo_mkdir("/", 0755);
     } else
         free_inode(&e);
+
+    mounted = time(NULL);
+    prewarm_pool(pool_prewarm);
+    start_link_migration();
+    start_pipeline();
+    start_readahead();
+    if(dedup_seed)
+        start_dedup_seed();
+    start_compactor();
+    start_gc();
+    start_writeout();
     return NULL;
 }
 
-static struct fuse_operations mongo_oper = {
-    .getattr    = mongo_getattr,
+static void mongo_destroy(void * p) {
+    log_pool_stats((uint64_t)(time(NULL) - mounted) * 1000000);
+    logit(INFO, "Dedup filter: %llu hits (%llu bytes not uploaded) "
+        "out of %llu possible matches",
+        (unsigned long long)dedup_hits,
+        (unsigned long long)dedup_bytes,
+        (unsigned long long)dedup_checks);
+    logit(INFO, "Compaction: %llu files compacted from %llu extent documents "
+        "to %llu, %llu abandoned because the file changed",
+        (unsigned long long)compact_runs,
+        (unsigned long long)compact_docs_before,
+        (unsigned long long)compact_docs_after,
+        (unsigned long long)compact_aborts);
+    logit(INFO, "Attribute cache: %llu hits, %llu missing path hits, "
+        "%llu misses",
+        (unsigned long long)attr_cache_hits,
+        (unsigned long long)attr_cache_negative_hits,
+        (unsigned long long)attr_cache_misses);
+    logit(INFO, "Garbage collection: %llu blocks (%llu bytes) removed "
+        "in %llu passes",
+        (unsigned long long)gc_blocks_deleted,
+        (unsigned long long)gc_bytes_reclaimed,
+        (unsigned long long)gc_runs);
+    logit(INFO, "Extents of idle open files written out %llu times",
+        (unsigned long long)writeouts);
+}
+
+/*
+ * Every operation that can touch the database holds a pooled connection
+ * for as long as it runs. It's taken before any locks, so nothing waits
+ * for a connection while holding something another request needs. Each
+ * one is timed under stat and traced for the slow operation log, and
+ * fails with guard if it's given one of the stats files, unless guard is
+ * 0 and the operation handles them itself.
+ */
+#define POOLED(op, stat, guard, params, args) \
+    static int pooled_##op params { \
+        uint64_t start = stats_start(); \
+        int res; \
+        if(guard != 0 && stats_file(path)) \
+            res = guard; \
+        else { \
+            trace_begin(#op, path); \
+            acquire_conn(); \
+            res = mongo_##op args; \
+            release_conn(); \
+            trace_end(res); \
+        } \
+        stats_end(stat, start); \
+        return res; \
+    }
+
+POOLED(getattr, STAT_GETATTR, 0,
+    (const char * path, struct stat * stbuf), (path, stbuf))
+POOLED(readdir, STAT_READDIR, -ENOTDIR,
+    (const char * path, void * buf, fuse_fill_dir_t filler,
+    off_t offset, struct fuse_file_info * fi), (path, buf, filler, offset, fi))
+POOLED(open, STAT_OPEN, 0,
+    (const char * path, struct fuse_file_info * fi), (path, fi))
+POOLED(read, STAT_READ, 0,
+    (const char * path, char * buf, size_t size, off_t offset,
+    struct fuse_file_info * fi), (path, buf, size, offset, fi))
+POOLED(write, STAT_WRITE, -EBADF,
+    (const char * path, const char * buf, size_t size,
+    off_t offset, struct fuse_file_info * fi), (path, buf, size, offset, fi))
+POOLED(write_buf, STAT_WRITE, -EBADF,
+    (const char * path, struct fuse_bufvec * bufv,
+    off_t offset, struct fuse_file_info * fi), (path, bufv, offset, fi))
+POOLED(create, STAT_CREATE, -EEXIST,
+    (const char * path, mode_t mode, struct fuse_file_info * fi),
+    (path, mode, fi))
+POOLED(truncate, STAT_TRUNCATE, -EPERM,
+    (const char * path, off_t off), (path, off))
+POOLED(ftruncate, STAT_TRUNCATE, -EPERM,
+    (const char * path, off_t off, struct fuse_file_info * fi),
+    (path, off, fi))
+POOLED(mkdir, STAT_MKDIR, -EEXIST,
+    (const char * path, mode_t mode), (path, mode))
+POOLED(unlink, STAT_UNLINK, -EPERM,
+    (const char * path), (path))
+POOLED(link, STAT_LINK, -EPERM,
+    (const char * path, const char * newpath), (path, newpath))
+POOLED(chmod, STAT_CHMOD, -EPERM,
+    (const char * path, mode_t mode), (path, mode))
+POOLED(chown, STAT_CHOWN, -EPERM,
+    (const char * path, uid_t user, gid_t group),
+    (path, user, group))
+POOLED(rmdir, STAT_RMDIR, -ENOTDIR,
+    (const char * path), (path))
+POOLED(utimens, STAT_UTIMENS, -EPERM,
+    (const char * path, const struct timespec tv[2]), (path, tv))
+POOLED(rename, STAT_RENAME, -EPERM,
+    (const char * path, const char * newpath), (path, newpath))
+POOLED(access, STAT_ACCESS, 0,
+    (const char * path, int amode), (path, amode))
+POOLED(symlink, STAT_SYMLINK, 0,
+    (const char * path, const char * target), (path, target))
+POOLED(readlink, STAT_READLINK, -EINVAL,
+    (const char * path, char * out, size_t outlen),
+    (path, out, outlen))
+POOLED(flush, STAT_FLUSH, 0,
+    (const char * path, struct fuse_file_info * fi), (path, fi))
+POOLED(fsync, STAT_FSYNC, 0,
+    (const char * path, int syncdata, struct fuse_file_info * fi),
+    (path, syncdata, fi))
+POOLED(release, STAT_RELEASE, 0,
+    (const char * path, struct fuse_file_info * fi), (path, fi))
+#ifdef __APPLE__
+POOLED(setxattr, STAT_SETXATTR, -EPERM,
+    (const char * path, const char * name, const char * value,
+    size_t size, int flags, uint32_t position),
+    (path, name, value, size, flags, position))
+#else
+POOLED(setxattr, STAT_SETXATTR, -EPERM,
+    (const char * path, const char * name, const char * value,
+    size_t size, int flags), (path, name, value, size, flags))
+#endif
+
+struct fuse_operations mongo_oper = {
+    .getattr    = pooled_getattr,
     .fgetattr   = mongo_fgetattr,
-    .readdir    = mongo_readdir,
-    .open       = mongo_open,
-    .read       = mongo_read,
-    .write      = mongo_write,
-    .create     = mongo_create,
-    .truncate   = mongo_truncate,
-    .ftruncate  = mongo_ftruncate,
-    .mkdir      = mongo_mkdir,
-    .unlink     = mongo_unlink,
-    .link       = mongo_link,
-    .chmod      = mongo_chmod,
-    .chown      = mongo_chown,
-    .rmdir      = mongo_rmdir,
-    .utimens    = mongo_utimens,
-    .rename     = mongo_rename,
-    .access     = mongo_access,
-    .symlink    = mongo_symlink,
-    .readlink   = mongo_readlink,
-    .flush      = mongo_flush,
-    .fsync      = mongo_fsync,
-    .release    = mongo_release,
-    .init       = mongo_initfs
+    .readdir    = pooled_readdir,
+    .open       = pooled_open,
+    .read       = pooled_read,
+    .write      = pooled_write,
+    .write_buf  = pooled_write_buf,
+    .create     = pooled_create,
+    .truncate   = pooled_truncate,
+    .ftruncate  = pooled_ftruncate,
+    .mkdir      = pooled_mkdir,
+    .unlink     = pooled_unlink,
+    .link       = pooled_link,
+    .chmod      = pooled_chmod,
+    .chown      = pooled_chown,
+    .rmdir      = pooled_rmdir,
+    .utimens    = pooled_utimens,
+    .rename     = pooled_rename,
+    .access     = pooled_access,
+    .symlink    = pooled_symlink,
+    .readlink   = pooled_readlink,
+    .flush      = pooled_flush,
+    .fsync      = pooled_fsync,
+    .release    = pooled_release,
+    .setxattr   = pooled_setxattr,
+    .init       = mongo_initfs,
+    .destroy    = mongo_destroy
 };
 
 void parse_args(struct fuse_args * rawargs) {
     // Struct for parsing args
     struct mongo_fuse_config {
         char * dburi;
+        char * hash;
+        char * codec;
+        int codec_level;
+        unsigned int min_gain;
+        unsigned int hole_min;
+        unsigned int compact_interval;
+        unsigned int compact_min_docs;
+        unsigned int gc_interval;
+        unsigned int gc_grace;
+        unsigned int gc_rate;
+        unsigned int writeout_interval;
+        char * chunking;
+        unsigned int cdc_min;
+        unsigned int cdc_avg;
+        unsigned int cdc_max;
         int loglevel;
+        unsigned int cache_size;
+        unsigned int attr_cache;
+        unsigned int attr_ttl;
+        unsigned int negative_ttl;
+        unsigned int entry_ttl;
+        int lowlevel;
+        unsigned int readahead;
+        unsigned int writeback;
+        unsigned int hash_threads;
+        unsigned int upload_threads;
+        unsigned int pipeline;
+        unsigned int bulk_max;
+        unsigned int bulk_delay;
+        unsigned int dedup_filter;
+        int dedup_seed;
+        int strict_indexes;
+        unsigned int pool_size;
+        unsigned int pool_prewarm;
+        unsigned int slow_ms;
+        unsigned int slowlog_size;
     } opts;
 
 #define MF_OPT(t, p, v) { t, offsetof(struct mongo_fuse_config, p), v }
@@ -388,10 +657,74 @@ void parse_args(struct fuse_args * rawargs) {
     static struct fuse_opt mongo_fuse_opts[] = {
         MF_OPT("db=%s", dburi, 0),
         MF_OPT("loglevel", loglevel, 0),
+        MF_OPT("cache_size=%u", cache_size, 0),
+        MF_OPT("attr_cache=%u", attr_cache, 0),
+        MF_OPT("attr_ttl=%u", attr_ttl, 0),
+        MF_OPT("negative_ttl=%u", negative_ttl, 0),
+        MF_OPT("entry_ttl=%u", entry_ttl, 0),
+        MF_OPT("lowlevel", lowlevel, 1),
+        MF_OPT("readahead=%u", readahead, 0),
+        MF_OPT("writeback=%u", writeback, 0),
+        MF_OPT("hash_threads=%u", hash_threads, 0),
+        MF_OPT("upload_threads=%u", upload_threads, 0),
+        MF_OPT("pipeline=%u", pipeline, 0),
+        MF_OPT("bulk_max=%u", bulk_max, 0),
+        MF_OPT("bulk_delay=%u", bulk_delay, 0),
+        MF_OPT("dedup_filter=%u", dedup_filter, 0),
+        MF_OPT("dedup_seed", dedup_seed, 1),
+        MF_OPT("strict_indexes", strict_indexes, 1),
+        MF_OPT("pool_size=%u", pool_size, 0),
+        MF_OPT("pool_prewarm=%u", pool_prewarm, 0),
+        MF_OPT("slow_ms=%u", slow_ms, 0),
+        MF_OPT("slowlog_size=%u", slowlog_size, 0),
+        MF_OPT("hash=%s", hash, 0),
+        MF_OPT("codec=%s", codec, 0),
+        MF_OPT("codec_level=%d", codec_level, 0),
+        MF_OPT("min_gain=%u", min_gain, 0),
+        MF_OPT("hole_min=%u", hole_min, 0),
+        MF_OPT("compact_interval=%u", compact_interval, 0),
+        MF_OPT("compact_min_docs=%u", compact_min_docs, 0),
+        MF_OPT("gc_interval=%u", gc_interval, 0),
+        MF_OPT("gc_grace=%u", gc_grace, 0),
+        MF_OPT("gc_rate=%u", gc_rate, 0),
+        MF_OPT("writeout_interval=%u", writeout_interval, 0),
+        MF_OPT("chunking=%s", chunking, 0),
+        MF_OPT("cdc_min=%u", cdc_min, 0),
+        MF_OPT("cdc_avg=%u", cdc_avg, 0),
+        MF_OPT("cdc_max=%u", cdc_max, 0),
         FUSE_OPT_END
     };
 
     memset(&opts, 0, sizeof(opts));
+    opts.cache_size = 256;
+    opts.pool_size = 16;
+    opts.pool_prewarm = 4;
+    opts.slow_ms = 100;
+    opts.slowlog_size = 64;
+    opts.attr_cache = 65536;
+    opts.attr_ttl = 1000;
+    opts.negative_ttl = 1000;
+    opts.entry_ttl = 1000;
+    opts.readahead = 4096;
+    opts.writeback = 64;
+    opts.hash_threads = 4;
+    opts.upload_threads = 4;
+    opts.pipeline = 64;
+    opts.bulk_max = 64;
+    opts.bulk_delay = 2;
+    opts.dedup_filter = 32;
+    opts.codec_level = 3;
+    opts.min_gain = 10;
+    opts.hole_min = 16;
+    opts.compact_interval = 60;
+    opts.compact_min_docs = 64;
+    opts.gc_interval = 3600;
+    opts.gc_grace = 3600;
+    opts.gc_rate = 1000;
+    opts.writeout_interval = 60;
+    opts.cdc_min = 16;
+    opts.cdc_avg = 32;
+    opts.cdc_max = 64;
     fuse_opt_parse(rawargs, &opts, mongo_fuse_opts, NULL);
 
     if(!opts.dburi)
@@ -407,13 +740,138 @@ void parse_args(struct fuse_args * rawargs) {
         logit(ERROR, "Did not specify a database with URI. Exiting.");
         exit(1);
     }
+
+    // pool_size is how many connections requests share; any more requests
+    // than that wait their turn. pool_prewarm of them are opened at mount.
+    if(setup_pool(opts.pool_size) != 0) {
+        logit(ERROR, "Could not set up the connection pool. Exiting.");
+        exit(1);
+    }
+    pool_prewarm = opts.pool_prewarm;
+
+    // Operations that take longer than slow_ms milliseconds are logged
+    // with a breakdown of where the time went to /.slowlog, which keeps
+    // the last slowlog_size of them. Zero for either turns it off.
+    setup_tracing(opts.slow_ms, opts.slowlog_size);
+
+    // cache_size is in megabytes, zero turns the block cache off.
+    setup_block_cache((size_t)opts.cache_size << 20);
+
+    // attr_cache is how many paths' attributes are cached. attr_ttl and
+    // negative_ttl are how many milliseconds attributes and missing paths
+    // are trusted for, zero turns caching them off.
+    setup_attr_cache(opts.attr_cache, opts.attr_ttl, opts.negative_ttl);
+
+    // lowlevel serves the filesystem through the low-level FUSE API, so the
+    // kernel caches lookups for entry_ttl milliseconds and attributes and
+    // missing names for the same times as the attribute cache.
+    if(opts.lowlevel)
+        setup_lowlevel(opts.entry_ttl, opts.attr_ttl, opts.negative_ttl);
+
+    // readahead is the largest read-ahead window in kilobytes. Read-ahead
+    // lands in the block cache, so there's no point without one.
+    if(opts.cache_size == 0)
+        opts.readahead = 0;
+    setup_readahead((size_t)opts.readahead << 10);
+
+    // writeback is the memory in megabytes shared by all the write-back
+    // buffers, zero means every write is stored as it arrives.
+    setup_writeback((size_t)opts.writeback << 20);
+
+    // chunking=cdc cuts blocks at content-defined boundaries instead of
+    // fixed offsets. cdc_min, cdc_avg and cdc_max are the chunk sizes in
+    // kilobytes; chunks are never bigger than a block.
+    if(opts.chunking && strcmp(opts.chunking, "cdc") == 0) {
+        if(setup_chunking((size_t)opts.cdc_min << 10,
+            (size_t)opts.cdc_avg << 10, (size_t)opts.cdc_max << 10) != 0) {
+            logit(ERROR, "Invalid chunk sizes. Exiting.");
+            exit(1);
+        }
+    }
+    else if(opts.chunking && strcmp(opts.chunking, "fixed") != 0) {
+        logit(ERROR, "Unknown chunking %s. Exiting.", opts.chunking);
+        exit(1);
+    }
+
+    // pipeline is how many megabytes of written blocks can be waiting to
+    // be hashed or uploaded before writes start to block.
+    if(opts.hash_threads == 0)
+        opts.hash_threads = 1;
+    if(opts.upload_threads == 0)
+        opts.upload_threads = 1;
+    // bulk_max is the most blocks sent in one bulk upsert and bulk_delay
+    // is how many milliseconds an upload thread waits to fill one.
+    if(opts.bulk_max == 0)
+        opts.bulk_max = 1;
+    setup_pipeline(opts.hash_threads, opts.upload_threads,
+        (size_t)opts.pipeline << 20, opts.bulk_max, opts.bulk_delay);
+
+    // compact_interval is how many seconds the background compactor waits
+    // between looking at recently written files, zero turns it off. Files
+    // with fewer than compact_min_docs extent documents are left alone.
+    setup_compaction(opts.compact_interval, opts.compact_min_docs);
+
+    // gc_interval is how many seconds apart garbage collection passes
+    // are, zero turns it off. Blocks created or used in the last gc_grace
+    // seconds are kept, and at most gc_rate blocks are removed a second.
+    setup_gc(opts.gc_interval, opts.gc_grace, opts.gc_rate);
+
+    // writeout_interval is how many seconds extents can sit in memory for
+    // a file that's open but not being written. Blocks only they refer to
+    // are fair game for garbage collection after gc_grace, so it has to be
+    // well below that on every client of the database.
+    if(opts.gc_interval &&
+        (opts.writeout_interval == 0 ||
+        opts.writeout_interval > opts.gc_grace / 4)) {
+        opts.writeout_interval = opts.gc_grace / 4 ? opts.gc_grace / 4 : 1;
+        logit(WARN, "Writing out extents every %u seconds to stay well "
+            "inside gc_grace", opts.writeout_interval);
+    }
+    setup_writeout(opts.writeout_interval);
+
+    // hole_min is the smallest run of zeros in kilobytes inside a block
+    // that's stored as a hole instead of data, zero turns that off.
+    setup_hole_detection((size_t)opts.hole_min << 10);
+
+    // dedup_filter is the size of the filter of known block hashes in
+    // megabytes. dedup_seed fills it from the blocks collection at mount.
+    setup_dedup_filter((size_t)opts.dedup_filter << 20);
+    dedup_seed = opts.dedup_seed;
+
+    // strict_indexes refuses to mount if the indexes the hot queries need
+    // are missing, instead of just warning about it.
+    strict_indexes = opts.strict_indexes;
+
+    // hash is the algorithm new blocks are hashed with: sha1 (the default),
+    // sha256 or auto to pick by CPU. Every client of a database should use
+    // the same one or they won't dedup against each other, so auto is only
+    // safe when they all run on the same kind of CPU.
+    if(setup_hash(opts.hash) != 0) {
+        logit(ERROR, "Unknown hash algorithm %s. Exiting.", opts.hash);
+        exit(1);
+    }
+
+    logit(INFO, "Using the %s zero scan kernel", setup_zero_scan());
+
+    // codec is how new blocks are compressed: snappy, lz4, zstd or raw.
+    // codec_level is the zstd level, and blocks that don't shrink by
+    // min_gain percent are stored raw.
+    if(setup_codec(opts.codec, opts.codec_level, opts.min_gain) != 0) {
+        logit(ERROR, "Unknown codec %s or level %d. Exiting.",
+            opts.codec ? opts.codec : "snappy", opts.codec_level);
+        exit(1);
+    }
 }
 
+#ifndef MONGO_FUSE_BENCH
 int main(int argc, char *argv[])
 {
     struct fuse_args rawargs = FUSE_ARGS_INIT(argc, argv);
     parse_args(&rawargs);
     setup_threading();
+    if(use_lowlevel)
+        return run_lowlevel(&rawargs);
     int rc = fuse_main(rawargs.argc, rawargs.argv, &mongo_oper, NULL);
     return rc;
 }
+#endif
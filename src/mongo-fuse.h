@@ -18,7 +18,23 @@ struct extent {
 #define BLOCKS_PER_EXTENT 512
 #define MAX_BLOCK_SIZE 65536
 #define TREE_HEIGHT_LIMIT 64
-#define HASH_LEN 20
+#define HASH_LEN 32
+
+#define HASH_SHA1 0
+#define HASH_SHA256 1
+#define HASH_ALG_MAX 2
+
+#define CODEC_RAW 0
+#define CODEC_SNAPPY 1
+#define CODEC_LZ4 2
+#define CODEC_ZSTD 3
+#define CODEC_MAX 4
+
+#define CHUNK_FIXED 0
+#define CHUNK_CDC 1
+
+// Big enough for the worst case output of any codec for one block.
+#define COMPRESS_BUF_LEN (32 + MAX_BLOCK_SIZE + MAX_BLOCK_SIZE / 6)
 
 #define INFO 0
 #define WARN 1
@@ -32,6 +48,8 @@ struct extent {
 
 struct dirent {
     struct dirent * next;
+    bson_oid_t parent;
+    char linked;
     size_t len;
     char path[1];
 };
@@ -39,8 +57,10 @@ struct dirent {
 struct enode {
     off_t off;
     size_t len;
+    size_t boff;
     uint32_t seq;
     char empty;
+    uint8_t hashalg;
     uint8_t hash[HASH_LEN];
 };
 
@@ -50,6 +70,8 @@ struct elist {
     struct enode list[1];
 };
 
+struct block_job;
+
 struct inode {
     time_t updated;
     bson_oid_t oid;
@@ -66,27 +88,174 @@ struct inode {
 
     struct elist * wr_extent;
     pthread_mutex_t wr_lock;
+    pthread_cond_t wr_cond;
     time_t wr_age;
+    int wr_error;
+    struct block_job * inflight_head;
+    struct block_job * inflight_tail;
+
+    struct elist * map;
+    bson_oid_t map_gen;
+    bson_oid_t extgen;
+
+    char * wb_buf;
+    off_t wb_off;
+    size_t wb_len;
+    size_t wb_scan;
+    uint64_t wb_fp;
+
+    off_t ra_next;
+    off_t ra_issued;
+    size_t ra_window;
+
+    struct inode * open_next;
+    struct inode * open_prev;
 };
 
+#define STAT_GETATTR 0
+#define STAT_READDIR 1
+#define STAT_OPEN 2
+#define STAT_READ 3
+#define STAT_WRITE 4
+#define STAT_CREATE 5
+#define STAT_TRUNCATE 6
+#define STAT_MKDIR 7
+#define STAT_UNLINK 8
+#define STAT_LINK 9
+#define STAT_CHMOD 10
+#define STAT_CHOWN 11
+#define STAT_RMDIR 12
+#define STAT_UTIMENS 13
+#define STAT_RENAME 14
+#define STAT_ACCESS 15
+#define STAT_SYMLINK 16
+#define STAT_READLINK 17
+#define STAT_FLUSH 18
+#define STAT_FSYNC 19
+#define STAT_RELEASE 20
+#define STAT_SETXATTR 21
+#define STAT_LOOKUP 22
+#define STAT_DB_FIND 23
+#define STAT_DB_UPSERT 24
+#define STAT_DB_UPDATE 25
+#define STAT_DB_INSERT 26
+#define STAT_DB_DELETE 27
+#define STAT_COMPRESS 28
+#define STAT_DECOMPRESS 29
+#define STAT_TIMER_MAX 30
+
+#define STAT_BYTES_READ 0
+#define STAT_BYTES_WRITTEN 1
+#define STAT_CACHE_HITS 2
+#define STAT_CACHE_MISSES 3
+#define STAT_COUNTER_MAX 4
+
+#define STATS_TEXT 1
+#define STATS_JSON 2
+#define STATS_SLOWLOG 3
+
 void setup_threading();
 void teardown_threading();
+int setup_pool(int size);
+void prewarm_pool(int count);
+void acquire_conn();
+void release_conn();
+void log_pool_stats(uint64_t uptime_us);
+extern uint64_t pool_checkouts;
+extern uint64_t pool_waits;
+extern uint64_t pool_wait_us;
+extern uint64_t pool_max_queue;
 char * get_compress_buf();
 char * get_extent_buf();
 void logit(int level, const char * fmt, ...);
 mongoc_collection_t * get_coll(int coll);
 
+extern int block_hash_alg;
+int setup_hash(const char * name);
+size_t hash_len(int alg);
+int hash_alg_for_len(size_t len);
+void hash_block(int alg, const char * buf, size_t len, uint8_t out[HASH_LEN]);
+int read_hash(const bson_iter_t * iter, int alg, uint8_t out[HASH_LEN]);
+void append_hash(bson_t * doc, const char * key, size_t keylen,
+    int alg, const uint8_t hash[HASH_LEN]);
+
+int setup_codec(const char * name, int level, unsigned int mingain);
+int compress_data(const char * in, size_t len, char * out, size_t cap,
+    size_t * outlen);
+int uncompress_data(int codec, const char * in, size_t len, char * out,
+    size_t * outlen);
+
+typedef void (*zero_scan_fn)(const char * buf, size_t len,
+    size_t * start, size_t * end);
+struct zero_scan_kernel {
+    const char * name;
+    int (*supported)();
+    zero_scan_fn scan;
+};
+extern const struct zero_scan_kernel zero_scan_kernels[];
+const char * setup_zero_scan();
+void zero_scan(const char * buf, size_t len, size_t * start, size_t * end);
+int find_zero_run(const char * buf, off_t base, size_t start, size_t end,
+    size_t grain, size_t minrun, size_t * runstart, size_t * runend);
+
+void setup_block_cache(size_t maxbytes);
+int block_cache_get(const uint8_t hash[HASH_LEN], char * out,
+    size_t off, size_t len);
+void block_cache_put(const uint8_t hash[HASH_LEN], const char * data,
+    size_t len);
+
 int insert_hash(struct elist ** list, off_t off,
-    size_t len, const uint8_t hash[HASH_LEN]);
+    size_t len, int alg, const uint8_t hash[HASH_LEN]);
 int insert_empty(struct elist ** list, off_t off, size_t len);
 int deserialize_extent(struct inode * e, off_t off,
     size_t len, struct elist ** pout);
 int serialize_extent(struct inode * e, struct elist * list);
+void elist_truncate(struct elist * list, off_t off);
+int cut_extents(struct inode * e, off_t off);
+int bump_extgen(struct inode * e, const bson_oid_t * gen);
 struct elist * init_elist();
+int map_insert(struct elist ** pmap, const struct enode * n);
+void map_truncate(struct elist * map, off_t off);
+int map_lookup(struct elist * map, off_t off, size_t len, struct elist ** pout);
+int load_extent_map(struct inode * e);
+int read_extent_map(struct inode * e, struct elist ** pmap,
+    bson_oid_t ** pids, size_t * pnids);
+void build_extent_doc(bson_t * doc, const bson_oid_t * id,
+    const bson_oid_t * inode, const struct enode * nodes, size_t n);
+
+// What getattr and access need from an inode.
+struct inode_attr {
+    uint32_t mode;
+    uint64_t owner;
+    uint64_t group;
+    uint64_t size;
+    time_t created;
+    time_t modified;
+    int direntcount;
+};
+
+extern uint64_t attr_cache_hits;
+extern uint64_t attr_cache_negative_hits;
+extern uint64_t attr_cache_misses;
+void setup_attr_cache(size_t maxentries, unsigned int ttl,
+    unsigned int negttl);
+int attr_cache_get(const char * path, struct inode_attr * out,
+    uint64_t * gen);
+void attr_cache_put(const char * path, const struct inode_attr * attr,
+    uint64_t gen);
+void attr_cache_invalidate(const char * path);
+void attr_cache_invalidate_tree(const char * path);
+void attr_cache_invalidate_inode(struct inode * e);
 
 void init_inode(struct inode * e);
 void free_inode(struct inode *e);
 int get_inode(const char * path, struct inode * out);
+int get_inode_attr(const char * path, struct inode * out);
+int get_inode_by_oid(const bson_oid_t * oid, struct inode * out);
+int get_child_inode(const bson_oid_t * parent, const char * name,
+    struct inode * out);
+struct stat;
+void inode_to_stat(struct inode * e, struct stat * stbuf);
 int get_cached_inode(const char * path, struct inode * out);
 int commit_inode(struct inode * e);
 int create_inode(const char * path, mode_t mode, const char * data);
@@ -95,6 +264,107 @@ int read_inode(const bson_t * doc, struct inode * out);
 int inode_exists(const char * path);
 
 int do_trunc(struct inode * e, off_t off);
+void setup_pipeline(int nhash, int nupload, size_t limit,
+    int bulkmax, int bulkdelay);
+void setup_hole_detection(size_t minrun);
+void start_pipeline();
+int submit_block(struct inode * e, const char * buf, size_t size,
+    off_t offset);
+int submit_block_with(struct inode * e, size_t size, off_t offset,
+    int (*fill)(void * p, char * out, size_t len), void * p);
+void throttle_pipeline();
+int wait_for_blocks(struct inode * e);
+int inflight_blocks(struct inode * e,
+    int (*cb)(void * p, const char * data, off_t off, size_t len), void * p);
+void setup_writeback(size_t limit);
+extern int chunk_mode;
+int setup_chunking(size_t min, size_t avg, size_t max);
+size_t cdc_next_cut(const char * buf, size_t len, size_t * scan, uint64_t * fp);
+int flush_writeback(struct inode * e);
+void free_writeback(struct inode * e);
+int prefetch_blocks(struct elist * list, off_t offset, size_t size);
+
+struct hash_filter {
+    uint64_t * bits;
+    uint64_t nbits;
+};
+int hash_filter_init(struct hash_filter * f, size_t bytes);
+void hash_filter_free(struct hash_filter * f);
+void hash_filter_add(struct hash_filter * f, const uint8_t hash[HASH_LEN]);
+int hash_filter_check(const struct hash_filter * f,
+    const uint8_t hash[HASH_LEN]);
+
+extern uint64_t dedup_checks;
+extern uint64_t dedup_hits;
+extern uint64_t dedup_bytes;
+void setup_dedup_filter(size_t bytes);
+void dedup_filter_add(const uint8_t hash[HASH_LEN]);
+int dedup_filter_check(const uint8_t hash[HASH_LEN]);
+void start_dedup_seed();
+
+extern uint64_t compact_runs;
+extern uint64_t compact_aborts;
+extern uint64_t compact_docs_before;
+extern uint64_t compact_docs_after;
+void setup_compaction(int interval, int mindocs);
+void start_compactor();
+void note_extents_written(const bson_oid_t * oid);
+int compact_inode(const bson_oid_t * oid, int force);
+
+extern uint64_t gc_runs;
+extern uint64_t gc_blocks_deleted;
+extern uint64_t gc_bytes_reclaimed;
+void setup_gc(int interval, int grace, int rate);
+void start_gc();
+
+extern uint64_t writeouts;
+void setup_writeout(int interval);
+void start_writeout();
+void note_inode_open(struct inode * e);
+void note_inode_closed(struct inode * e);
+
+void setup_readahead(size_t maxwindow);
+void start_readahead();
+void detect_readahead(struct inode * e, off_t offset, size_t size);
+
+int check_indexes();
+
+extern int use_lowlevel;
+void setup_lowlevel(unsigned int entryttl, unsigned int attrttl,
+    unsigned int negttl);
+struct fuse_args;
+void parse_args(struct fuse_args * rawargs);
+int run_lowlevel(struct fuse_args * args);
+void lowlevel_exit();
+void get_caller(uid_t * uid, gid_t * gid);
+uint64_t oid_ino(const bson_oid_t * oid);
+
+struct fuse_file_info;
+void start_stats();
+uint64_t stats_start();
+void stats_end(int timer, uint64_t start);
+void stats_add(int counter, uint64_t n);
+int stats_file(const char * path);
+void stats_stat(struct stat * stbuf);
+int stats_open(const char * path, struct fuse_file_info * fi);
+int stats_read(struct fuse_file_info * fi, char * buf, size_t size,
+    off_t offset);
+void stats_release(struct fuse_file_info * fi);
+
+void setup_tracing(unsigned int slowms, unsigned int logsize);
+void trace_begin(const char * op, const char * path);
+void trace_end(int res);
+int span_begin(const char * name);
+void span_end(int span, uint64_t docs, uint64_t bytes);
+void trace_call(const char * name, uint64_t start, uint64_t elapsed);
+void trace_docs(uint64_t docs, uint64_t bytes);
+char * dump_slowlog(size_t * outlen);
+
+extern int links_migrated;
+int path_to_oid(const char * path, size_t len, bson_oid_t * out);
+int link_parent(struct dirent * d);
+void append_links(bson_t * doc, struct dirent * dirents);
+void start_link_migration();
 
 int read_dirents(const char * directory,
     int (*dirent_cb)(struct inode *e, void * p,
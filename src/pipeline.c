@@ -0,0 +1,664 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include "mongo-fuse.h"
+
+/*
+ * Blocks are stored in two stages so writes don't wait on the database.
+ * submit_block copies the data into a job and queues it. A pool of hash
+ * workers trims, hashes and compresses it, then a pool of upload workers
+ * upserts it into the blocks collection. Every inode keeps its jobs in a
+ * FIFO in the order they were submitted. Finished jobs are only retired
+ * into wr_extent and the extent map from the head of that FIFO, so the
+ * enodes go in in write order no matter which job finishes first. Until
+ * a job is retired, reads get its data straight from the job.
+ *
+ * Upload workers send their blocks as one unordered bulk upsert of up to
+ * bulk_max blocks. When fewer than that are queued, a worker waits up to
+ * bulk_delay milliseconds for more before sending what it has.
+ *
+ * A block the dedup filter says may already be stored isn't compressed
+ * by the hash worker. It goes to the upload workers, which confirm every
+ * such block in their batch with one update and one query, and only
+ * compress and upload the ones that turn out not to be there.
+ */
+
+struct block_job {
+    struct block_job * next;
+    struct block_job * inode_next;
+    struct inode * e;
+    off_t off;
+    size_t size;
+    int done;
+    int res;
+    int empty;
+    int check;
+    int dedup;
+    int hashalg;
+    int codec;
+    uint8_t hash[HASH_LEN];
+    int32_t blk_offset;
+    int32_t blk_len;
+    char * comp;
+    size_t comp_size;
+    char data[1];
+};
+
+#define HOLE_GRAIN 4096
+
+struct job_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct block_job * head;
+    struct block_job * tail;
+    int count;
+};
+
+static struct job_queue hash_queue = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+static struct job_queue upload_queue = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+
+static int hash_threads = 0, upload_threads = 0;
+static int bulk_max = 1, bulk_delay = 0;
+static size_t hole_min = 0;
+static size_t pipeline_limit = 0;
+static size_t pipeline_used = 0;
+static pthread_mutex_t pipeline_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pipeline_cond = PTHREAD_COND_INITIALIZER;
+
+void setup_pipeline(int nhash, int nupload, size_t limit,
+    int bulkmax, int bulkdelay) {
+    hash_threads = nhash;
+    upload_threads = nupload;
+    pipeline_limit = limit;
+    bulk_max = bulkmax;
+    bulk_delay = bulkdelay;
+}
+
+void setup_hole_detection(size_t minrun) {
+    hole_min = minrun;
+}
+
+static void queue_push(struct job_queue * q, struct block_job * job) {
+    job->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if(q->tail)
+        q->tail->next = job;
+    else
+        q->head = job;
+    q->tail = job;
+    q->count++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Waits for at least one job and takes up to max of them off the queue.
+ * If there are fewer than max, waits up to delay milliseconds for more.
+ */
+static struct block_job * queue_pop(struct job_queue * q, int max, int delay) {
+    struct block_job * out, * last;
+    struct timespec deadline;
+    struct timeval now;
+    int n = 1;
+
+    pthread_mutex_lock(&q->lock);
+    while(q->head == NULL)
+        pthread_cond_wait(&q->cond, &q->lock);
+
+    if(q->count < max && delay > 0) {
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec + delay / 1000;
+        deadline.tv_nsec = (now.tv_usec + (delay % 1000) * 1000) * 1000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while(q->count < max && q->head != NULL &&
+            pthread_cond_timedwait(&q->cond, &q->lock, &deadline) == 0);
+        // Someone else may have taken everything while we waited.
+        while(q->head == NULL)
+            pthread_cond_wait(&q->cond, &q->lock);
+    }
+
+    out = last = q->head;
+    while(n < max && last->next) {
+        last = last->next;
+        n++;
+    }
+    q->head = last->next;
+    if(q->head == NULL)
+        q->tail = NULL;
+    q->count -= n;
+    last->next = NULL;
+    pthread_mutex_unlock(&q->lock);
+    return out;
+}
+
+static void free_job(struct block_job * job) {
+    size_t used = sizeof(struct block_job) + job->size + job->comp_size;
+
+    free(job->comp);
+    free(job);
+
+    pthread_mutex_lock(&pipeline_lock);
+    pipeline_used -= used;
+    pthread_cond_broadcast(&pipeline_cond);
+    pthread_mutex_unlock(&pipeline_lock);
+}
+
+/*
+ * Marks a job finished and retires every finished job at the head of
+ * its inode's FIFO.
+ */
+static void finish_job(struct block_job * job, int res) {
+    struct inode * e = job->e;
+    struct block_job * cur;
+
+    pthread_mutex_lock(&e->wr_lock);
+    job->done = 1;
+    job->res = res;
+
+    while((cur = e->inflight_head) != NULL && cur->done) {
+        e->inflight_head = cur->inode_next;
+        if(e->inflight_head == NULL)
+            e->inflight_tail = NULL;
+
+        res = cur->res;
+        if(res == 0 && cur->empty)
+            res = insert_empty(&e->wr_extent, cur->off, cur->size);
+        else if(res == 0) {
+            block_cache_put(cur->hash, cur->data, cur->size);
+            dedup_filter_add(cur->hash);
+            res = insert_hash(&e->wr_extent, cur->off, cur->size,
+                cur->hashalg, cur->hash);
+        }
+        if(res == 0 && e->map)
+            res = map_insert(&e->map,
+                &e->wr_extent->list[e->wr_extent->nnodes - 1]);
+        if(res != 0 && e->wr_error == 0)
+            e->wr_error = res;
+        free_job(cur);
+    }
+
+    pthread_cond_broadcast(&e->wr_cond);
+    pthread_mutex_unlock(&e->wr_lock);
+}
+
+static void trim_block(struct block_job * job) {
+    size_t start, end;
+
+    zero_scan(job->data, job->size, &start, &end);
+    job->blk_offset = start;
+    job->blk_len = end - start;
+    if(job->blk_len == 0)
+        job->empty = 1;
+}
+
+/*
+ * Makes a new job for the len bytes of job starting at off and links it
+ * into the inode's FIFO right after job. If data is NULL the new job is
+ * a hole.
+ */
+static struct block_job * split_job(struct block_job * job, size_t off,
+    size_t len, const char * data) {
+    struct inode * e = job->e;
+    struct block_job * split = calloc(1, sizeof(struct block_job) + len);
+
+    if(!split)
+        return NULL;
+    split->e = e;
+    split->off = job->off + off;
+    split->size = len;
+    if(data)
+        memcpy(split->data, data, len);
+    else
+        split->empty = 1;
+
+    pthread_mutex_lock(&e->wr_lock);
+    split->inode_next = job->inode_next;
+    job->inode_next = split;
+    if(e->inflight_tail == job)
+        e->inflight_tail = split;
+    pthread_mutex_unlock(&e->wr_lock);
+
+    pthread_mutex_lock(&pipeline_lock);
+    pipeline_used += sizeof(struct block_job) + len;
+    pthread_mutex_unlock(&pipeline_lock);
+    return split;
+}
+
+/*
+ * If the stored part of a job has a run of at least hole_min zero bytes
+ * in it, cuts the job in three: the data before the run, a hole for the
+ * run, and a new job for the rest. The rest goes into the batch after
+ * job so it gets checked for holes of its own. Holes are stored as empty
+ * enodes, so they're never compressed, uploaded or fetched.
+ */
+static void split_hole(struct block_job * job) {
+    struct block_job * hole, * rest;
+    size_t runstart, runend;
+    struct inode * e = job->e;
+
+    if(hole_min == 0 || !find_zero_run(job->data, job->off, job->blk_offset,
+        job->blk_offset + job->blk_len, HOLE_GRAIN, hole_min,
+        &runstart, &runend))
+        return;
+
+    rest = split_job(job, runend, job->size - runend, job->data + runend);
+    hole = split_job(job, runstart, runend - runstart, NULL);
+
+    // The new jobs hold the same bytes as the part of job they cover, so
+    // if either couldn't be allocated job just stays whole.
+    if(rest && hole) {
+        pthread_mutex_lock(&e->wr_lock);
+        job->size = runstart;
+        pthread_mutex_unlock(&e->wr_lock);
+        pthread_mutex_lock(&pipeline_lock);
+        pipeline_used -= runend - runstart + rest->size;
+        pthread_mutex_unlock(&pipeline_lock);
+        trim_block(job);
+    }
+    if(rest) {
+        rest->next = job->next;
+        job->next = rest;
+    }
+    if(hole) {
+        hole->next = job->next;
+        job->next = hole;
+    }
+}
+
+static int compress_block(struct block_job * job) {
+    const char * buf = job->data + job->blk_offset;
+    const size_t reallen = job->blk_len;
+    int res;
+
+    char * comp_out = get_compress_buf();
+    size_t comp_size;
+    if((res = compress_data(buf, reallen, comp_out,
+        COMPRESS_BUF_LEN, &comp_size)) < 0)
+        return res;
+    job->codec = res;
+
+    if((job->comp = malloc(comp_size)) == NULL)
+        return -ENOMEM;
+    memcpy(job->comp, comp_out, comp_size);
+    job->comp_size = comp_size;
+
+    pthread_mutex_lock(&pipeline_lock);
+    pipeline_used += comp_size;
+    pthread_mutex_unlock(&pipeline_lock);
+    return 0;
+}
+
+static void build_upsert(struct block_job * job, bson_t * cond, bson_t * doc) {
+    bson_t setoninsert, set;
+    const time_t now = time(NULL);
+
+    bson_init(cond);
+    append_hash(cond, KEYEXP("_id"), job->hashalg, job->hash);
+
+    bson_init(doc);
+    bson_append_document_begin(doc, KEYEXP("$setOnInsert"), &setoninsert);
+    bson_append_binary(&setoninsert, KEYEXP("data"), 0,
+        (const uint8_t*)job->comp, job->comp_size);
+    bson_append_int64(&setoninsert, KEYEXP("offset"), job->blk_offset);
+    bson_append_int64(&setoninsert, KEYEXP("size"), job->size);
+    bson_append_time_t(&setoninsert, KEYEXP("created"), now);
+    bson_append_int32(&setoninsert, KEYEXP("alg"), job->hashalg);
+    bson_append_int32(&setoninsert, KEYEXP("codec"), job->codec);
+    bson_append_document_end(doc, &setoninsert);
+    bson_append_document_begin(doc, KEYEXP("$set"), &set);
+    bson_append_time_t(&set, KEYEXP("touched"), now);
+    bson_append_document_end(doc, &set);
+}
+
+static int upload_block(struct block_job * job) {
+    bson_t doc, cond;
+    bson_error_t dberr;
+    mongoc_collection_t * coll = get_coll(COLL_BLOCKS);
+    uint64_t start;
+    bool res;
+
+    build_upsert(job, &cond, &doc);
+    start = stats_start();
+    res = mongoc_collection_update(coll,
+        MONGOC_UPDATE_UPSERT,
+        &cond,
+        &doc,
+        NULL, // write concern
+        &dberr);
+    stats_end(STAT_DB_UPSERT, start);
+    bson_destroy(&doc);
+    bson_destroy(&cond);
+
+    if(!res) {
+        logit(ERROR, "Error commiting block: %s", dberr.message);
+        return -EIO;
+    }
+    return 0;
+}
+
+static void append_hash_list(bson_t * query, struct block_job * jobs) {
+    struct block_job * job;
+    bson_t sub, inlist;
+    uint32_t i = 0;
+
+    bson_init(query);
+    bson_append_document_begin(query, KEYEXP("_id"), &sub);
+    bson_append_array_begin(&sub, KEYEXP("$in"), &inlist);
+    for(job = jobs; job; job = job->next) {
+        char idxbuf[10];
+        const char * idxstr;
+        size_t idxlen;
+
+        if(!job->check)
+            continue;
+        idxlen = bson_uint32_to_string(i++, &idxstr, idxbuf, sizeof(idxbuf));
+        append_hash(&inlist, idxstr, idxlen, job->hashalg, job->hash);
+    }
+    bson_append_array_end(&sub, &inlist);
+    bson_append_document_end(query, &sub);
+}
+
+/*
+ * Finds out which of the blocks the dedup filter matched are really
+ * stored, and marks those as dedup. They all get their touched time
+ * updated first, which keeps garbage collection from removing them
+ * before the extents that are about to refer to them are written. If
+ * we can't tell, the blocks are just uploaded again.
+ */
+static void confirm_blocks(struct block_job * jobs) {
+    mongoc_collection_t * coll = get_coll(COLL_BLOCKS);
+    mongoc_cursor_t * curs;
+    struct block_job * job;
+    const bson_t * doc;
+    bson_t query, update, set, fields;
+    bson_error_t dberr;
+    uint64_t start;
+    bool res;
+
+    for(job = jobs; job && !job->check; job = job->next);
+    if(!job)
+        return;
+
+    append_hash_list(&query, jobs);
+    bson_init(&update);
+    bson_append_document_begin(&update, KEYEXP("$set"), &set);
+    bson_append_time_t(&set, KEYEXP("touched"), time(NULL));
+    bson_append_document_end(&update, &set);
+
+    start = stats_start();
+    res = mongoc_collection_update(coll,
+        MONGOC_UPDATE_MULTI_UPDATE,
+        &query,
+        &update,
+        NULL, // write concern
+        &dberr);
+    stats_end(STAT_DB_UPDATE, start);
+    bson_destroy(&update);
+    if(!res) {
+        logit(WARN, "Error touching existing blocks: %s", dberr.message);
+        bson_destroy(&query);
+        return;
+    }
+
+    bson_init(&fields);
+    bson_append_int32(&fields, KEYEXP("_id"), 1);
+    start = stats_start();
+    curs = mongoc_collection_find(coll,
+        MONGOC_QUERY_NONE,
+        0, // skip
+        0, // limit
+        0, // batch size
+        &query,
+        &fields,
+        NULL); // read prefs
+    bson_destroy(&query);
+    bson_destroy(&fields);
+    if(!curs) {
+        logit(WARN, "Error getting cursor while checking for existing blocks");
+        return;
+    }
+
+    while(mongoc_cursor_next(curs, &doc)) {
+        bson_iter_t iter;
+        uint8_t hash[HASH_LEN];
+
+        if(!bson_iter_init_find(&iter, doc, "_id") ||
+            read_hash(&iter, -1, hash) < 0)
+            continue;
+        for(job = jobs; job; job = job->next) {
+            if(job->check && memcmp(job->hash, hash, HASH_LEN) == 0)
+                job->dedup = 1;
+        }
+    }
+    stats_end(STAT_DB_FIND, start);
+
+    if(mongoc_cursor_error(curs, &dberr)) {
+        logit(WARN, "Error checking for existing blocks: %s", dberr.message);
+        for(job = jobs; job; job = job->next)
+            job->dedup = 0;
+    }
+    mongoc_cursor_destroy(curs);
+}
+
+/*
+ * Upserts a batch of blocks in one unordered bulk operation. The upserts
+ * are idempotent, so if the batch fails each block is retried on its own
+ * to find out which ones actually didn't make it.
+ */
+static void upload_blocks(struct block_job * jobs) {
+    mongoc_collection_t * coll = get_coll(COLL_BLOCKS);
+    mongoc_bulk_operation_t * bulk;
+    struct block_job * job, * next;
+    bson_t doc, cond, reply;
+    bson_error_t dberr;
+    struct block_job ** tail = &jobs;
+    uint64_t start;
+    uint32_t res;
+    int err;
+
+    // Blocks that are already stored, or that couldn't be compressed,
+    // are done here.
+    confirm_blocks(jobs);
+    while((job = *tail) != NULL) {
+        if(!job->check) {
+            tail = &job->next;
+            continue;
+        }
+        err = 0;
+        if(job->dedup) {
+            __sync_fetch_and_add(&dedup_hits, 1);
+            __sync_fetch_and_add(&dedup_bytes, job->size);
+        }
+        else
+            err = compress_block(job);
+        if(job->dedup || err != 0) {
+            *tail = job->next;
+            finish_job(job, err);
+        }
+        else
+            tail = &job->next;
+    }
+    if(jobs == NULL)
+        return;
+
+    if(jobs->next == NULL) {
+        finish_job(jobs, upload_block(jobs));
+        return;
+    }
+
+    bulk = mongoc_collection_create_bulk_operation(coll,
+        false, // ordered
+        NULL); // write concern
+    for(job = jobs; job; job = job->next) {
+        build_upsert(job, &cond, &doc);
+        mongoc_bulk_operation_update(bulk, &cond, &doc, true);
+        bson_destroy(&doc);
+        bson_destroy(&cond);
+    }
+
+    start = stats_start();
+    res = mongoc_bulk_operation_execute(bulk, &reply, &dberr);
+    stats_end(STAT_DB_UPSERT, start);
+    bson_destroy(&reply);
+    mongoc_bulk_operation_destroy(bulk);
+    if(!res)
+        logit(WARN, "Error commiting blocks in bulk, retrying one at a time: %s",
+            dberr.message);
+
+    for(job = jobs; job; job = next) {
+        next = job->next;
+        finish_job(job, res ? 0 : upload_block(job));
+    }
+}
+
+static void * hash_worker(void * p) {
+    struct block_job * job, * next;
+    int res;
+
+    for(;;) {
+        // split_hole adds the jobs it cuts off after job, so they're
+        // handled here too.
+        for(job = queue_pop(&hash_queue, 1, 0); job; job = next) {
+            if(!job->empty)
+                trim_block(job);
+            if(!job->empty)
+                split_hole(job);
+            next = job->next;
+            res = 0;
+            if(!job->empty) {
+                job->hashalg = block_hash_alg;
+                hash_block(job->hashalg, job->data, job->size, job->hash);
+            }
+            if(!job->empty && dedup_filter_check(job->hash)) {
+                __sync_fetch_and_add(&dedup_checks, 1);
+                job->check = 1;
+            }
+            else if(!job->empty)
+                res = compress_block(job);
+            if(res != 0 || job->empty)
+                finish_job(job, res);
+            else
+                queue_push(&upload_queue, job);
+        }
+    }
+    return NULL;
+}
+
+static void * upload_worker(void * p) {
+    for(;;)
+        upload_blocks(queue_pop(&upload_queue, bulk_max, bulk_delay));
+    return NULL;
+}
+
+static int start_workers(int count, void * (*worker)(void *)) {
+    pthread_t thread;
+    int i;
+
+    for(i = 0; i < count; i++) {
+        if(pthread_create(&thread, NULL, worker, NULL) != 0)
+            return -1;
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+void start_pipeline() {
+    if(start_workers(hash_threads, hash_worker) != 0 ||
+        start_workers(upload_threads, upload_worker) != 0) {
+        logit(ERROR, "Could not start block pipeline threads. Exiting.");
+        exit(1);
+    }
+}
+
+/*
+ * Queues a new job for a block of size bytes at offset, whose data fill
+ * writes into the job. Must be called with e->wr_lock held. This never
+ * blocks waiting for room in the pipeline, since the workers need
+ * e->wr_lock to make that room; callers should call throttle_pipeline
+ * once they've dropped the lock.
+ */
+int submit_block_with(struct inode * e, size_t size, off_t offset,
+    int (*fill)(void * p, char * out, size_t len), void * p) {
+    struct block_job * job = calloc(1, sizeof(struct block_job) + size);
+    int res;
+
+    if(!job)
+        return -ENOMEM;
+    if((res = fill(p, job->data, size)) != 0) {
+        free(job);
+        return res;
+    }
+    job->e = e;
+    job->off = offset;
+    job->size = size;
+
+    if(e->inflight_tail)
+        e->inflight_tail->inode_next = job;
+    else
+        e->inflight_head = job;
+    e->inflight_tail = job;
+
+    pthread_mutex_lock(&pipeline_lock);
+    pipeline_used += sizeof(struct block_job) + size;
+    pthread_mutex_unlock(&pipeline_lock);
+
+    queue_push(&hash_queue, job);
+    return 0;
+}
+
+static int copy_block(void * p, char * out, size_t len) {
+    memcpy(out, p, len);
+    return 0;
+}
+
+// Copies a block into a new job and queues it, as submit_block_with.
+int submit_block(struct inode * e, const char * buf, size_t size,
+    off_t offset) {
+    return submit_block_with(e, size, offset, copy_block, (void*)buf);
+}
+
+void throttle_pipeline() {
+    pthread_mutex_lock(&pipeline_lock);
+    while(pipeline_used > pipeline_limit)
+        pthread_cond_wait(&pipeline_cond, &pipeline_lock);
+    pthread_mutex_unlock(&pipeline_lock);
+}
+
+/*
+ * Waits for every block submitted for e to be retired and returns the
+ * first error any of them hit. Must be called with e->wr_lock held.
+ */
+int wait_for_blocks(struct inode * e) {
+    int res;
+
+    while(e->inflight_head)
+        pthread_cond_wait(&e->wr_cond, &e->wr_lock);
+    res = e->wr_error;
+    e->wr_error = 0;
+    return res;
+}
+
+/*
+ * Calls cb for every byte range of e that's been submitted but not
+ * retired yet, oldest first. Must be called with e->wr_lock held.
+ */
+int inflight_blocks(struct inode * e,
+    int (*cb)(void * p, const char * data, off_t off, size_t len), void * p) {
+    struct block_job * cur;
+    int res;
+
+    for(cur = e->inflight_head; cur; cur = cur->inode_next) {
+        if((res = cb(p, cur->data, cur->off, cur->size)) != 0)
+            return res;
+    }
+    return 0;
+}
@@ -13,25 +13,144 @@
 #include <limits.h>
 #include <math.h>
 #include "mongo-fuse.h"
-#include <snappy-c.h>
-#ifdef __APPLE__
-#include <CommonCrypto/CommonDigest.h>
-#else
-#include <openssl/sha.h>
-#endif
-#include <xmmintrin.h>
-
-static int resolve_block(struct inode * e, uint8_t hash[HASH_LEN], char * buf) {
-    bson_t query, *doc;
+
+/*
+ * Decompresses a document from the blocks collection into buf, which
+ * holds cap bytes, and returns the logical length of the block in
+ * blocklen. Returns -ENOSPC without logging anything if the block might
+ * not fit.
+ */
+static int decode_block(const bson_t * doc, char * buf, size_t cap,
+    size_t * blocklen) {
     bson_iter_t iter;
+    size_t outsize, compsize = 0;
+    const char * compdata = NULL;
+    uint32_t offset = 0, size = 0;
+    int codec = CODEC_SNAPPY;
+
+    bson_iter_init(&iter, doc);
+    while(bson_iter_next(&iter)) {
+        const char * key = bson_iter_key(&iter);
+        if(strcmp(key, "data") == 0) {
+            bson_subtype_t subtype;
+            bson_iter_binary(&iter, &subtype, 
+                (uint32_t*)&compsize, (const uint8_t**)&compdata);
+        }
+        else if(strcmp(key, "offset") == 0)
+            offset = bson_iter_as_int64(&iter);
+        else if(strcmp(key, "size") == 0)
+            size = bson_iter_as_int64(&iter);
+        else if(strcmp(key, "codec") == 0)
+            codec = bson_iter_int32(&iter);
+    }
+
+    if(!compdata) {
+        logit(ERROR, "No data in block?");
+        return -EIO;
+    }
+
+    // Blocks from before size was recorded could be any length.
+    if((size == 0 && cap < MAX_BLOCK_SIZE) || size > cap || offset >= cap)
+        return -ENOSPC;
+
+    outsize = cap - offset;
+    if(uncompress_data(codec, compdata, compsize, buf + offset, &outsize) != 0)
+        return -EIO;
+    if(offset > 0)
+        memset(buf, 0, offset);
+    compsize = outsize + offset;
+    if(compsize < size)
+        memset(buf + compsize, 0, size - compsize);
+
+    *blocklen = compsize > size ? compsize : size;
+    return 0;
+}
+
+/*
+ * A block document fetched from the database. The compressed document
+ * is kept rather than the block, so it can be decompressed straight
+ * into the read buffer once we know where it goes.
+ */
+struct fetched_block {
+    uint8_t hash[HASH_LEN];
+    int hashalg;
+    bson_t * doc;
+};
+
+static struct fetched_block * find_fetched(struct fetched_block * fetched,
+    size_t nfetched, const uint8_t hash[HASH_LEN]) {
+    size_t i;
+    for(i = 0; i < nfetched; i++) {
+        if(memcmp(fetched[i].hash, hash, HASH_LEN) == 0)
+            return &fetched[i];
+    }
+    return NULL;
+}
+
+static void free_fetched(struct fetched_block * fetched, size_t nfetched) {
+    size_t i;
+    for(i = 0; i < nfetched; i++) {
+        if(fetched[i].doc)
+            bson_destroy(fetched[i].doc);
+    }
+    free(fetched);
+}
+
+// Decompresses a fetched block into buf and keeps it in the block cache.
+static int decode_fetched(struct fetched_block * fb, char * buf, size_t cap,
+    size_t * blocklen) {
+    int res = decode_block(fb->doc, buf, cap, blocklen);
+    if(res == 0) {
+        block_cache_put(fb->hash, buf, *blocklen);
+        dedup_filter_add(fb->hash);
+    }
+    return res;
+}
+
+/*
+ * Copies [inskip, inskip + tocopy) of a fetched block to out. When that
+ * range starts the block and the whole block fits, it's decompressed
+ * directly into out instead of into the thread's extent buffer first.
+ */
+static int copy_fetched(struct fetched_block * fb, char * out,
+    size_t inskip, size_t tocopy) {
+    char * extent_buf;
+    size_t blocklen;
+    int res;
+
+    if(inskip == 0) {
+        res = decode_fetched(fb, out, tocopy, &blocklen);
+        if(res == 0 && blocklen < tocopy)
+            memset(out + blocklen, 0, tocopy - blocklen);
+        if(res != -ENOSPC)
+            return res;
+    }
+
+    extent_buf = get_extent_buf();
+    if((res = decode_fetched(fb, extent_buf, MAX_BLOCK_SIZE, &blocklen)) != 0)
+        return res;
+    memcpy(out, extent_buf + inskip, tocopy);
+    return 0;
+}
+
+// Fetches the block for n on its own.
+static int fetch_block(const struct enode * n, struct fetched_block * fb) {
+    bson_t query;
+    const bson_t * doc;
     bson_error_t dberr;
     mongoc_collection_t * coll = get_coll(COLL_BLOCKS);
     mongoc_cursor_t * curs;
-    int res;
+    uint64_t start;
+    int res = 0;
+
+    memcpy(fb->hash, n->hash, HASH_LEN);
+    fb->hashalg = n->hashalg;
+    fb->doc = NULL;
 
     bson_init(&query);
-    bson_append_binary(&query, KEYEXP("_id"), 0, hash, 20);
+    append_hash(&query, KEYEXP("_id"), n->hashalg, n->hash);
 
+    start = stats_start();
     curs = mongoc_collection_find(coll,
         MONGOC_QUERY_NONE,
         0, // skip
@@ -48,91 +167,187 @@ static int resolve_block(struct inode * e, uint8_t hash[HASH_LEN], char * buf) {
         return -EIO;
     }
 
-    if(!mongoc_cursor_next(curs, (const bson_t**)&doc)) {
+    if(!mongoc_cursor_next(curs, &doc)) {
+        stats_end(STAT_DB_FIND, start);
         if(mongoc_cursor_error(curs, &dberr))
             logit(ERROR, "Error searching for block: %s", dberr.message);
         else
             logit(WARN, "Block requested doesn't exist");
-        mongoc_cursor_destroy(curs);
-        return -EIO;
+        res = -EIO;
+    }
+    else {
+        trace_docs(1, doc->len);
+        stats_end(STAT_DB_FIND, start);
+        if((fb->doc = bson_copy(doc)) == NULL)
+            res = -ENOMEM;
     }
+    mongoc_cursor_destroy(curs);
+    return res;
+}
 
-    bson_iter_init(&iter, doc);
-    size_t outsize, compsize = 0;
-    const char * compdata = NULL;
-    uint32_t offset = 0, size = 0;
+/*
+ * Gets every block that isn't already in the block cache with a single
+ * { _id: { $in: [ ... ] } } query and keeps each document in its slot in
+ * fetched.
+ */
+static int fetch_blocks(struct fetched_block * fetched, size_t nfetched) {
+    bson_t query, sub, inlist;
+    const bson_t * doc;
+    bson_error_t dberr;
+    mongoc_collection_t * coll = get_coll(COLL_BLOCKS);
+    mongoc_cursor_t * curs;
+    uint64_t start, ndocs = 0, nbytes = 0;
+    size_t i;
+    int res = 0;
 
-    while(bson_iter_next(&iter)) {
-        const char * key = bson_iter_key(&iter);
-        if(strcmp(key, "data") == 0) {
-            bson_subtype_t subtype;
-            bson_iter_binary(&iter, &subtype, 
-                (uint32_t*)&compsize, (const uint8_t**)&compdata);
-        }
-        else if(strcmp(key, "offset") == 0)
-            offset = bson_iter_int32(&iter);
-        else if(strcmp(key, "size") == 0)
-            size = bson_iter_int32(&iter);
+    bson_init(&query);
+    bson_append_document_begin(&query, KEYEXP("_id"), &sub);
+    bson_append_array_begin(&sub, KEYEXP("$in"), &inlist);
+    for(i = 0; i < nfetched; i++) {
+        char idxbuf[10];
+        const char * idxstr;
+        size_t idxlen = bson_uint32_to_string(i, &idxstr,
+            idxbuf, sizeof(idxbuf));
+        append_hash(&inlist, idxstr, idxlen,
+            fetched[i].hashalg, fetched[i].hash);
     }
+    bson_append_array_end(&sub, &inlist);
+    bson_append_document_end(&query, &sub);
 
-    if(!compdata) {
-        logit(ERROR, "No data in block?");
-        mongoc_cursor_destroy(curs);
+    start = stats_start();
+    curs = mongoc_collection_find(coll,
+        MONGOC_QUERY_NONE,
+        0, // skip
+        0, // limit
+        0, // batch_size
+        &query,
+        NULL, // fields
+        NULL); // read_prefs
+
+    bson_destroy(&query);
+
+    if(!curs) {
+        logit(ERROR, "Error creating cursor while searching for blocks");
         return -EIO;
     }
 
-    outsize = MAX_BLOCK_SIZE;
-    if((res = snappy_uncompress(compdata, compsize,
-        buf + offset, &outsize)) != SNAPPY_OK) {
-        fprintf(stderr, "Error uncompressing block %d\n", res);
-        mongoc_cursor_destroy(curs);
-        return -EIO;
+    while(mongoc_cursor_next(curs, &doc)) {
+        bson_iter_t iter;
+        uint8_t hash[HASH_LEN];
+        struct fetched_block * fb;
+
+        ndocs++;
+        nbytes += doc->len;
+        if(!bson_iter_init_find(&iter, doc, "_id") ||
+            read_hash(&iter, -1, hash) < 0)
+            continue;
+        fb = find_fetched(fetched, nfetched, hash);
+        if(!fb || fb->doc)
+            continue;
+
+        if((fb->doc = bson_copy(doc)) == NULL) {
+            res = -ENOMEM;
+            break;
+        }
     }
-    if(offset > 0)
-        memset(buf, 0, offset);
-    compsize = outsize + offset;
-    if(compsize < size)
-        memset(buf + compsize, 0, size - compsize);
-    mongoc_cursor_destroy(curs);
 
-    return 0;
+    trace_docs(ndocs, nbytes);
+    stats_end(STAT_DB_FIND, start);
+
+    if(res == 0 && mongoc_cursor_error(curs, &dberr)) {
+        logit(ERROR, "Error searching for blocks: %s", dberr.message);
+        res = -EIO;
+    }
+    mongoc_cursor_destroy(curs);
+    return res;
 }
 
-int mongo_read(const char *path, char *buf, size_t size, off_t offset,
-               struct fuse_file_info *fi) {
-    struct inode * e;
-    int res;
+/*
+ * Fetches every block in [offset, offset + size) of list that isn't
+ * already in the block cache with one round-trip. On success fetched
+ * holds the block documents and must be freed with free_fetched.
+ */
+static int gather_blocks(struct elist * list, off_t offset, size_t size,
+    struct fetched_block ** pfetched, size_t * pnfetched) {
     const off_t end = size + offset;
-    size_t idx;
-    struct elist * list = NULL;
-    char * extent_buf = get_extent_buf();
+    struct fetched_block * fetched = NULL;
+    size_t idx, nfetched = 0;
+    int res;
 
-    e = (struct inode*)fi->fh;
-    if((res = get_cached_inode(path, e)) != 0)
-        return res;
+    *pfetched = NULL;
+    *pnfetched = 0;
 
-    if(e->mode & S_IFDIR)
-        return -EISDIR;
+    for(idx = 0; idx < list->nnodes; idx++) {
+        const struct enode * cur = &list->list[idx];
+        const off_t curend = cur->off + cur->len;
 
-    pthread_mutex_lock(&e->wr_lock);
-    if(e->wr_extent) {
-        if((res = serialize_extent(e, e->wr_extent)) != 0) {
-            pthread_mutex_unlock(&e->wr_lock);
-            return res;
+        if(cur->empty || cur->off > end || curend < offset)
+            continue;
+        if(block_cache_get(cur->hash, NULL, 0, 0) == 0) {
+            stats_add(STAT_CACHE_HITS, 1);
+            continue;
         }
-        e->wr_extent->nnodes = 0;
+        stats_add(STAT_CACHE_MISSES, 1);
+
+        if(!fetched) {
+            fetched = calloc(list->nnodes, sizeof(struct fetched_block));
+            if(!fetched)
+                return -ENOMEM;
+        }
+        if(find_fetched(fetched, nfetched, cur->hash))
+            continue;
+        memcpy(fetched[nfetched].hash, cur->hash, HASH_LEN);
+        fetched[nfetched++].hashalg = cur->hashalg;
     }
-    e->wr_age = time(NULL);
-    pthread_mutex_unlock(&e->wr_lock);
 
-    if((res = deserialize_extent(e, offset, size, &list)) != 0)
+    if(nfetched == 0)
+        return 0;
+
+    if((res = fetch_blocks(fetched, nfetched)) != 0) {
+        free_fetched(fetched, nfetched);
         return res;
+    }
+
+    *pfetched = fetched;
+    *pnfetched = nfetched;
+    return 0;
+}
+
+/*
+ * Pulls the blocks for [offset, offset + size) into the block cache
+ * without copying them anywhere. This is what read-ahead runs.
+ */
+int prefetch_blocks(struct elist * list, off_t offset, size_t size) {
+    struct fetched_block * fetched;
+    size_t idx, nfetched, blocklen;
+    int res;
 
-    if(list->nnodes == 0) {
-        memset(buf, 0, size);
-        free(list);
-        return size;
+    res = gather_blocks(list, offset, size, &fetched, &nfetched);
+    for(idx = 0; res == 0 && idx < nfetched; idx++) {
+        if(fetched[idx].doc)
+            res = decode_fetched(&fetched[idx], get_extent_buf(),
+                MAX_BLOCK_SIZE, &blocklen);
     }
+    free_fetched(fetched, nfetched);
+    return res;
+}
+
+/*
+ * Fills buf with the range [offset, offset + size) of the file described
+ * by list. Blocks missing from the block cache are all fetched in one
+ * round-trip before anything is copied, then the enodes are applied in
+ * list order so later enodes still win where they overlap.
+ */
+static int resolve_blocks(struct inode * e, struct elist * list,
+    char * buf, off_t offset, size_t size) {
+    const off_t end = size + offset;
+    struct fetched_block * fetched, single;
+    size_t idx, nfetched;
+    int res;
+
+    res = gather_blocks(list, offset, size, &fetched, &nfetched);
+    if(res != 0)
+        return res;
 
     if(list->list[0].off > offset)
         memset(buf, 0, list->list[0].off - offset);
@@ -141,6 +356,7 @@ int mongo_read(const char *path, char *buf, size_t size, off_t offset,
         const struct enode * cur = &list->list[idx];
         const off_t curend = cur->off + cur->len;
         size_t inskip = 0, tocopy = cur->len, outskip = 0;
+        struct fetched_block * fb;
  
         if(cur->off > end || curend < offset)
             continue;
@@ -156,14 +372,134 @@ int mongo_read(const char *path, char *buf, size_t size, off_t offset,
             memset(buf + outskip, 0, tocopy);
             continue;
         }
- 
-        res = resolve_block(e, (uint8_t*)cur->hash, extent_buf);
+        inskip += cur->boff;
+
+        fb = find_fetched(fetched, nfetched, cur->hash);
+        if(fb && fb->doc) {
+            if((res = copy_fetched(fb, buf + outskip, inskip, tocopy)) != 0)
+                goto end;
+            continue;
+        }
+
+        if(block_cache_get(cur->hash, buf + outskip, inskip, tocopy) == 0)
+            continue;
+
+        // Either the block fell out of the cache since we checked or it
+        // wasn't returned by the batch query, try it on its own.
+        res = fetch_block(cur, &single);
+        if(res == 0)
+            res = copy_fetched(&single, buf + outskip, inskip, tocopy);
+        if(single.doc)
+            bson_destroy(single.doc);
         if(res != 0)
-            return res;
-        memcpy(buf + outskip, extent_buf + inskip, tocopy);
+            goto end;
     }
 
+end:
+    free_fetched(fetched, nfetched);
+    return res;
+}
+
+/*
+ * Data that's been written but isn't in the extent map yet, either
+ * because it's still in the block pipeline or still in the write-back
+ * buffer, is copied out under wr_lock and laid over the read afterwards.
+ */
+struct overlay {
+    struct overlay * next;
+    off_t off;
+    size_t len;
+    char data[1];
+};
+
+struct overlay_list {
+    struct overlay * head;
+    struct overlay ** tail;
+    off_t offset;
+    off_t end;
+};
+
+static int add_overlay(void * p, const char * data, off_t off, size_t len) {
+    struct overlay_list * ol = (struct overlay_list*)p;
+    const off_t start = off > ol->offset ? off : ol->offset;
+    const off_t stop = off + (off_t)len < ol->end ? off + (off_t)len : ol->end;
+    struct overlay * o;
+
+    if(stop <= start)
+        return 0;
+    if((o = malloc(sizeof(struct overlay) + (stop - start))) == NULL)
+        return -ENOMEM;
+    o->next = NULL;
+    o->off = start;
+    o->len = stop - start;
+    memcpy(o->data, data + (start - off), o->len);
+    *ol->tail = o;
+    ol->tail = &o->next;
+    return 0;
+}
+
+int mongo_read(const char *path, char *buf, size_t size, off_t offset,
+               struct fuse_file_info *fi) {
+    struct inode * e;
+    int res;
+    const off_t end = size + offset;
+    struct elist * list = NULL;
+    struct overlay_list pending = { NULL, &pending.head, offset, end };
+    struct overlay * o;
+
+    if(stats_file(path))
+        return stats_read(fi, buf, size, offset);
+
+    e = (struct inode*)fi->fh;
+    if((res = get_cached_inode(path, e)) != 0)
+        return res;
+
+    if(e->mode & S_IFDIR)
+        return -EISDIR;
+
+    // Writes that haven't been serialized yet are already in the extent
+    // map, so there's no need to flush them before reading.
+    pthread_mutex_lock(&e->wr_lock);
+
+    // Someone else changed the file's extents since the map was loaded.
+    if(e->map && !bson_oid_equal(&e->map_gen, &e->extgen)) {
+        free(e->map);
+        e->map = NULL;
+    }
+    if(!e->map && (res = load_extent_map(e)) != 0) {
+        pthread_mutex_unlock(&e->wr_lock);
+        return res;
+    }
+    detect_readahead(e, offset, size);
+    res = map_lookup(e->map, offset, size, &list);
+
+    // Blocks still in the pipeline or the write-back buffer aren't.
+    if(res == 0)
+        res = inflight_blocks(e, add_overlay, &pending);
+    if(res == 0 && e->wb_len > 0)
+        res = add_overlay(&pending, e->wb_buf, e->wb_off, e->wb_len);
+    pthread_mutex_unlock(&e->wr_lock);
+
+    if(res == 0) {
+        if(list == NULL || list->nnodes == 0)
+            memset(buf, 0, size);
+        else {
+            int span = span_begin("resolve_blocks");
+            res = resolve_blocks(e, list, buf, offset, size);
+            span_end(span, 0, size);
+        }
+    }
     free(list);
+
+    while((o = pending.head) != NULL) {
+        if(res == 0)
+            memcpy(buf + (o->off - offset), o->data, o->len);
+        pending.head = o->next;
+        free(o);
+    }
+    if(res != 0)
+        return res;
+    stats_add(STAT_BYTES_READ, size);
     return size;
 }
 
@@ -171,6 +507,7 @@ int update_filesize(struct inode * e, off_t newsize) {
     bson_t cond, doc, set;
     bson_error_t dberr;
     mongoc_collection_t * coll = get_coll(COLL_INODES);
+    uint64_t start;
     bool res;
 
     if(newsize < e->size)
@@ -186,15 +523,18 @@ int update_filesize(struct inode * e, off_t newsize) {
     bson_append_int64(&set, KEYEXP("size"), newsize);
     bson_append_document_end(&doc, &set);
 
+    start = stats_start();
     res = mongoc_collection_update(coll,
         MONGOC_UPDATE_NONE,
         &cond,
         &doc,
         NULL, // write concern
         &dberr);
+    stats_end(STAT_DB_UPDATE, start);
 
     bson_destroy(&cond);
     bson_destroy(&doc);
+    attr_cache_invalidate_inode(e);
 
     if(!res) {
         char oidstr[25];
@@ -207,145 +547,224 @@ int update_filesize(struct inode * e, off_t newsize) {
     return 0;
 }
 
-int mongo_write(const char *path, const char *buf, size_t size,
-                off_t offset, struct fuse_file_info *fi)
-{
-    struct inode * e;
-    int res;
-    size_t reallen;
-    int32_t realend = size, blk_offset = 0;
-    const off_t write_end = size + offset;
-    char * lock;
-    bson_t doc, cond, setoninsert;
-    bson_error_t dberr;
-    mongoc_collection_t * coll = get_coll(COLL_BLOCKS);
-    uint8_t hash[20];
-    time_t now = time(NULL);
+/*
+ * Small writes are gathered in a per-inode buffer until they fill a
+ * MAX_BLOCK_SIZE aligned block, so a stream of 4 KiB writes becomes one
+ * block document and one enode per 64 KiB instead of sixteen. The
+ * buffer only ever holds one contiguous run inside a single aligned
+ * block. Buffers are capped at writeback_limit bytes across all files;
+ * once that's used up writes go straight to submit_block.
+ *
+ * With content-defined chunking the buffer holds a contiguous run that
+ * can start anywhere, and is cut into blocks wherever cdc_next_cut finds
+ * a chunk boundary instead of at aligned offsets.
+ */
+static size_t writeback_limit = 0;
+static size_t writeback_used = 0;
+
+void setup_writeback(size_t limit) {
+    writeback_limit = limit;
+}
 
-    e = (struct inode*)fi->fh;
-    if((res = get_cached_inode(path, e)) != 0)
-        return res;
+static int reserve_writeback(struct inode * e) {
+    if(e->wb_buf)
+        return 1;
+    if(__sync_add_and_fetch(&writeback_used, MAX_BLOCK_SIZE) > writeback_limit) {
+        __sync_sub_and_fetch(&writeback_used, MAX_BLOCK_SIZE);
+        return 0;
+    }
+    if((e->wb_buf = malloc(MAX_BLOCK_SIZE)) == NULL) {
+        __sync_sub_and_fetch(&writeback_used, MAX_BLOCK_SIZE);
+        return 0;
+    }
+    return 1;
+}
 
-    if(e->mode & S_IFDIR)
-        return -EISDIR;
+void free_writeback(struct inode * e) {
+    if(!e->wb_buf)
+        return;
+    free(e->wb_buf);
+    e->wb_buf = NULL;
+    e->wb_len = 0;
+    __sync_sub_and_fetch(&writeback_used, MAX_BLOCK_SIZE);
+}
 
-    /* Uncomment this for incredibly slow length calculations.
-    for(;realend >= 0 && buf[realend] == '\0'; realend--);
-    realend++;
-    for(blk_offset = 0; blk_offset < realend && buf[blk_offset] == 0; blk_offset++);
-    blk_offset -= blk_offset > 0 ? 1 : 0;
-    * The code below uses SSE4 instructions to find the first/last
-    * zero bytes by doing 16-byte comparisons at a time. This should give
-    * a ~16 speed boost on blocks with lots of zero bytes over the dumb
-    * method above.
-    */
-    
-    if(size >= 16) {
-        __m128i zero = _mm_setzero_si128();
-        lock = (char*)buf + size - 16;
-        while(lock >= buf) {
-            __m128i x = _mm_loadu_si128((__m128i*)lock);
-            res = _mm_movemask_epi8(_mm_cmpeq_epi8(zero, x));
-            if(res == 0xffff) {
-                lock -= 16;
-                continue;
-            }
-            realend = lock - buf + fls(res ^ 0xffff);
-            break;
-        }
-        if(lock <= buf)
-            realend = 0;
-
-        lock = (char*)buf;
-        while(lock - buf < realend) {
-            __m128i x = _mm_loadu_si128((__m128i*)lock);
-            res = _mm_movemask_epi8(_mm_cmpeq_epi8(zero, x));
-            if(res == 0xffff) {
-                lock += 16;
-                continue;
-            }
-            blk_offset = lock - buf + ffs(res ^ 0xffff) - 1;
-            break;
-        }
-    }
+/*
+ * Commits whatever is in the write-back buffer and gives the buffer back.
+ * Must be called with e->wr_lock held.
+ */
+int flush_writeback(struct inode * e) {
+    int res = 0;
+
+    if(e->wb_len > 0)
+        res = submit_block(e, e->wb_buf, e->wb_len, e->wb_off);
+    free_writeback(e);
+    return res;
+}
 
-    reallen = realend - blk_offset;
-    if(reallen == 0) {
-        pthread_mutex_lock(&e->wr_lock);
-        res = insert_empty(&e->wr_extent, offset, size);
-        goto end;
+/*
+ * Where written data comes from: a plain buffer for write, or whatever
+ * libfuse handed write_buf, which can be a pipe the kernel spliced the
+ * data into. Either way it's read once, straight into the write-back
+ * buffer or a new block job.
+ */
+struct write_src {
+    const char * mem;
+    struct fuse_bufvec * bufv;
+};
+
+static int read_src(void * p, char * out, size_t len) {
+    struct write_src * src = (struct write_src*)p;
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+    ssize_t res;
+
+    if(src->mem) {
+        memcpy(out, src->mem, len);
+        src->mem += len;
+        return 0;
     }
 
-#ifdef __APPLE__
-    CC_SHA1(buf, size, hash);
-#else
-    SHA1(buf, size, hash);
-#endif
+    dst.buf[0].mem = out;
+    res = fuse_buf_copy(&dst, src->bufv, 0);
+    if(res < 0)
+        return res;
+    return (size_t)res == len ? 0 : -EIO;
+}
 
-    bson_init(&cond);
-    bson_append_binary(&cond, KEYEXP("_id"), 0, hash, sizeof(hash));
+static int write_fixed(struct inode * e, struct write_src * src, size_t size,
+    off_t offset) {
+    size_t pos;
+    int res = 0;
+
+    for(pos = 0; res == 0 && pos < size;) {
+        const off_t cur = offset + pos;
+        const off_t blockend = (cur / MAX_BLOCK_SIZE + 1) * MAX_BLOCK_SIZE;
+        size_t n = size - pos;
+        if(n > blockend - cur)
+            n = blockend - cur;
+
+        if(n == MAX_BLOCK_SIZE || !reserve_writeback(e))
+            res = submit_block_with(e, n, cur, read_src, src);
+        else if((res = read_src(src, e->wb_buf + e->wb_len, n)) == 0) {
+            if(e->wb_len == 0)
+                e->wb_off = cur;
+            e->wb_len += n;
+            if(e->wb_off + e->wb_len == blockend)
+                res = flush_writeback(e);
+        }
+        pos += n;
+    }
+    return res;
+}
 
-    bson_init(&doc);
-    bson_append_document_begin(&doc, KEYEXP("$setOnInsert"), &setoninsert);
+/*
+ * Appends to the write-back buffer and submits every whole chunk in it.
+ * The buffer must already be reserved.
+ */
+static int write_chunks(struct inode * e, struct write_src * src, size_t size,
+    off_t offset) {
+    size_t pos = 0, n, cut;
+    int res;
 
-    char * comp_out = get_compress_buf();
-    size_t comp_size = snappy_max_compressed_length(reallen);
-    if((res = snappy_compress(buf + blk_offset, reallen,
-        comp_out, &comp_size)) != SNAPPY_OK) {
-        fprintf(stderr, "Error compressing input: %d\n", res);
-        return -EIO;
+    while(pos < size) {
+        if(e->wb_len == 0) {
+            e->wb_off = offset + pos;
+            e->wb_scan = 0;
+            e->wb_fp = 0;
+        }
+        n = MAX_BLOCK_SIZE - e->wb_len;
+        if(n > size - pos)
+            n = size - pos;
+        if((res = read_src(src, e->wb_buf + e->wb_len, n)) != 0)
+            return res;
+        e->wb_len += n;
+        pos += n;
+
+        while((cut = cdc_next_cut(e->wb_buf, e->wb_len,
+            &e->wb_scan, &e->wb_fp)) > 0) {
+            if((res = submit_block(e, e->wb_buf, cut, e->wb_off)) != 0)
+                return res;
+            e->wb_len -= cut;
+            e->wb_off += cut;
+            e->wb_scan = 0;
+            e->wb_fp = 0;
+            memmove(e->wb_buf, e->wb_buf + cut, e->wb_len);
+        }
     }
+    return 0;
+}
 
-    bson_append_binary(&setoninsert, KEYEXP("data"), 0,
-        (const uint8_t*)comp_out, comp_size);
-    bson_append_int64(&setoninsert, KEYEXP("offset"), blk_offset);
-    bson_append_int64(&setoninsert, KEYEXP("size"), size);
-    bson_append_time_t(&setoninsert, KEYEXP("created"), now);
-    bson_append_document_end(&doc, &setoninsert);
+static int write_from(const char * path, struct write_src * src, size_t size,
+    off_t offset, struct fuse_file_info * fi) {
+    struct inode * e;
+    int res;
+    const off_t write_end = size + offset;
+    time_t now = time(NULL);
 
-    res = mongoc_collection_update(coll,
-        MONGOC_UPDATE_UPSERT,
-        &cond,
-        &doc,
-        NULL, // write concern
-        &dberr);
-    bson_destroy(&doc);
-    bson_destroy(&cond);    
+    e = (struct inode*)fi->fh;
+    if((res = get_cached_inode(path, e)) != 0)
+        return res;
 
-    if(!res) {
-        logit(ERROR, "Error commiting block: %s", dberr.message);
-        return -EIO;
-    }
+    if(e->mode & S_IFDIR)
+        return -EISDIR;
 
     pthread_mutex_lock(&e->wr_lock);
-    res = insert_hash(&e->wr_extent, offset, size, hash);
+    if(e->wb_len > 0 && offset != e->wb_off + e->wb_len)
+        res = flush_writeback(e);
+
+    if(res == 0) {
+        if(chunk_mode == CHUNK_CDC && reserve_writeback(e))
+            res = write_chunks(e, src, size, offset);
+        else
+            res = write_fixed(e, src, size, offset);
+    }
 
-end:
     if(write_end > e->size)
         e->size = write_end;
 
-    if(now - e->wr_age > 3) {
+    if(res == 0 && e->wr_extent && now - e->wr_age > 3) {
         res = serialize_extent(e, e->wr_extent);
-        if(res != 0) {
-            pthread_mutex_unlock(&e->wr_lock);
-            return res;    
-        }
         e->wr_age = now;
     }
     pthread_mutex_unlock(&e->wr_lock);
     if(res != 0)
         return res;
 
+    throttle_pipeline();
     res = update_filesize(e, write_end);
 
     if(res != 0)
         return res;
+    stats_add(STAT_BYTES_WRITTEN, size);
     return size;
 }
 
+int mongo_write(const char *path, const char *buf, size_t size,
+                off_t offset, struct fuse_file_info *fi)
+{
+    struct write_src src = { buf, NULL };
+    return write_from(path, &src, size, offset, fi);
+}
+
+/*
+ * Like mongo_write, but takes the data as libfuse got it. With splice
+ * that's a pipe, and the data goes from there into the block it ends up
+ * in without being copied into a request buffer first.
+ */
+int mongo_write_buf(const char * path, struct fuse_bufvec * bufv,
+    off_t offset, struct fuse_file_info * fi) {
+    struct write_src src = { NULL, bufv };
+    const struct fuse_buf * first = &bufv->buf[bufv->idx];
+
+    if(bufv->count - bufv->idx == 1 && !(first->flags & FUSE_BUF_IS_FD))
+        src.mem = (const char*)first->mem + bufv->off;
+    return write_from(path, &src, fuse_buf_size(bufv), offset, fi);
+}
+
 int do_trunc(struct inode * e, off_t off) {
     bson_t cond;
     bson_error_t dberr;
+    uint64_t started;
     int res;
     mongoc_collection_t * coll = get_coll(COLL_EXTENTS);
 
@@ -355,11 +774,21 @@ int do_trunc(struct inode * e, off_t off) {
     }
 
     pthread_mutex_lock(&e->wr_lock);
-    if(e->wr_extent) {
-        if(off < 0 && (res = serialize_extent(e, e->wr_extent)) != 0)
+    if((res = flush_writeback(e)) != 0 || (res = wait_for_blocks(e)) != 0) {
+        pthread_mutex_unlock(&e->wr_lock);
+        return res;
+    }
+    // What was written below off has to be in the extent documents
+    // before the ones past it are removed.
+    if(e->wr_extent && off > 0) {
+        elist_truncate(e->wr_extent, off);
+        if((res = serialize_extent(e, e->wr_extent)) != 0) {
+            pthread_mutex_unlock(&e->wr_lock);
             return res;
-        e->wr_extent->nnodes = 0;
+        }
     }
+    if(e->wr_extent)
+        e->wr_extent->nnodes = 0;
     e->wr_age = time(NULL);
     pthread_mutex_unlock(&e->wr_lock);
 
@@ -372,11 +801,13 @@ int do_trunc(struct inode * e, off_t off) {
         bson_append_document_end(&cond, &start);
     }
 
+    started = stats_start();
     res = mongoc_collection_delete(coll,
         0, // flags,
         &cond,
         NULL, // write concern,
         &dberr);
+    stats_end(STAT_DB_DELETE, started);
     bson_destroy(&cond);
     if(!res) {
         char oidstr[25];
@@ -384,6 +815,18 @@ int do_trunc(struct inode * e, off_t off) {
         logit(ERROR, "Error removing extents for %s: %s", oidstr, dberr.message);
         return -EIO;
     }
+    if(off > 0 && (res = cut_extents(e, off)) != 0)
+        return res;
+
+    bson_oid_t gen;
+    bson_oid_init(&gen, NULL);
+    pthread_mutex_lock(&e->wr_lock);
+    if(e->map)
+        map_truncate(e->map, off);
+    res = bump_extgen(e, &gen);
+    pthread_mutex_unlock(&e->wr_lock);
+    if(res != 0)
+        return res;
 
     e->size = off;
 
@@ -0,0 +1,169 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "mongo-fuse.h"
+
+/*
+ * Read-ahead for sequential readers. Each open file tracks where its
+ * last read ended; while reads keep starting there, the window of data
+ * fetched ahead of the reader doubles up to max_window. The fetching is
+ * done by a small pool of worker threads that pull the blocks for the
+ * window into the block cache, so the reader finds them there when it
+ * catches up. The enodes for each piece come from the file's extent map
+ * when it's queued, so the workers only query the extents collection
+ * for files that don't have one.
+ */
+
+#define RA_THREADS 4
+#define RA_QUEUE_LEN 64
+#define RA_MIN_WINDOW (4 * MAX_BLOCK_SIZE)
+
+struct ra_job {
+    bson_oid_t oid;
+    off_t off;
+    size_t len;
+    int mapped;
+    struct elist * list;
+};
+
+static struct ra_job ra_queue[RA_QUEUE_LEN];
+static size_t ra_head = 0, ra_count = 0;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+static size_t max_window = 0;
+static int ra_running = 0;
+
+void setup_readahead(size_t maxwindow) {
+    max_window = maxwindow;
+}
+
+static void * readahead_worker(void * p) {
+    struct ra_job job;
+    struct inode e;
+    struct elist * list;
+    int res;
+
+    for(;;) {
+        pthread_mutex_lock(&ra_lock);
+        while(ra_count == 0)
+            pthread_cond_wait(&ra_cond, &ra_lock);
+        job = ra_queue[ra_head];
+        ra_head = (ra_head + 1) % RA_QUEUE_LEN;
+        ra_count--;
+        pthread_mutex_unlock(&ra_lock);
+
+        // Pieces queued without a map only carry the oid, which is all
+        // deserialize_extent needs, so this doesn't hold onto the file
+        // handle that asked for the read-ahead.
+        list = job.list;
+        res = 0;
+        if(!job.mapped) {
+            init_inode(&e);
+            bson_oid_copy(&job.oid, &e.oid);
+            res = deserialize_extent(&e, job.off, job.len, &list);
+        }
+        if(res == 0 && list != NULL)
+            res = prefetch_blocks(list, job.off, job.len);
+        if(res != 0)
+            logit(DEBUG, "Read-ahead failed: %d", res);
+        free(list);
+    }
+    return NULL;
+}
+
+void start_readahead() {
+    pthread_t thread;
+    int i;
+
+    if(max_window == 0)
+        return;
+
+    for(i = 0; i < RA_THREADS; i++) {
+        if(pthread_create(&thread, NULL, readahead_worker, NULL) != 0) {
+            logit(WARN, "Could not start read-ahead thread");
+            break;
+        }
+        pthread_detach(thread);
+        ra_running++;
+    }
+}
+
+/*
+ * Queues a piece of e for the workers, with its enodes from the extent
+ * map if e has one.
+ */
+static void queue_readahead(struct inode * e, off_t off, size_t len) {
+    struct elist * list = NULL;
+    int mapped = 0;
+
+    if(e->map && map_lookup(e->map, off, len, &list) == 0) {
+        // Nothing but holes, so there's nothing to fetch.
+        if(!list)
+            return;
+        mapped = 1;
+    }
+
+    pthread_mutex_lock(&ra_lock);
+    if(ra_count == RA_QUEUE_LEN) {
+        pthread_mutex_unlock(&ra_lock);
+        free(list);
+        logit(DEBUG, "Read-ahead queue is full, dropping request");
+        return;
+    }
+    struct ra_job * job = &ra_queue[(ra_head + ra_count++) % RA_QUEUE_LEN];
+    bson_oid_copy(&e->oid, &job->oid);
+    job->off = off;
+    job->len = len;
+    job->mapped = mapped;
+    job->list = list;
+    pthread_cond_signal(&ra_cond);
+    pthread_mutex_unlock(&ra_lock);
+}
+
+/*
+ * Called from mongo_read with e->wr_lock held and the extent map loaded
+ * for every read. Once the reader gets within half a window of what's
+ * already been queued, the window grows and the next stretch of the file is queued in
+ * RA_MIN_WINDOW sized pieces so the workers can fetch them in parallel.
+ */
+void detect_readahead(struct inode * e, off_t offset, size_t size) {
+    const off_t end = offset + size;
+    size_t minwindow = max_window < RA_MIN_WINDOW ? max_window : RA_MIN_WINDOW;
+    off_t start, stop;
+
+    if(ra_running == 0)
+        return;
+
+    if(offset != e->ra_next) {
+        e->ra_next = end;
+        e->ra_window = 0;
+        e->ra_issued = 0;
+        return;
+    }
+    e->ra_next = end;
+
+    if(e->ra_issued > end && e->ra_issued - end >= e->ra_window / 2)
+        return;
+
+    if(e->ra_window == 0)
+        e->ra_window = minwindow;
+    else if(e->ra_window * 2 <= max_window)
+        e->ra_window *= 2;
+    else
+        e->ra_window = max_window;
+
+    start = e->ra_issued > end ? e->ra_issued : end;
+    stop = end + e->ra_window;
+    if(stop > e->size)
+        stop = e->size;
+    if(stop <= start)
+        return;
+
+    e->ra_issued = stop;
+    while(start < stop) {
+        size_t len = stop - start > minwindow ? minwindow : stop - start;
+        queue_readahead(e, start, len);
+        start += len;
+    }
+}
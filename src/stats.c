@@ -0,0 +1,416 @@
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include "mongo-fuse.h"
+
+/*
+ * Counters and latency histograms for every FUSE operation and the
+ * database and codec calls under them, readable from /.stats as text and
+ * /.stats.json as JSON. The slow operation log in trace.c is read from
+ * /.slowlog the same way.
+ *
+ * Each thread keeps its own copy of everything and is the only one that
+ * writes to it, so recording is a few plain increments with no locks or
+ * atomics. Reading adds up every thread's copy, which can be a few
+ * operations behind a thread that's busy. Threads that exit fold their
+ * numbers into a retired total.
+ *
+ * Histograms are log-linear like HdrHistogram: 8 buckets per power of
+ * two of microseconds, so a percentile is never off by more than 12.5%.
+ */
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+// Up to 2^32 microseconds, which is over an hour.
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+struct thread_stats {
+    struct thread_stats * next;
+    struct thread_stats * prev;
+    uint64_t counters[STAT_COUNTER_MAX];
+    struct histogram timers[STAT_TIMER_MAX];
+};
+
+// What an open stats file reads back.
+struct stats_buf {
+    char * data;
+    size_t len;
+    size_t cap;
+};
+
+static const char * timer_names[STAT_TIMER_MAX] = {
+    "getattr", "readdir", "open", "read", "write", "create", "truncate",
+    "mkdir", "unlink", "link", "chmod", "chown", "rmdir", "utimens",
+    "rename", "access", "symlink", "readlink", "flush", "fsync",
+    "release", "setxattr", "lookup",
+    "db_find", "db_upsert", "db_update", "db_insert", "db_delete",
+    "compress", "decompress",
+};
+
+static const char * counter_names[STAT_COUNTER_MAX] = {
+    "bytes_read", "bytes_written", "block_cache_hits", "block_cache_misses",
+};
+
+static pthread_key_t stats_key;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats * all_stats = NULL;
+static struct thread_stats retired;
+static __thread struct thread_stats * my_stats = NULL;
+static uint64_t started_us = 0;
+
+static uint64_t now_us() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static void merge_stats(struct thread_stats * into,
+    const struct thread_stats * from) {
+    int i, b;
+
+    for(i = 0; i < STAT_COUNTER_MAX; i++)
+        into->counters[i] += from->counters[i];
+    for(i = 0; i < STAT_TIMER_MAX; i++) {
+        struct histogram * h = &into->timers[i];
+        const struct histogram * fh = &from->timers[i];
+
+        h->count += fh->count;
+        h->total_us += fh->total_us;
+        if(fh->max_us > h->max_us)
+            h->max_us = fh->max_us;
+        for(b = 0; b < HIST_BUCKETS; b++)
+            h->buckets[b] += fh->buckets[b];
+    }
+}
+
+static void retire_stats(void * p) {
+    struct thread_stats * ts = (struct thread_stats*)p;
+
+    pthread_mutex_lock(&stats_lock);
+    merge_stats(&retired, ts);
+    if(ts->prev)
+        ts->prev->next = ts->next;
+    else
+        all_stats = ts->next;
+    if(ts->next)
+        ts->next->prev = ts->prev;
+    pthread_mutex_unlock(&stats_lock);
+    free(ts);
+}
+
+void start_stats() {
+    pthread_key_create(&stats_key, retire_stats);
+    started_us = now_us();
+}
+
+static struct thread_stats * get_stats() {
+    struct thread_stats * ts = my_stats;
+
+    if(ts)
+        return ts;
+    if((ts = calloc(1, sizeof(struct thread_stats))) == NULL)
+        return NULL;
+    pthread_mutex_lock(&stats_lock);
+    ts->next = all_stats;
+    if(all_stats)
+        all_stats->prev = ts;
+    all_stats = ts;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, ts);
+    my_stats = ts;
+    return ts;
+}
+
+static int hist_bucket(uint64_t us) {
+    int msb;
+
+    if(us < HIST_SUB)
+        return us;
+    if(us >= (1ULL << 32))
+        return HIST_BUCKETS - 1;
+    msb = 63 - __builtin_clzll(us);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+        ((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// The largest value that lands in bucket b.
+static uint64_t hist_value(int b) {
+    int shift;
+
+    if(b < HIST_SUB)
+        return b;
+    shift = b / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + b % HIST_SUB + 1) << shift) - 1;
+}
+
+static uint64_t hist_percentile(const struct histogram * h, double p) {
+    uint64_t want = (uint64_t)(h->count * p + 0.999999), seen = 0;
+    int b;
+
+    if(want == 0)
+        return 0;
+    for(b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if(seen >= want)
+            return hist_value(b) < h->max_us ? hist_value(b) : h->max_us;
+    }
+    return h->max_us;
+}
+
+uint64_t stats_start() {
+    return now_us();
+}
+
+void stats_end(int timer, uint64_t start) {
+    struct thread_stats * ts = get_stats();
+    struct histogram * h;
+    uint64_t elapsed = now_us() - start;
+
+    if(!ts)
+        return;
+    h = &ts->timers[timer];
+    h->count++;
+    h->total_us += elapsed;
+    if(elapsed > h->max_us)
+        h->max_us = elapsed;
+    h->buckets[hist_bucket(elapsed)]++;
+
+    if(timer >= STAT_DB_FIND)
+        trace_call(timer_names[timer], start, elapsed);
+}
+
+void stats_add(int counter, uint64_t n) {
+    struct thread_stats * ts = get_stats();
+    if(ts)
+        ts->counters[counter] += n;
+}
+
+static void buf_printf(struct stats_buf * sb, const char * fmt, ...) {
+    va_list ap;
+    int n;
+
+    for(;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(sb->data + sb->len, sb->cap - sb->len, fmt, ap);
+        va_end(ap);
+        if(n < 0)
+            return;
+        if(sb->len + n < sb->cap) {
+            sb->len += n;
+            return;
+        }
+
+        char * newdata = realloc(sb->data, sb->cap * 2 + n);
+        if(!newdata)
+            return;
+        sb->data = newdata;
+        sb->cap = sb->cap * 2 + n;
+    }
+}
+
+/*
+ * Counters kept elsewhere, by the caches and background threads. They're
+ * only ever added to with __sync builtins.
+ */
+struct global_counter {
+    const char * name;
+    const uint64_t * value;
+};
+
+static const struct global_counter global_counters[] = {
+    { "dedup_checks", &dedup_checks },
+    { "dedup_hits", &dedup_hits },
+    { "dedup_bytes", &dedup_bytes },
+    { "compact_runs", &compact_runs },
+    { "compact_aborts", &compact_aborts },
+    { "compact_docs_before", &compact_docs_before },
+    { "compact_docs_after", &compact_docs_after },
+    { "gc_runs", &gc_runs },
+    { "gc_blocks_deleted", &gc_blocks_deleted },
+    { "gc_bytes_reclaimed", &gc_bytes_reclaimed },
+    { "writeouts", &writeouts },
+    { "attr_cache_hits", &attr_cache_hits },
+    { "attr_cache_negative_hits", &attr_cache_negative_hits },
+    { "attr_cache_misses", &attr_cache_misses },
+    { "pool_checkouts", &pool_checkouts },
+    { "pool_waits", &pool_waits },
+    { "pool_wait_us", &pool_wait_us },
+    { "pool_max_queue", &pool_max_queue },
+};
+
+#define NGLOBAL (sizeof(global_counters) / sizeof(global_counters[0]))
+
+static void render_text(struct stats_buf * sb, const struct thread_stats * ts,
+    double uptime) {
+    size_t i;
+
+    buf_printf(sb, "uptime %.0f s\n\n", uptime);
+    buf_printf(sb, "%-12s %10s %9s %8s %8s %8s %8s %8s %8s\n",
+        "operation", "count", "per sec", "mean us", "p50", "p90", "p99",
+        "p99.9", "max");
+    for(i = 0; i < STAT_TIMER_MAX; i++) {
+        const struct histogram * h = &ts->timers[i];
+        if(h->count == 0)
+            continue;
+        buf_printf(sb, "%-12s %10llu %9.1f %8llu %8llu %8llu %8llu %8llu %8llu\n",
+            timer_names[i], (unsigned long long)h->count,
+            uptime > 0 ? h->count / uptime : 0.0,
+            (unsigned long long)(h->total_us / h->count),
+            (unsigned long long)hist_percentile(h, 0.5),
+            (unsigned long long)hist_percentile(h, 0.9),
+            (unsigned long long)hist_percentile(h, 0.99),
+            (unsigned long long)hist_percentile(h, 0.999),
+            (unsigned long long)h->max_us);
+    }
+
+    buf_printf(sb, "\n");
+    for(i = 0; i < STAT_COUNTER_MAX; i++)
+        buf_printf(sb, "%-26s %llu\n", counter_names[i],
+            (unsigned long long)ts->counters[i]);
+    for(i = 0; i < NGLOBAL; i++)
+        buf_printf(sb, "%-26s %llu\n", global_counters[i].name,
+            (unsigned long long)*global_counters[i].value);
+}
+
+static void render_json(struct stats_buf * sb, const struct thread_stats * ts,
+    double uptime) {
+    const char * sep = "";
+    size_t i;
+
+    buf_printf(sb, "{\"uptime_s\":%.0f,\"operations\":{", uptime);
+    for(i = 0; i < STAT_TIMER_MAX; i++) {
+        const struct histogram * h = &ts->timers[i];
+        if(h->count == 0)
+            continue;
+        buf_printf(sb, "%s\"%s\":{\"count\":%llu,\"mean_us\":%llu,"
+            "\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,"
+            "\"p999_us\":%llu,\"max_us\":%llu}", sep, timer_names[i],
+            (unsigned long long)h->count,
+            (unsigned long long)(h->total_us / h->count),
+            (unsigned long long)hist_percentile(h, 0.5),
+            (unsigned long long)hist_percentile(h, 0.9),
+            (unsigned long long)hist_percentile(h, 0.99),
+            (unsigned long long)hist_percentile(h, 0.999),
+            (unsigned long long)h->max_us);
+        sep = ",";
+    }
+
+    buf_printf(sb, "},\"counters\":{");
+    sep = "";
+    for(i = 0; i < STAT_COUNTER_MAX; i++) {
+        buf_printf(sb, "%s\"%s\":%llu", sep, counter_names[i],
+            (unsigned long long)ts->counters[i]);
+        sep = ",";
+    }
+    for(i = 0; i < NGLOBAL; i++)
+        buf_printf(sb, ",\"%s\":%llu", global_counters[i].name,
+            (unsigned long long)*global_counters[i].value);
+    buf_printf(sb, "}}\n");
+}
+
+static int render_stats(int which, struct stats_buf * sb) {
+    struct thread_stats * total, * ts;
+    double uptime = (now_us() - started_us) / 1000000.0;
+
+    if(which == STATS_SLOWLOG) {
+        if((sb->data = dump_slowlog(&sb->len)) == NULL)
+            return -ENOMEM;
+        sb->cap = sb->len;
+        return 0;
+    }
+
+    if((total = calloc(1, sizeof(struct thread_stats))) == NULL)
+        return -ENOMEM;
+    pthread_mutex_lock(&stats_lock);
+    merge_stats(total, &retired);
+    for(ts = all_stats; ts; ts = ts->next)
+        merge_stats(total, ts);
+    pthread_mutex_unlock(&stats_lock);
+
+    sb->len = 0;
+    sb->cap = 4096;
+    if((sb->data = malloc(sb->cap)) == NULL) {
+        free(total);
+        return -ENOMEM;
+    }
+    if(which == STATS_JSON)
+        render_json(sb, total, uptime);
+    else
+        render_text(sb, total, uptime);
+    free(total);
+    return 0;
+}
+
+// Which stats file path is, if it's one of them.
+int stats_file(const char * path) {
+    if(strcmp(path, "/.stats") == 0)
+        return STATS_TEXT;
+    if(strcmp(path, "/.stats.json") == 0)
+        return STATS_JSON;
+    if(strcmp(path, "/.slowlog") == 0)
+        return STATS_SLOWLOG;
+    return 0;
+}
+
+void stats_stat(struct stat * stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_mtime = stbuf->st_ctime = stbuf->st_atime = time(NULL);
+}
+
+/*
+ * Takes a snapshot of the stats for the file to read from. The size
+ * isn't known until then, so reads bypass the page cache.
+ */
+int stats_open(const char * path, struct fuse_file_info * fi) {
+    struct stats_buf * sb;
+    int res;
+
+    if((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+    if((sb = calloc(1, sizeof(struct stats_buf))) == NULL)
+        return -ENOMEM;
+    if((res = render_stats(stats_file(path), sb)) != 0) {
+        free(sb);
+        return res;
+    }
+    fi->fh = (uintptr_t)sb;
+    fi->direct_io = 1;
+    return 0;
+}
+
+int stats_read(struct fuse_file_info * fi, char * buf, size_t size,
+    off_t offset) {
+    struct stats_buf * sb = (struct stats_buf*)fi->fh;
+
+    if(offset >= sb->len)
+        return 0;
+    if(size > sb->len - offset)
+        size = sb->len - offset;
+    memcpy(buf, sb->data + offset, size);
+    return size;
+}
+
+void stats_release(struct fuse_file_info * fi) {
+    struct stats_buf * sb = (struct stats_buf*)fi->fh;
+    free(sb->data);
+    free(sb);
+}
@@ -1,32 +1,84 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <sys/time.h>
 #include "mongo-fuse.h"
 
-static pthread_key_t tls_key;
-extern mongoc_uri_t * dial_uri;
-extern int loglevel;
+/*
+ * Database connections. FUSE requests run inside acquire_conn and
+ * release_conn, and get a connection from a shared pool of pool_size
+ * while they do. libfuse starts more threads whenever every thread is
+ * busy, so a connection per thread would mean as many connections to
+ * mongod as the most requests that were ever in flight at once. Instead,
+ * requests past pool_size wait their turn in the order they arrived.
+ *
+ * The pooled clients come from a mongoc_client_pool_t, so they share one
+ * view of the cluster, and each keeps its collection handles while it's
+ * idle. They're taken from the pool once, by prewarm_pool at mount or
+ * on first use, and kept.
+ *
+ * Background threads are a fixed set and may block waiting on each
+ * other while a request holds a connection, so outside of acquire_conn
+ * each thread still gets its own client, as before.
+ */
 
-struct thread_data {
+struct conn_slot {
     mongoc_client_t * conn;
     mongoc_collection_t * coll_cache[COLL_MAX];
+    uint64_t checkouts;
+    uint64_t busy_us;
+    uint64_t since;
+};
+
+struct thread_data {
+    struct conn_slot own;
+    struct conn_slot * slot;
+    int depth;
 
     // This is a buffer for compression output that should hold the
-    // largest block size plus any overhead from snappy.
+    // largest block size plus any overhead from snappy, which has the
+    // largest worst case of the codecs.
     // See https://code.google.com/p/snappy/source/browse/trunk/snappy.cc#55
-    char compress_buf[32 + MAX_BLOCK_SIZE + MAX_BLOCK_SIZE / 6];
+    char compress_buf[COMPRESS_BUF_LEN];
     char extent_buf[MAX_BLOCK_SIZE];
 };
 
-void free_thread_data(void * tdr) {
-    struct thread_data * td = (struct thread_data*)tdr;
+static pthread_key_t tls_key;
+extern mongoc_uri_t * dial_uri;
+extern int loglevel;
+
+static mongoc_client_pool_t * client_pool = NULL;
+static struct conn_slot * slots = NULL;
+static int * free_slots = NULL;
+static int nfree = 0;
+static int pool_size = 0;
+static uint64_t next_ticket = 0;
+static uint64_t now_serving = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+uint64_t pool_checkouts = 0;
+uint64_t pool_waits = 0;
+uint64_t pool_wait_us = 0;
+uint64_t pool_max_queue = 0;
+
+static void free_slot(struct conn_slot * s) {
     int i;
     for(i = 0; i < COLL_MAX; i++) {
-        if(td->coll_cache[i] == NULL)
+        if(s->coll_cache[i] == NULL)
             continue;
-        mongoc_collection_destroy(td->coll_cache[i]);
+        mongoc_collection_destroy(s->coll_cache[i]);
     }
-    mongoc_client_destroy(td->conn);
+    if(s->conn)
+        mongoc_client_destroy(s->conn);
+}
+
+void free_thread_data(void * tdr) {
+    struct thread_data * td = (struct thread_data*)tdr;
+    if(td->slot)
+        logit(WARN, "Thread exited holding a pooled connection");
+    free_slot(&td->own);
     free(td);
 }
 
@@ -34,20 +86,164 @@ void setup_threading() {
     pthread_key_create(&tls_key, free_thread_data);
 }
 
+/*
+ * Sets up a pool of size connections. Nothing connects until
+ * prewarm_pool or the first request.
+ */
+int setup_pool(int size) {
+    int i;
+
+    if(size <= 0)
+        size = 1;
+    if((client_pool = mongoc_client_pool_new(dial_uri)) == NULL)
+        return -EINVAL;
+    mongoc_client_pool_max_size(client_pool, size);
+
+    slots = calloc(size, sizeof(struct conn_slot));
+    free_slots = calloc(size, sizeof(int));
+    if(!slots || !free_slots)
+        return -ENOMEM;
+    // Handed out from the end, so the first connections get reused most.
+    for(i = 0; i < size; i++)
+        free_slots[i] = size - i - 1;
+    nfree = pool_size = size;
+    return 0;
+}
+
+static uint64_t now_us() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static int ping(mongoc_client_t * conn) {
+    bson_t cmd, reply;
+    bson_error_t dberr;
+    int res = 0;
+
+    bson_init(&cmd);
+    bson_append_int32(&cmd, KEYEXP("ping"), 1);
+    if(!mongoc_client_command_simple(conn, "admin", &cmd, NULL,
+        &reply, &dberr)) {
+        logit(WARN, "Error connecting to the database: %s", dberr.message);
+        res = -EIO;
+    }
+    bson_destroy(&cmd);
+    bson_destroy(&reply);
+    return res;
+}
+
+/*
+ * Opens the first count connections in the pool, so the first requests
+ * after mounting don't each wait for a connection to be set up. Must be
+ * called before any requests are running.
+ */
+void prewarm_pool(int count) {
+    int i, ok = 0;
+
+    if(count > pool_size)
+        count = pool_size;
+    for(i = 0; i < count; i++) {
+        struct conn_slot * s = &slots[free_slots[pool_size - i - 1]];
+        if(!s->conn)
+            s->conn = mongoc_client_pool_pop(client_pool);
+        if(ping(s->conn) == 0)
+            ok++;
+    }
+    if(count > 0)
+        logit(INFO, "Opened %d of %d pooled connections", ok, pool_size);
+}
+
 struct thread_data * get_thread_data() {
     struct thread_data * td = pthread_getspecific(tls_key);
     if(td)
         return td;
     td = calloc(1, sizeof(struct thread_data));
-    td->conn = mongoc_client_new_from_uri(dial_uri);
-    if(td->conn == NULL) {
-        free(td);
+    if(td == NULL)
         return NULL;
-    }
     pthread_setspecific(tls_key, td);
     return td;
 }
 
+/*
+ * Gets the calling thread a pooled connection, waiting behind anyone who
+ * asked first if they're all in use. Calls nest; only the outermost
+ * acquire_conn takes a connection.
+ */
+void acquire_conn() {
+    struct thread_data * td = get_thread_data();
+    struct conn_slot * s;
+    uint64_t ticket, queued, start = 0;
+    int idx;
+
+    if(!td || td->depth++ > 0 || !slots)
+        return;
+
+    pthread_mutex_lock(&pool_lock);
+    ticket = next_ticket++;
+    if(ticket != now_serving || nfree == 0) {
+        queued = next_ticket - now_serving;
+        if(queued > pool_max_queue)
+            pool_max_queue = queued;
+        start = now_us();
+        while(ticket != now_serving || nfree == 0)
+            pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+    now_serving++;
+    idx = free_slots[--nfree];
+    pool_checkouts++;
+    // The next in line may be able to go too.
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    s = &slots[idx];
+    if(!s->conn)
+        s->conn = mongoc_client_pool_pop(client_pool);
+    s->checkouts++;
+    s->since = now_us();
+    if(start) {
+        __sync_fetch_and_add(&pool_waits, 1);
+        __sync_fetch_and_add(&pool_wait_us, s->since - start);
+    }
+    td->slot = s;
+}
+
+void release_conn() {
+    struct thread_data * td = get_thread_data();
+    struct conn_slot * s;
+
+    if(!td)
+        return;
+    s = td->slot;
+    if(td->depth == 0 || --td->depth > 0 || !s)
+        return;
+
+    s->busy_us += now_us() - s->since;
+    td->slot = NULL;
+    pthread_mutex_lock(&pool_lock);
+    free_slots[nfree++] = s - slots;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void log_pool_stats(uint64_t uptime_us) {
+    int i;
+
+    logit(INFO, "Connection pool: %llu checkouts, %llu waited "
+        "(%llu us total), at most %llu waiting",
+        (unsigned long long)pool_checkouts,
+        (unsigned long long)pool_waits,
+        (unsigned long long)pool_wait_us,
+        (unsigned long long)pool_max_queue);
+    for(i = 0; i < pool_size; i++) {
+        if(!slots[i].conn)
+            continue;
+        logit(INFO, "Connection %d: %llu checkouts, busy %.1f%% of the time",
+            i, (unsigned long long)slots[i].checkouts,
+            uptime_us ? slots[i].busy_us * 100.0 / uptime_us : 0.0);
+    }
+}
+
 char * get_extent_buf() {
     return get_thread_data()->extent_buf;
 }
@@ -58,21 +254,28 @@ char * get_compress_buf() {
 
 mongoc_collection_t * get_coll(int coll) {
     struct thread_data * td = get_thread_data();
+    struct conn_slot * s;
 
-    if(td->coll_cache[coll] != NULL)
-        return td->coll_cache[coll];
-
+    if(!td)
+        return NULL;
     if(coll >= COLL_MAX) {
         logit(ERROR, "Requesting invalid collection %d", coll);
         return NULL;
     }
 
+    s = td->slot ? td->slot : &td->own;
+    if(s->coll_cache[coll] != NULL)
+        return s->coll_cache[coll];
+
+    if(!s->conn && (s->conn = mongoc_client_new_from_uri(dial_uri)) == NULL)
+        return NULL;
+
     const char * coll_names[] = { "inodes", "blocks", "extents" };
     const char * dbname = mongoc_uri_get_database(dial_uri);
 
-    td->coll_cache[coll] = mongoc_client_get_collection(
-        td->conn, dbname, coll_names[coll]);
-    return td->coll_cache[coll];
+    s->coll_cache[coll] = mongoc_client_get_collection(
+        s->conn, dbname, coll_names[coll]);
+    return s->coll_cache[coll];
 }
 
 void logit(int level, const char * fmt, ...) {
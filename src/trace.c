@@ -0,0 +1,287 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include "mongo-fuse.h"
+
+/*
+ * Slow operation log. While an operation runs, its thread records a span
+ * for each step that matters (finding the inode, reading or writing
+ * extents, resolving blocks) and for every database and codec call under
+ * them, with how many documents and bytes each one handled. If the whole
+ * operation took longer than slow_ms, the span tree is formatted into a
+ * ring buffer of the last slowlog_size slow operations, which reads back
+ * from /.slowlog.
+ *
+ * Spans are written to the thread's own trace with no locking; only
+ * adding a finished entry to the ring takes a lock. Steps are recorded
+ * when they start, so the spans are already in tree order; calls timed
+ * by stats_end are leaves and are recorded when they finish, with the
+ * documents and bytes trace_docs counted while they ran.
+ */
+
+#define MAX_SPANS 256
+#define MAX_TRACE_PATH 256
+#define SLOWLOG_ENTRY_MAX 16384
+
+struct span {
+    const char * name;
+    int depth;
+    uint64_t start_us;
+    uint64_t dur_us;
+    uint64_t docs;
+    uint64_t bytes;
+};
+
+struct trace {
+    int active;
+    int depth;
+    int nspans;
+    int dropped;
+    uint64_t docs;
+    uint64_t bytes;
+    const char * op;
+    char path[MAX_TRACE_PATH];
+    uint64_t start_us;
+    struct span spans[MAX_SPANS];
+};
+
+static uint64_t slow_us = 0;
+static pthread_key_t trace_key;
+static __thread struct trace * my_trace = NULL;
+
+static pthread_mutex_t slowlog_lock = PTHREAD_MUTEX_INITIALIZER;
+static char ** slowlog = NULL;
+static size_t slowlog_size = 0;
+static size_t slowlog_next = 0;
+static uint64_t slowlog_total = 0;
+
+void setup_tracing(unsigned int slowms, unsigned int logsize) {
+    if(slowms == 0 || logsize == 0)
+        return;
+    if((slowlog = calloc(logsize, sizeof(char*))) == NULL) {
+        logit(WARN, "Could not allocate the slow operation log");
+        return;
+    }
+    pthread_key_create(&trace_key, free);
+    slowlog_size = logsize;
+    slow_us = (uint64_t)slowms * 1000;
+}
+
+static uint64_t now_us() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static struct trace * get_trace() {
+    struct trace * t = my_trace;
+
+    if(t || slow_us == 0)
+        return t;
+    if((t = calloc(1, sizeof(struct trace))) == NULL)
+        return NULL;
+    pthread_setspecific(trace_key, t);
+    my_trace = t;
+    return t;
+}
+
+// The trace the current operation is recording to, if it's recording.
+static struct trace * active_trace() {
+    struct trace * t = my_trace;
+    return t && t->active ? t : NULL;
+}
+
+/*
+ * Starts tracing an operation on path. Operations called from inside
+ * another one are part of its trace.
+ */
+void trace_begin(const char * op, const char * path) {
+    struct trace * t = get_trace();
+
+    if(!t || t->active++ > 0)
+        return;
+    t->op = op;
+    t->depth = 0;
+    t->nspans = 0;
+    t->dropped = 0;
+    t->docs = 0;
+    t->bytes = 0;
+    snprintf(t->path, sizeof(t->path), "%s", path ? path : "");
+    t->start_us = now_us();
+}
+
+static struct span * add_span(struct trace * t, const char * name,
+    uint64_t start) {
+    struct span * s;
+
+    if(t->nspans == MAX_SPANS) {
+        t->dropped++;
+        return NULL;
+    }
+    s = &t->spans[t->nspans++];
+    s->name = name;
+    s->depth = t->depth;
+    s->start_us = start;
+    s->dur_us = 0;
+    s->docs = 0;
+    s->bytes = 0;
+    return s;
+}
+
+// Opens a step of the current operation. Returns what to close it with.
+int span_begin(const char * name) {
+    struct trace * t = active_trace();
+    struct span * s;
+
+    if(!t)
+        return -1;
+    s = add_span(t, name, now_us());
+    t->depth++;
+    return s ? s - t->spans : -1;
+}
+
+void span_end(int span, uint64_t docs, uint64_t bytes) {
+    struct trace * t = active_trace();
+    struct span * s;
+
+    if(!t)
+        return;
+    t->depth--;
+    if(span < 0 || span >= t->nspans)
+        return;
+    s = &t->spans[span];
+    s->dur_us = now_us() - s->start_us;
+    s->docs += docs;
+    s->bytes += bytes;
+}
+
+// Records a call that's already finished as a step with nothing under it.
+void trace_call(const char * name, uint64_t start, uint64_t elapsed) {
+    struct trace * t = active_trace();
+    struct span * s;
+
+    if(!t)
+        return;
+    if((s = add_span(t, name, start)) != NULL) {
+        s->dur_us = elapsed;
+        s->docs = t->docs;
+        s->bytes = t->bytes;
+    }
+    t->docs = 0;
+    t->bytes = 0;
+}
+
+// Counts documents and bytes against the call that's being timed.
+void trace_docs(uint64_t docs, uint64_t bytes) {
+    struct trace * t = active_trace();
+
+    if(!t)
+        return;
+    t->docs += docs;
+    t->bytes += bytes;
+}
+
+static size_t entry_printf(char * out, size_t len, const char * fmt, ...) {
+    va_list ap;
+    int n;
+
+    if(len >= SLOWLOG_ENTRY_MAX)
+        return len;
+    va_start(ap, fmt);
+    n = vsnprintf(out + len, SLOWLOG_ENTRY_MAX - len, fmt, ap);
+    va_end(ap);
+    if(n < 0)
+        return len;
+    return len + n < SLOWLOG_ENTRY_MAX ? len + n : SLOWLOG_ENTRY_MAX - 1;
+}
+
+static char * format_trace(struct trace * t, uint64_t elapsed, int res) {
+    char * out = malloc(SLOWLOG_ENTRY_MAX);
+    char when[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    size_t len = 0;
+    int i;
+
+    if(!out)
+        return NULL;
+    localtime_r(&now, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    len = entry_printf(out, len, "%s %s %s %.3f ms res=%d\n", when, t->op,
+        t->path, elapsed / 1000.0, res);
+    for(i = 0; i < t->nspans; i++) {
+        const struct span * s = &t->spans[i];
+        len = entry_printf(out, len, "  %*s%s +%.3f ms %.3f ms",
+            s->depth * 2, "", s->name, (s->start_us - t->start_us) / 1000.0,
+            s->dur_us / 1000.0);
+        if(s->docs)
+            len = entry_printf(out, len, " docs=%llu",
+                (unsigned long long)s->docs);
+        if(s->bytes)
+            len = entry_printf(out, len, " bytes=%llu",
+                (unsigned long long)s->bytes);
+        len = entry_printf(out, len, "\n");
+    }
+    if(t->dropped)
+        len = entry_printf(out, len, "  ... %d more\n", t->dropped);
+    entry_printf(out, len, "\n");
+    return out;
+}
+
+// Finishes the operation, and logs it if it was slow.
+void trace_end(int res) {
+    struct trace * t = active_trace();
+    uint64_t elapsed;
+    char * entry;
+
+    if(!t || --t->active > 0)
+        return;
+    elapsed = now_us() - t->start_us;
+    if(elapsed < slow_us || (entry = format_trace(t, elapsed, res)) == NULL)
+        return;
+
+    pthread_mutex_lock(&slowlog_lock);
+    free(slowlog[slowlog_next]);
+    slowlog[slowlog_next] = entry;
+    slowlog_next = (slowlog_next + 1) % slowlog_size;
+    slowlog_total++;
+    pthread_mutex_unlock(&slowlog_lock);
+}
+
+/*
+ * Copies the slow operation log out, oldest first, into a buffer the
+ * caller frees.
+ */
+char * dump_slowlog(size_t * outlen) {
+    size_t i, len = 0, cap = 64;
+    char * out;
+
+    pthread_mutex_lock(&slowlog_lock);
+    for(i = 0; i < slowlog_size; i++) {
+        if(slowlog[i])
+            cap += strlen(slowlog[i]);
+    }
+    if((out = malloc(cap)) == NULL) {
+        pthread_mutex_unlock(&slowlog_lock);
+        return NULL;
+    }
+    if(slow_us == 0)
+        len = snprintf(out, cap, "slow operation log is off\n");
+    else if(slowlog_total > slowlog_size)
+        len = snprintf(out, cap, "%llu earlier slow operations dropped\n\n",
+            (unsigned long long)(slowlog_total - slowlog_size));
+    for(i = 0; i < slowlog_size; i++) {
+        const char * entry = slowlog[(slowlog_next + i) % slowlog_size];
+        if(entry) {
+            strcpy(out + len, entry);
+            len += strlen(entry);
+        }
+    }
+    pthread_mutex_unlock(&slowlog_lock);
+    *outlen = len;
+    return out;
+}
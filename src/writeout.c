@@ -0,0 +1,97 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "mongo-fuse.h"
+
+/*
+ * Background write-out of extents. Writes only put their enodes in
+ * wr_extent, which is written out by a later write, a truncate, or
+ * flush and release. A file that's written and then held open without
+ * being touched could keep enodes there indefinitely, and garbage
+ * collection only knows about blocks that extent documents refer to,
+ * so once gc_grace passed their blocks could be removed out from under
+ * it.
+ *
+ * Every open file is kept on a list, and every writeout_interval seconds
+ * a background thread writes out the extents of any file that hasn't
+ * had them written for that long. The list lock is held while it does,
+ * so a file can't be released in the middle of it.
+ */
+
+static struct inode * open_head = NULL;
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+static int writeout_interval = 0;
+
+uint64_t writeouts = 0;
+
+void setup_writeout(int interval) {
+    writeout_interval = interval;
+}
+
+void note_inode_open(struct inode * e) {
+    pthread_mutex_lock(&open_lock);
+    e->open_prev = NULL;
+    e->open_next = open_head;
+    if(open_head)
+        open_head->open_prev = e;
+    open_head = e;
+    pthread_mutex_unlock(&open_lock);
+}
+
+void note_inode_closed(struct inode * e) {
+    pthread_mutex_lock(&open_lock);
+    if(e->open_prev)
+        e->open_prev->open_next = e->open_next;
+    else if(open_head == e)
+        open_head = e->open_next;
+    if(e->open_next)
+        e->open_next->open_prev = e->open_prev;
+    e->open_next = e->open_prev = NULL;
+    pthread_mutex_unlock(&open_lock);
+}
+
+static void writeout_pass() {
+    struct inode * e;
+    time_t now = time(NULL);
+    int res;
+
+    pthread_mutex_lock(&open_lock);
+    for(e = open_head; e; e = e->open_next) {
+        pthread_mutex_lock(&e->wr_lock);
+        if(e->wr_extent && e->wr_extent->nnodes > 0 &&
+            now - e->wr_age >= writeout_interval) {
+            if((res = serialize_extent(e, e->wr_extent)) != 0) {
+                char oidstr[25];
+                bson_oid_to_string(&e->oid, oidstr);
+                logit(WARN, "Error writing out extents for %s: %d",
+                    oidstr, res);
+            }
+            else
+                __sync_fetch_and_add(&writeouts, 1);
+            e->wr_age = now;
+        }
+        pthread_mutex_unlock(&e->wr_lock);
+    }
+    pthread_mutex_unlock(&open_lock);
+}
+
+static void * writeout_worker(void * p) {
+    for(;;) {
+        sleep(writeout_interval);
+        writeout_pass();
+    }
+    return NULL;
+}
+
+void start_writeout() {
+    pthread_t thread;
+
+    if(writeout_interval == 0)
+        return;
+    if(pthread_create(&thread, NULL, writeout_worker, NULL) != 0) {
+        logit(WARN, "Could not start extent write-out thread");
+        return;
+    }
+    pthread_detach(thread);
+}
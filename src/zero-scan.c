@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+#include "mongo-fuse.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/*
+ * Finds the first and last non-zero bytes of a block so the zeros on
+ * either end don't have to be stored. start is the offset of the first
+ * non-zero byte and end is one past the last one; a block that's all
+ * zeros gets 0 for both. The forward scan stops at the first non-zero
+ * byte and the backward scan stops there too, so every byte is looked
+ * at once at most.
+ *
+ * There's a version for each vector width. setup_zero_scan picks the
+ * widest one the CPU supports.
+ */
+
+static void scan_scalar(const char * buf, size_t len,
+    size_t * pstart, size_t * pend) {
+    size_t i = 0, j = len;
+    uint64_t w;
+
+    for(; i + 8 <= len; i += 8) {
+        memcpy(&w, buf + i, 8);
+        if(w)
+            break;
+    }
+    for(; i < len && buf[i] == 0; i++);
+    if(i == len) {
+        *pstart = *pend = 0;
+        return;
+    }
+
+    for(; j >= i + 8; j -= 8) {
+        memcpy(&w, buf + j - 8, 8);
+        if(w)
+            break;
+    }
+    for(; j > i && buf[j - 1] == 0; j--);
+
+    *pstart = i;
+    *pend = j;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void scan_sse2(const char * buf, size_t len,
+    size_t * pstart, size_t * pend) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0, j = len;
+    uint32_t nz;
+
+    for(; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(buf + i));
+        nz = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) & 0xffff;
+        if(nz) {
+            i += __builtin_ctz(nz);
+            goto found;
+        }
+    }
+    for(; i < len && buf[i] == 0; i++);
+    if(i == len) {
+        *pstart = *pend = 0;
+        return;
+    }
+
+found:
+    for(; j >= i + 16; j -= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(buf + j - 16));
+        nz = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) & 0xffff;
+        if(nz) {
+            j = j - 16 + 32 - __builtin_clz(nz);
+            goto done;
+        }
+    }
+    for(; j > i && buf[j - 1] == 0; j--);
+
+done:
+    *pstart = i;
+    *pend = j;
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(const char * buf, size_t len,
+    size_t * pstart, size_t * pend) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0, j = len;
+    uint32_t nz;
+
+    for(; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(buf + i));
+        nz = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, zero));
+        if(nz) {
+            i += __builtin_ctz(nz);
+            goto found;
+        }
+    }
+    for(; i < len && buf[i] == 0; i++);
+    if(i == len) {
+        *pstart = *pend = 0;
+        return;
+    }
+
+found:
+    for(; j >= i + 32; j -= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(buf + j - 32));
+        nz = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, zero));
+        if(nz) {
+            j -= __builtin_clz(nz);
+            goto done;
+        }
+    }
+    for(; j > i && buf[j - 1] == 0; j--);
+
+done:
+    *pstart = i;
+    *pend = j;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void scan_avx512(const char * buf, size_t len,
+    size_t * pstart, size_t * pend) {
+    size_t i = 0, j = len;
+    uint64_t nz;
+
+    for(; i + 64 <= len; i += 64) {
+        __m512i x = _mm512_loadu_si512((const void*)(buf + i));
+        nz = _mm512_test_epi8_mask(x, x);
+        if(nz) {
+            i += __builtin_ctzll(nz);
+            goto found;
+        }
+    }
+    for(; i < len && buf[i] == 0; i++);
+    if(i == len) {
+        *pstart = *pend = 0;
+        return;
+    }
+
+found:
+    for(; j >= i + 64; j -= 64) {
+        __m512i x = _mm512_loadu_si512((const void*)(buf + j - 64));
+        nz = _mm512_test_epi8_mask(x, x);
+        if(nz) {
+            j -= __builtin_clzll(nz);
+            goto done;
+        }
+    }
+    for(; j > i && buf[j - 1] == 0; j--);
+
+done:
+    *pstart = i;
+    *pend = j;
+}
+
+static int have_sse2() {
+    return __builtin_cpu_supports("sse2");
+}
+
+static int have_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+static int have_avx512() {
+    return __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+static int have_scalar() {
+    return 1;
+}
+
+// Widest first, so setup_zero_scan can take the first one supported.
+const struct zero_scan_kernel zero_scan_kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx512bw", have_avx512, scan_avx512 },
+    { "avx2", have_avx2, scan_avx2 },
+    { "sse2", have_sse2, scan_sse2 },
+#endif
+    { "scalar", have_scalar, scan_scalar },
+    { NULL, NULL, NULL }
+};
+
+static zero_scan_fn scan_impl = scan_scalar;
+
+const char * setup_zero_scan() {
+    const struct zero_scan_kernel * k;
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+#endif
+    for(k = zero_scan_kernels; k->name; k++) {
+        if(k->supported()) {
+            scan_impl = k->scan;
+            return k->name;
+        }
+    }
+    return "scalar";
+}
+
+void zero_scan(const char * buf, size_t len, size_t * start, size_t * end) {
+    scan_impl(buf, len, start, end);
+}
+
+/*
+ * Finds the first run of at least minrun zero bytes in buf between start
+ * and end that's made of whole grain sized pieces. base is the file
+ * offset of buf, so the pieces line up with the file rather than the
+ * buffer. Returns 1 and the run in runstart and runend if there is one.
+ * Pieces with data in them are usually rejected at their first byte, so
+ * this is cheap on dense blocks.
+ */
+int find_zero_run(const char * buf, off_t base, size_t start, size_t end,
+    size_t grain, size_t minrun, size_t * runstart, size_t * runend) {
+    size_t cur = start + (grain - (base + start) % grain) % grain;
+    size_t run = cur, s, e;
+
+    for(; cur + grain <= end; cur += grain) {
+        scan_impl(buf + cur, grain, &s, &e);
+        if(e == 0)
+            continue;
+        if(cur - run >= minrun)
+            break;
+        run = cur + grain;
+    }
+    if(cur <= run || cur - run < minrun)
+        return 0;
+    *runstart = run;
+    *runend = cur;
+    return 1;
+}